@@ -16,6 +16,12 @@
 
 
 import asyncio
+import mmap
+import os
+import re
+import socket
+import struct
+import sys
 import types
 from datetime import datetime
 import time
@@ -25,38 +31,73 @@ TRACEPOINT_LIST_REPLY = int(2).to_bytes(2, 'big')
 TRACEPOINT_ENABLE_REQUEST = int(3).to_bytes(2, 'big')
 TRACEPOINT_DISABLE_REQUEST = int(4).to_bytes(2, 'big')
 TRACE_PUSH = int(5).to_bytes(2, 'big')
+FORMAT_STRING_LIST = int(6).to_bytes(2, 'big')
+TRACE_PUSH_FORMATTED = int(7).to_bytes(2, 'big')
+CLOCK_CALIBRATION = int(8).to_bytes(2, 'big')
+DROP_REPORT = int(9).to_bytes(2, 'big')
+TRACEPOINT_ID_LIST = int(10).to_bytes(2, 'big')
+TRACE_PUSH_DELTA = int(11).to_bytes(2, 'big')
+TRACE_BLOB = int(12).to_bytes(2, 'big')
+SHM_REQUEST = int(13).to_bytes(2, 'big')
+SHM_REPLY = int(14).to_bytes(2, 'big')
+FLIGHT_RECORDER_REQUEST = int(15).to_bytes(2, 'big')
+FLIGHT_RECORDER_END = int(16).to_bytes(2, 'big')
+# Header flags selecting the record encoding of TRACE_PUSH: tracepoint IDs
+# instead of names, and varints with timestamp differences
+FLAG_TRACEPOINT_IDS = 0x0001
+FLAG_COMPACT_RECORDS = 0x0002
+# Set by the tracer on LZ4 compressed frames, if the client allows it
+FLAG_COMPRESSED = 0x0004
 MAGIC_NO = bytearray('RuSt'.encode('utf-8'))
 
+# One printf conversion: flags, width, precision, length modifier, specifier
+FMT_CONVERSION = re.compile(r"%([-+ #0']*)(\*|\d+)?(?:\.(\*|\d*))?"
+                            r"(hh|h|ll|l|j|z|t|L)?([diouxXcpeEfFgGaAsn%])")
+
 
 class Tracy(asyncio.Protocol):
     def __init__(self, on_con_lost, loop):
         self.loop = loop
         self.on_con_lost = on_con_lost
         self.tracepoints = []
+        self.formats = {}
+        # Tracepoint names by ID, see FLAG_TRACEPOINT_IDS
+        self.ids = {}
+        # (ticks, epoch_ns, ticks_per_sec) if the tracer uses another clock
+        # than the realtime clock
+        self.calibration = None
+        # Last decoded payload by tracepoint name, see TRACE_PUSH_DELTA
+        self.delta_payloads = {}
+        # Blobs being reassembled, by blob ID
+        self.blobs = {}
         rec_messages = []
         self.all_tracepoints_enabled = False
         self.print_calls = 0
 
-    def generate_header(self, cmd, msg_len):
-        return MAGIC_NO + cmd + msg_len.to_bytes(4, 'big')
+    def generate_header(self, cmd, msg_len, flags=0):
+        return (MAGIC_NO + flags.to_bytes(2, 'big') + cmd +
+                msg_len.to_bytes(4, 'big'))
 
     def parse_header(self, head, total_len):
         magic = head[0:4]
-        flags = head[4:6]
+        flags = int.from_bytes(head[4:6], 'big')
         cmd = head[6:8]
         rec_len = int.from_bytes(head[8:], 'big')
 
         if magic != MAGIC_NO:
             print("Magic Number " + str(magic) + " invalid.")
-            return (None, 0)
+            return (None, 0, 0)
 
         if total_len != rec_len + 12:
-            return (None, 0)
+            return (None, 0, 0)
 
-        if cmd == TRACE_PUSH or cmd == TRACEPOINT_LIST_REPLY:
-            return (cmd, rec_len)
+        if cmd in (TRACE_PUSH, TRACEPOINT_LIST_REPLY, FORMAT_STRING_LIST,
+                   TRACE_PUSH_FORMATTED, CLOCK_CALIBRATION, DROP_REPORT,
+                   TRACEPOINT_ID_LIST, TRACE_PUSH_DELTA, TRACE_BLOB,
+                   FLIGHT_RECORDER_END):
+            return (cmd, rec_len, flags)
         else:
-            return (None, 0)
+            return (None, 0, 0)
 
     def generate_enable_msg(self, tracepoints):
         total_len = 0
@@ -81,8 +122,10 @@ class Tracy(asyncio.Protocol):
         msg = self.generate_tracepoint_list_request_msg()
         self.transport.write(msg)
 
+    # Also asks for the most compact record encoding
     def generate_tracepoint_list_request_msg(self):
-        return self.generate_header(TRACEPOINT_LIST_REQUEST, 0)
+        return self.generate_header(TRACEPOINT_LIST_REQUEST, 0,
+                FLAG_TRACEPOINT_IDS | FLAG_COMPACT_RECORDS | FLAG_COMPRESSED)
 
     def enable_tracepoints(self, transport, tracepoints):
         msg = self.generate_enable_msg(tracepoints)
@@ -98,7 +141,7 @@ class Tracy(asyncio.Protocol):
                 'payload: ' + str(message.payload))
 
     def pretty_timestamp(self, tstamp):
-        timestamp = int.from_bytes(tstamp, 'big')
+        timestamp = self.to_epoch_ns(int.from_bytes(tstamp, 'big'))
 
         # TODO: Do we want to see UTC or localtime?
         date = datetime.fromtimestamp(timestamp // 1e9)
@@ -107,6 +150,13 @@ class Tracy(asyncio.Protocol):
         s += '.' + str(int(timestamp % int(1e9))).zfill(6)
         return s
 
+    def to_epoch_ns(self, timestamp):
+        if self.calibration is None:
+            return timestamp
+
+        ticks, epoch_ns, ticks_per_sec = self.calibration
+        return epoch_ns + (timestamp - ticks) * int(1e9) // ticks_per_sec
+
     # Currently we're assuming that parse_data is only ever called when a
     # TRACE_PUSH arrives
     def parse_data(self, data):
@@ -115,35 +165,113 @@ class Tracy(asyncio.Protocol):
             header = data[offset:offset + 12]
 
             # Get command number. None if header was invalid
-            cmd, tracer_msg_len = self.parse_header(header, len(data))
+            cmd, tracer_msg_len, flags = self.parse_header(header, len(data))
             offset += 12
             if cmd is None:
                 break
 
             if cmd == TRACE_PUSH:
-                offset = self.parse_trace_push_msg(data, tracer_msg_len, offset)
+                offset = self.parse_trace_push_msg(data, tracer_msg_len, offset,
+                        flags)
             elif cmd == TRACEPOINT_LIST_REPLY:
                 offset = self.parse_tracepoint_list_msg(data, tracer_msg_len,
                         offset)
+            elif cmd == FORMAT_STRING_LIST:
+                offset = self.parse_format_string_list_msg(data,
+                        tracer_msg_len, offset)
+            elif cmd == CLOCK_CALIBRATION:
+                # Clock ID at offset 0 is informational only
+                self.calibration = (
+                        int.from_bytes(data[offset + 2:offset + 10], 'big'),
+                        int.from_bytes(data[offset + 10:offset + 18], 'big'),
+                        int.from_bytes(data[offset + 18:offset + 26], 'big'))
+                offset += tracer_msg_len
+            elif cmd == TRACEPOINT_ID_LIST:
+                offset = self.parse_tracepoint_id_list_msg(data,
+                        tracer_msg_len, offset)
+            elif cmd == DROP_REPORT:
+                offset = self.parse_drop_report_msg(data, tracer_msg_len,
+                        offset)
+            elif cmd == FLIGHT_RECORDER_END:
+                # The records before were recorded, not live
+                records = int.from_bytes(data[offset:offset + 4], 'big')
+                overwritten = int.from_bytes(data[offset + 4:offset + 12],
+                        'big')
+                print('Flight recorder: ' + str(records) + ' record(s), ' +
+                        str(overwritten) + ' overwritten before')
+                offset += tracer_msg_len
+            elif cmd == TRACE_PUSH_FORMATTED:
+                first = len(self.rec_messages)
+                offset = self.parse_trace_push_msg(data, tracer_msg_len, offset,
+                        flags)
+                for message in self.rec_messages[first:]:
+                    message.payload = self.format_payload(message.payload)
+            elif cmd == TRACE_BLOB:
+                offset = self.parse_blob_msg(data, tracer_msg_len, offset,
+                        flags)
+            elif cmd == TRACE_PUSH_DELTA:
+                first = len(self.rec_messages)
+                offset = self.parse_trace_push_msg(data, tracer_msg_len, offset,
+                        flags)
+                for message in self.rec_messages[first:]:
+                    message.payload = self.decode_delta(message.name,
+                            message.payload)
+
+    def parse_trace_push_msg(self, data, tracer_msg_len, offset, flags=0):
+        # Uncompressed length, then the LZ4 block
+        if flags & FLAG_COMPRESSED:
+            body = self.lz4_decompress(data[offset + 4:offset + tracer_msg_len])
+            self.parse_trace_push_msg(body, len(body), 0,
+                    flags & ~FLAG_COMPRESSED)
+            return offset + tracer_msg_len
 
-    def parse_trace_push_msg(self, data, tracer_msg_len, offset):
         parsed = 0
         old_offset = offset
+        ids = flags & FLAG_TRACEPOINT_IDS != 0
+        compact = flags & FLAG_COMPACT_RECORDS != 0
+
+        # Compact frames start with the base timestamp
+        if compact:
+            prev = int.from_bytes(data[offset:offset + 8], 'big')
+            offset += 8
+            parsed += 8
+            old_offset = offset
 
         while parsed < tracer_msg_len:
             message = types.SimpleNamespace()
-            tp_name_len = self.sub_msg_len(data, offset)
-            offset += 2
-
-            message.name = data[offset:offset + tp_name_len]
-            offset += tp_name_len
+            if ids:
+                if compact:
+                    tp_id, offset = self.varint(data, offset)
+                else:
+                    tp_id = self.sub_msg_len(data, offset)
+                    offset += 2
+                message.name = self.ids.get(tp_id, b'<unknown id %d>' % tp_id)
+            else:
+                if compact:
+                    tp_name_len, offset = self.varint(data, offset)
+                else:
+                    tp_name_len = self.sub_msg_len(data, offset)
+                    offset += 2
+
+                message.name = data[offset:offset + tp_name_len]
+                offset += tp_name_len
 
             # TODO: Parse timestamp into other data structure
-            message.timestamp = data[offset:offset + 8]
-            offset += 8
-
-            data_len = self.sub_msg_len(data, offset)
-            offset += 2
+            if compact:
+                delta, offset = self.varint(data, offset)
+                # Zigzag encoded, records may be slightly out of order
+                delta = (delta >> 1) ^ -(delta & 1)
+                prev = (prev + delta) % (1 << 64)
+                message.timestamp = prev.to_bytes(8, 'big')
+            else:
+                message.timestamp = data[offset:offset + 8]
+                offset += 8
+
+            if compact:
+                data_len, offset = self.varint(data, offset)
+            else:
+                data_len = self.sub_msg_len(data, offset)
+                offset += 2
             message.payload = data[offset:offset + data_len]
             offset += data_len
 
@@ -154,6 +282,41 @@ class Tracy(asyncio.Protocol):
 
         return offset
 
+    # One chunk of a blob. The message is complete with its last chunk.
+    def parse_blob_msg(self, data, tracer_msg_len, offset, flags=0):
+        end = offset + tracer_msg_len
+        blob_id = int.from_bytes(data[offset:offset + 4], 'big')
+        total_len = int.from_bytes(data[offset + 4:offset + 8], 'big')
+        chunk_offset = int.from_bytes(data[offset + 8:offset + 12], 'big')
+        offset += 12
+
+        if chunk_offset == 0:
+            message = types.SimpleNamespace()
+            if flags & FLAG_TRACEPOINT_IDS:
+                tp_id = self.sub_msg_len(data, offset)
+                offset += 2
+                message.name = self.ids.get(tp_id, b'<unknown id %d>' % tp_id)
+            else:
+                tp_name_len = self.sub_msg_len(data, offset)
+                offset += 2
+                message.name = data[offset:offset + tp_name_len]
+                offset += tp_name_len
+            message.timestamp = data[offset:offset + 8]
+            offset += 8
+            message.payload = bytearray()
+            self.blobs[blob_id] = message
+
+        # Chunks not continuing a known blob are skipped
+        message = self.blobs.get(blob_id)
+        if message is not None and len(message.payload) == chunk_offset:
+            message.payload += data[offset:end]
+            if len(message.payload) == total_len:
+                message.payload = bytes(message.payload)
+                self.rec_messages.append(message)
+                del self.blobs[blob_id]
+
+        return end
+
     def parse_tracepoint_list_msg(self, data, tracer_msg_len, offset):
         parsed = 0
         old_offset = offset
@@ -175,6 +338,191 @@ class Tracy(asyncio.Protocol):
         self.all_tracepoints_enabled = False
         return offset
 
+    def parse_format_string_list_msg(self, data, tracer_msg_len, offset):
+        end = offset + tracer_msg_len
+
+        while offset < end:
+            fmt_id = self.sub_msg_len(data, offset)
+            offset += 2
+            fmt_len = self.sub_msg_len(data, offset)
+            offset += 2
+
+            self.formats[fmt_id] = data[offset:offset + fmt_len].decode(
+                    'utf-8', 'replace')
+            offset += fmt_len
+
+        return offset
+
+    def parse_tracepoint_id_list_msg(self, data, tracer_msg_len, offset):
+        end = offset + tracer_msg_len
+
+        while offset < end:
+            tp_id = self.sub_msg_len(data, offset)
+            offset += 2
+            tp_name_len = self.sub_msg_len(data, offset)
+            offset += 2
+
+            self.ids[tp_id] = data[offset:offset + tp_name_len]
+            offset += tp_name_len
+
+        return offset
+
+    def parse_drop_report_msg(self, data, tracer_msg_len, offset):
+        end = offset + tracer_msg_len
+
+        while offset < end:
+            tp_name_len = self.sub_msg_len(data, offset)
+            offset += 2
+            tracepoint = data[offset:offset + tp_name_len].decode('ascii')
+            offset += tp_name_len
+            dropped = int.from_bytes(data[offset:offset + 8], 'big')
+            offset += 8
+
+            print('TP: ' + tracepoint + ' | dropped ' + str(dropped) +
+                    ' record(s)')
+
+        return offset
+
+    # Formats the arguments of a deferred printf the way the C side would
+    def format_payload(self, payload):
+        fmt_id = self.sub_msg_len(payload, 0)
+        fmt = self.formats.get(fmt_id)
+        if fmt is None:
+            return 'unknown format ' + str(fmt_id) + ': ' + str(payload[2:])
+
+        args = payload[2:]
+        pos = 0
+        out = ''
+        last = 0
+
+        def next_int(signed=True):
+            nonlocal pos
+            if pos + 8 > len(args):
+                raise IndexError
+            val = int.from_bytes(args[pos:pos + 8], 'big', signed=signed)
+            pos += 8
+            return val
+
+        for conv in FMT_CONVERSION.finditer(fmt):
+            out += fmt[last:conv.start()]
+            last = conv.end()
+            flags, width, prec, _, spec = conv.groups()
+
+            if spec == '%':
+                out += '%'
+                continue
+            if spec == 'n':
+                continue
+
+            try:
+                if width == '*':
+                    width = str(next_int())
+                if prec == '*':
+                    prec = str(next_int())
+
+                if spec in 'di':
+                    val = next_int()
+                elif spec in 'ouxX':
+                    val = next_int(signed=False)
+                elif spec == 'c':
+                    val = chr(next_int(signed=False) & 0xff)
+                    spec = 's'
+                elif spec == 'p':
+                    val = hex(next_int(signed=False))
+                    spec = 's'
+                elif spec in 'aA':
+                    val = struct.unpack('>d', args[pos:pos + 8])[0].hex()
+                    pos += 8
+                    spec = 's'
+                elif spec == 's':
+                    str_len = self.sub_msg_len(args, pos)
+                    val = args[pos + 2:pos + 2 + str_len].decode('utf-8',
+                            'replace')
+                    pos += 2 + str_len
+                else:
+                    if pos + 8 > len(args):
+                        raise IndexError
+                    val = struct.unpack('>d', args[pos:pos + 8])[0]
+                    pos += 8
+            except IndexError:
+                # Arguments were cut off, leave the rest unformatted
+                return out + fmt[conv.start():]
+
+            spec_fmt = '%' + flags.replace("'", '') + (width or '')
+            if prec is not None:
+                spec_fmt += '.' + prec
+            out += (spec_fmt + spec) % val
+
+        return out + fmt[last:]
+
+    # Keyframes carry the payload, deltas the XOR against the previous payload
+    # of the tracepoint as (unchanged count, length, bytes) runs
+    def decode_delta(self, name, data):
+        if data[0] == 0:
+            payload = bytearray(data[1:])
+        else:
+            payload = bytearray(self.delta_payloads.get(name, b''))
+            i = 1
+            pos = 0
+            while i < len(data):
+                zeros, i = self.varint(data, i)
+                length, i = self.varint(data, i)
+                pos += zeros
+                for k in range(length):
+                    payload[pos + k] ^= data[i + k]
+                pos += length
+                i += length
+
+        self.delta_payloads[name] = bytes(payload)
+        return bytes(payload)
+
+    def lz4_decompress(self, block):
+        out = bytearray()
+        i = 0
+        while i < len(block):
+            token = block[i]
+            i += 1
+
+            literal_len, i = self.lz4_length(block, i, token >> 4)
+            out += block[i:i + literal_len]
+            i += literal_len
+            # The last sequence has no match
+            if i >= len(block):
+                break
+
+            match_offset = int.from_bytes(block[i:i + 2], 'little')
+            i += 2
+            match_len, i = self.lz4_length(block, i, token & 0xf)
+
+            # Matches may overlap with what they produce
+            start = len(out) - match_offset
+            for k in range(match_len + 4):
+                out.append(out[start + k])
+
+        return bytes(out)
+
+    def lz4_length(self, block, i, length):
+        if length == 15:
+            while True:
+                byte = block[i]
+                i += 1
+                length += byte
+                if byte != 255:
+                    break
+        return (length, i)
+
+    # LEB128, returns the value and the offset behind it
+    def varint(self, data, offset):
+        value = 0
+        shift = 0
+        while True:
+            byte = data[offset]
+            offset += 1
+            value |= (byte & 0x7f) << shift
+            shift += 7
+            if byte & 0x80 == 0:
+                return (value, offset)
+
     def sub_msg_len(self, data, offset):
         return int.from_bytes(data[offset:offset+2], 'big')
 
@@ -205,6 +553,97 @@ class Tracy(asyncio.Protocol):
         self.rec_messages = []
 
 
+# Asks the tracer to send through a shared-memory ring instead of the unix
+# socket, see SHM_REQUEST. Returns the ring, or None if the tracer refused,
+# and the frames which arrived on the socket before the reply.
+def request_shm(sock):
+    sock.sendall(MAGIC_NO + bytes(2) + SHM_REQUEST + bytes(4))
+    frames = []
+    while True:
+        header, fds = recv_exact(sock, 12)
+        payload, more_fds = recv_exact(sock,
+                                       int.from_bytes(header[8:], 'big'))
+        fds += more_fds
+        if header[6:8] != SHM_REPLY:
+            frames.append(header + payload)
+            continue
+
+        capacity = int.from_bytes(payload, 'big')
+        if capacity == 0 or not fds:
+            return (None, frames)
+        return (ShmRing(fds[0], capacity), frames)
+
+
+# Also collects file descriptors passed along
+def recv_exact(sock, length):
+    data = b''
+    fds = []
+    while len(data) < length:
+        chunk, ancdata, _, _ = sock.recvmsg(length - len(data),
+                                            socket.CMSG_SPACE(4))
+        if not chunk:
+            raise ConnectionError('The Tracer closed the connection')
+        data += chunk
+        for level, kind, cdata in ancdata:
+            if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                fds.append(int.from_bytes(cdata[:4], sys.byteorder))
+    return (data, fds)
+
+
+# The client's side of the ring, see SHM_REPLY for the layout. Python can't
+# do acquire and release, which the plain loads and stores are on x86.
+class ShmRing:
+    def __init__(self, fd, capacity):
+        self.map = mmap.mmap(fd, 128 + capacity)
+        os.close(fd)
+        self.capacity = capacity
+
+    # The bytes written since the last call
+    def read(self):
+        head = struct.unpack_from('=Q', self.map, 0)[0]
+        tail = struct.unpack_from('=Q', self.map, 64)[0]
+        start = 128 + tail % self.capacity
+        length = head - tail
+        first = min(length, 128 + self.capacity - start)
+        data = self.map[start:start + first] + self.map[128:128 + length - first]
+        struct.pack_into('=Q', self.map, 64, head)
+        return data
+
+
+# Splits the stream in the ring into frames, as parse_data expects them
+async def poll_shm(ring, protocol, on_con_lost):
+    stream = b''
+    while not on_con_lost.done():
+        stream += ring.read()
+        while len(stream) >= 12:
+            frame_len = 12 + int.from_bytes(stream[8:12], 'big')
+            if len(stream) < frame_len:
+                break
+            protocol.data_received(stream[:frame_len])
+            stream = stream[frame_len:]
+        await asyncio.sleep(0.001)
+
+
+# Prints the records in the files of a file sink, see tracy_open_file_sink.
+# They hold the frames a connection would carry; pass the oldest file first.
+def read_trace_files(paths):
+    protocol = Tracy(None, None)
+    protocol.rec_messages = []
+    for path in paths:
+        with open(path, 'rb') as f:
+            stream = f.read()
+        offset = 0
+        # A frame cut off at the end, e.g. by a crash, is skipped
+        while len(stream) - offset >= 12:
+            frame_len = 12 + int.from_bytes(stream[offset + 8:offset + 12],
+                    'big')
+            if len(stream) - offset < frame_len:
+                break
+            protocol.parse_data(stream[offset:offset + frame_len])
+            offset += frame_len
+        protocol.print_all_messages_in_buf()
+
+
 async def main():
     # Get a reference to the event loop as we plan to use
     # low-level APIs.
@@ -212,9 +651,29 @@ async def main():
 
     on_con_lost = loop.create_future()
 
-    transport, protocol = await loop.create_connection(
-        lambda: Tracy(on_con_lost, loop),
-        'localhost', 61455)
+    if len(sys.argv) > 2 and sys.argv[1] == '--file':
+        read_trace_files(sys.argv[2:])
+        return
+
+    # An argument like @tracy-1234-app selects the tracer's unix socket,
+    # see TRACY_INIT_UNIX_SOCKET. Abstract names start with a 0 byte. With
+    # --shm after it, the data is received through shared memory.
+    if len(sys.argv) > 1 and sys.argv[1].startswith('@'):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.connect('\0' + sys.argv[1][1:])
+        ring, frames = None, []
+        if '--shm' in sys.argv[2:]:
+            ring, frames = request_shm(sock)
+        transport, protocol = await loop.create_unix_connection(
+            lambda: Tracy(on_con_lost, loop), sock=sock)
+        for frame in frames:
+            protocol.data_received(frame)
+        if ring is not None:
+            loop.create_task(poll_shm(ring, protocol, on_con_lost))
+    else:
+        transport, protocol = await loop.create_connection(
+            lambda: Tracy(on_con_lost, loop),
+            'localhost', 61455)
 
     # Wait until the protocol signals that the connection
     # is lost and close the transport.
@@ -18,6 +18,7 @@
 #include <stdio.h> /* necessary for size_t */
 #include <stdbool.h>
 #include <stdarg.h>
+#include <sys/uio.h> /* struct iovec */
 
 /* You may change this constant */
 #define TRACY_MAX_SBMTPRNT_LEN 256
@@ -25,10 +26,34 @@
 /* DO NOT CHANGE these constants. They can only be changed in lib.rs */
 #define TRACY_MAX_TRPT_NAME_LEN 32 /* Excluding terminating 0 */
 #define TRACY_MAX_SUBMIT_LEN = 2048
+#define TRACY_MAX_TRACEPOINTS 4096 /* Handles per tracer */
 
 #define TRACY_MCAST_DEFAULT_ADDR_V4 "224.0.0.1:64042"
 #define TRACY_MCAST_DEFAULT_ADDR_V6 "[ff02::1]:64042"
 
+#define TRACY_INIT_RING 0x1
+#define TRACY_INIT_THREAD_RINGS 0x2
+#define TRACY_INIT_CLOCK_MONOTONIC_RAW 0x4
+#define TRACY_INIT_CLOCK_MONOTONIC_COARSE 0x8
+#define TRACY_INIT_CLOCK_COUNTER 0x10
+#define TRACY_INIT_UNIX_SOCKET 0x20
+
+#define TRACY_OVERFLOW_DROP_NEWEST 0
+#define TRACY_OVERFLOW_DROP_OLDEST 1
+#define TRACY_OVERFLOW_BLOCK 2
+
+#define TRACY_SYNC_NEVER 0
+#define TRACY_SYNC_ROTATE 1
+#define TRACY_SYNC_FLUSH 2
+
+#define TRACY_BATCH_TIMESTAMP_EACH 0x1
+
+struct tracy_record {
+	int handle;
+	const void *data;
+	size_t data_len;
+};
+
 static inline void* tracy_init(const char *hostname,
 				  const char *process_name,
 				  unsigned buffer_flush_interval,
@@ -49,6 +74,32 @@ static inline void* tracy_init(const char *hostname,
 }
 
 
+struct tracy_config {
+	const char *hostname;
+	const char *process_name;
+	unsigned buffer_flush_interval;
+	unsigned announce_interval;
+	const char *announce_iface;
+	const char *announce_mcast_addr;
+	int flags;
+	size_t flush_threshold;
+	size_t max_submit_len;
+	size_t recv_buf_size;
+	size_t poll_events;
+	size_t ring_size;
+	size_t thread_ring_size;
+	size_t backlog_limit;
+	size_t max_clients;
+};
+
+static inline void *tracy_init_ex(const struct tracy_config *config)
+{
+	(void)config;
+
+	return NULL;
+}
+
+
 static inline void tracy_finit(void *tracer)
 {
 	(void)tracer;
@@ -57,6 +108,18 @@ static inline void tracy_finit(void *tracer)
 }
 
 
+static inline int tracy_set_budget(void *tracer, size_t bytes, int policy,
+                                   unsigned block_timeout_ms)
+{
+	(void)tracer;
+	(void)bytes;
+	(void)policy;
+	(void)block_timeout_ms;
+
+	return 0;
+}
+
+
 static inline int tracy_register(void *tracer, const char *tracepoint_name)
 {
 	(void)tracer;
@@ -66,6 +129,15 @@ static inline int tracy_register(void *tracer, const char *tracepoint_name)
 }
 
 
+static inline int tracy_register_h(void *tracer, const char *tracepoint_name)
+{
+	(void)tracer;
+	(void)tracepoint_name;
+
+	return 0;
+}
+
+
 static inline bool tracy_tracepoint_enabled(void *tracer,
 		const char *tracepoint_name)
 {
@@ -76,6 +148,107 @@ static inline bool tracy_tracepoint_enabled(void *tracer,
 }
 
 
+static inline bool tracy_enabled_h(void *tracer, int handle)
+{
+	(void)tracer;
+	(void)handle;
+
+	return false;
+}
+
+
+static inline int tracy_set_delta(void *tracer, int handle,
+                                  unsigned keyframe_interval)
+{
+	(void)tracer;
+	(void)handle;
+	(void)keyframe_interval;
+
+	return 0;
+}
+
+static inline int tracy_set_flight_recorder(void *tracer, size_t capacity)
+{
+	(void)tracer;
+	(void)capacity;
+
+	return 0;
+}
+
+static inline int tracy_set_recorded(void *tracer, int handle, bool recorded)
+{
+	(void)tracer;
+	(void)handle;
+	(void)recorded;
+
+	return 0;
+}
+
+struct tracy_file_sink {
+	const char *path;
+	size_t file_size;
+	unsigned max_files;
+	int sync;
+	bool compress;
+};
+
+static inline int tracy_open_file_sink(void *tracer,
+                                       const struct tracy_file_sink *sink)
+{
+	(void)tracer;
+	(void)sink;
+
+	return 0;
+}
+
+static inline int tracy_close_file_sink(void *tracer)
+{
+	(void)tracer;
+
+	return 0;
+}
+
+static inline int tracy_set_persisted(void *tracer, int handle, bool persisted)
+{
+	(void)tracer;
+	(void)handle;
+	(void)persisted;
+
+	return 0;
+}
+
+static inline int tracy_emergency_flush(void *tracer)
+{
+	(void)tracer;
+
+	return 0;
+}
+
+static inline int tracy_install_crash_handler(void *tracer)
+{
+	(void)tracer;
+
+	return 0;
+}
+
+
+static inline bool tracy_connected(void *tracer)
+{
+	(void)tracer;
+
+	return false;
+}
+
+
+static inline bool tracy_enabled_fast(void *tracer, int handle)
+{
+	(void)tracer;
+	(void)handle;
+
+	return false;
+}
+
+
 static inline void tracy_submit(void *tracer, const char *tracepoint_name,
 		const void *data, size_t data_len)
 {
@@ -88,6 +261,96 @@ static inline void tracy_submit(void *tracer, const char *tracepoint_name,
 }
 
 
+static inline void tracy_submit_h(void *tracer, int handle,
+		const void *data, size_t data_len)
+{
+	(void)tracer;
+	(void)handle;
+	(void)data;
+	(void)data_len;
+
+	return;
+}
+
+
+static inline int tracy_submit_blob(void *tracer, int handle,
+		const void *data, size_t data_len)
+{
+	(void)tracer;
+	(void)handle;
+	(void)data;
+	(void)data_len;
+
+	return 0;
+}
+
+
+static inline void tracy_submitv(void *tracer, const char *tracepoint_name,
+		const struct iovec *iov, int iovcnt)
+{
+	(void)tracer;
+	(void)tracepoint_name;
+	(void)iov;
+	(void)iovcnt;
+
+	return;
+}
+
+
+static inline void tracy_submitv_h(void *tracer, int handle,
+		const struct iovec *iov, int iovcnt)
+{
+	(void)tracer;
+	(void)handle;
+	(void)iov;
+	(void)iovcnt;
+
+	return;
+}
+
+
+static inline void tracy_submit_batch(void *tracer,
+		const struct tracy_record *recs, size_t n, int flags)
+{
+	(void)tracer;
+	(void)recs;
+	(void)n;
+	(void)flags;
+
+	return;
+}
+
+
+static inline void *tracy_reserve(void *tracer, const char *tracepoint_name,
+		size_t data_len)
+{
+	(void)tracer;
+	(void)tracepoint_name;
+	(void)data_len;
+
+	return NULL;
+}
+
+
+static inline void *tracy_reserve_h(void *tracer, int handle, size_t data_len)
+{
+	(void)tracer;
+	(void)handle;
+	(void)data_len;
+
+	return NULL;
+}
+
+
+static inline void tracy_commit(void *tracer, void *reservation)
+{
+	(void)tracer;
+	(void)reservation;
+
+	return;
+}
+
+
 static inline void tracy_submit_printf(void *tracer, const char *tracepoint_name,
 		const char *fmt, ...)
 {
@@ -98,4 +361,45 @@ static inline void tracy_submit_printf(void *tracer, const char *tracepoint_name
 	return;
 }
 
+
+static inline int tracy_register_fmt(void *tracer, const char *fmt)
+{
+	(void)tracer;
+	(void)fmt;
+
+	return -1;
+}
+
+
+static inline void tracy_submit_fmt_args(void *tracer, int handle, int fmt_id,
+		const void *args, size_t args_len)
+{
+	(void)tracer;
+	(void)handle;
+	(void)fmt_id;
+	(void)args;
+	(void)args_len;
+
+	return;
+}
+
+
+static inline void tracy_submit_fmt(void *tracer, int handle, int fmt_id,
+		const char *fmt, ...)
+{
+	(void)tracer;
+	(void)handle;
+	(void)fmt_id;
+	(void)fmt;
+
+	return;
+}
+
+
+#define TRACY_SUBMIT_FMT(tracer, handle, fmt, ...) \
+	do { \
+		(void)(tracer); \
+		(void)(handle); \
+	} while (0)
+
 #endif
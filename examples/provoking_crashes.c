@@ -25,6 +25,10 @@ int main(int argc, char *argv[])
 			"127.0.0.1", TRACY_MCAST_DEFAULT_ADDR_V4, 0);
 	/* You should check for error here... */
 
+	/* Whatever the tracer has not sent yet is sent before the crash takes
+	 * the application down */
+	tracy_install_crash_handler(tracer);
+
 	/* If "tracer" is invalid and not NULL, the program will crash here */
 	tracy_register(tracer, invalid_tp);
 
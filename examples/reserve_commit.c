@@ -0,0 +1,69 @@
+/*
+ * Copyright 2019, 2020 Rohde & Schwarz GmbH & Co KG
+ * 	philipp.stanner@rohde-schwarz.com
+ * 	hagen.pfeifer@rohde-schwarz.com
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/.
+ *
+ * This example shows how you serialize a payload directly into the tracer's
+ * memory, instead of preparing it in a buffer of your own and having
+ * tracy_submit copy it.
+ */
+
+#include "tracy.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define N_SAMPLES 500
+
+struct sensor_frame {
+	uint32_t sequence_no;
+	int16_t samples[N_SAMPLES];
+};
+
+static void serialize_frame(struct sensor_frame *frame, uint32_t sequence_no)
+{
+	frame->sequence_no = sequence_no;
+	for (int i = 0; i < N_SAMPLES; i++)
+		frame->samples[i] = (int16_t)(i * sequence_no);
+}
+
+int main(int argc, char *argv[])
+{
+	(void)argc;
+	/* The ring mode makes reservations point directly into the tracer's
+	 * submit ring */
+	void *tracer = tracy_init("Best-Radio", argv[0], 1000, 5000,
+			"127.0.0.1", TRACY_MCAST_DEFAULT_ADDR_V4, TRACY_INIT_RING);
+
+	if (tracer == NULL) {
+		fprintf(stderr, "Initializing tracer failed.\n");
+		return EXIT_FAILURE;
+	}
+
+	int tp_frames = tracy_register_h(tracer, "sensor_frames");
+	if (tp_frames < 0) {
+		tracy_finit(tracer);
+		return EXIT_FAILURE;
+	}
+
+	for (uint32_t i = 0; i < 100; i++) {
+		/* NULL if no client enabled the tracepoint: skip serializing */
+		struct sensor_frame *frame = tracy_reserve_h(tracer, tp_frames,
+				sizeof(*frame));
+		if (frame) {
+			serialize_frame(frame, i);
+			tracy_commit(tracer, frame);
+		}
+		usleep(100000);
+	}
+
+	tracy_finit(tracer);
+	tracer = NULL;
+
+	return EXIT_SUCCESS;
+}
@@ -28,6 +28,17 @@ local vs_types = {
     [0x03] = "Enable Request",
     [0x04] = "Disable Request",
     [0x05] = "Push",
+    [0x06] = "Format String List",
+    [0x07] = "Push Formatted",
+    [0x08] = "Clock Calibration",
+    [0x09] = "Drop Report",
+    [0x0a] = "Tracepoint ID List",
+    [0x0b] = "Push Delta",
+    [0x0c] = "Blob",
+    [0x0d] = "Shared Memory Request",
+    [0x0e] = "Shared Memory Reply",
+    [0x0f] = "Flight Recorder Request",
+    [0x10] = "Flight Recorder End",
 }
 
 local tracy_info = {
@@ -38,6 +49,9 @@ local tracy_info = {
 set_plugin_info(tracy_info)
 
 local header_len = 12
+local flag_tracepoint_ids = 0x0001
+local flag_compact_records = 0x0002
+local flag_compressed = 0x0004
 
 -- Fields
 local f_magic_number = ProtoField.uint32("tracy.magic", "Magic Number", base.HEX)
@@ -53,6 +67,41 @@ local f_enable_proto = ProtoField.protocol("tracy.enable", "TRACE_ENABLE")
 local f_disable_proto = ProtoField.protocol("tracy.disable", "TRACE_DISABLE")
 local f_push_proto = ProtoField.protocol("tracy.push", "TRACE_PUSH")
 local f_timestamp = ProtoField.uint64("tracy.timestamp", "Timestamp", base.DEC)
+local f_format_list_proto = ProtoField.protocol("tracy.format_list", "FORMAT_STRING_LIST")
+local f_push_formatted_proto = ProtoField.protocol("tracy.push_formatted", "TRACE_PUSH_FORMATTED")
+local f_format_id = ProtoField.uint16("tracy.format.id", "Format ID", base.DEC)
+local f_format_len = ProtoField.uint16("tracy.format.len", "Format Length", base.DEC)
+local f_format = ProtoField.string("tracy.format", "Format String")
+local vs_clocks = {
+    [0x01] = "CLOCK_MONOTONIC_RAW",
+    [0x02] = "CLOCK_MONOTONIC_COARSE",
+    [0x03] = "Cycle Counter",
+}
+local f_calibration_proto = ProtoField.protocol("tracy.calibration", "CLOCK_CALIBRATION")
+local f_clock = ProtoField.uint16("tracy.calibration.clock", "Clock", base.DEC, vs_clocks)
+local f_ticks = ProtoField.uint64("tracy.calibration.ticks", "Ticks", base.DEC)
+local f_epoch_ns = ProtoField.uint64("tracy.calibration.epoch_ns", "UNIX Epoch ns", base.DEC)
+local f_ticks_per_sec = ProtoField.uint64("tracy.calibration.ticks_per_sec", "Ticks per Second", base.DEC)
+local f_drop_report_proto = ProtoField.protocol("tracy.drop_report", "DROP_REPORT")
+local f_dropped = ProtoField.uint64("tracy.dropped", "Dropped Records", base.DEC)
+local f_id_list_proto = ProtoField.protocol("tracy.id_list", "TRACEPOINT_ID_LIST")
+local f_tracepoint_id = ProtoField.uint16("tracy.tracepoint.id", "Tracepoint ID", base.DEC)
+local f_base_timestamp = ProtoField.uint64("tracy.timestamp.base", "Base Timestamp", base.DEC)
+local f_timestamp_delta = ProtoField.int64("tracy.timestamp.delta", "Timestamp Delta", base.DEC)
+local f_uncompressed_len = ProtoField.uint32("tracy.uncompressed_len", "Uncompressed Length", base.DEC)
+local vs_delta_types = {
+    [0x00] = "Keyframe",
+    [0x01] = "Delta",
+}
+local f_push_delta_proto = ProtoField.protocol("tracy.push_delta", "TRACE_PUSH_DELTA")
+local f_delta_type = ProtoField.uint8("tracy.delta.type", "Encoding", base.DEC, vs_delta_types)
+local f_blob_proto = ProtoField.protocol("tracy.blob", "TRACE_BLOB")
+local f_blob_id = ProtoField.uint32("tracy.blob.id", "Blob ID", base.DEC)
+local f_blob_len = ProtoField.uint32("tracy.blob.len", "Blob Length", base.DEC)
+local f_blob_offset = ProtoField.uint32("tracy.blob.offset", "Chunk Offset", base.DEC)
+local f_recorder_end_proto = ProtoField.protocol("tracy.recorder_end", "FLIGHT_RECORDER_END")
+local f_recorder_records = ProtoField.uint32("tracy.recorder.records", "Records Sent", base.DEC)
+local f_recorder_overwritten = ProtoField.uint64("tracy.recorder.overwritten", "Records Overwritten", base.DEC)
 
 tracy_proto.fields = {
     f_magic_number,
@@ -68,7 +117,32 @@ tracy_proto.fields = {
     f_disable_proto,
     f_push_proto,
     f_timestamp,
-    f_push_payload,
+    f_format_list_proto,
+    f_push_formatted_proto,
+    f_format_id,
+    f_format_len,
+    f_format,
+    f_calibration_proto,
+    f_clock,
+    f_ticks,
+    f_epoch_ns,
+    f_ticks_per_sec,
+    f_drop_report_proto,
+    f_dropped,
+    f_id_list_proto,
+    f_tracepoint_id,
+    f_base_timestamp,
+    f_timestamp_delta,
+    f_uncompressed_len,
+    f_push_delta_proto,
+    f_delta_type,
+    f_blob_proto,
+    f_blob_id,
+    f_blob_len,
+    f_blob_offset,
+    f_recorder_end_proto,
+    f_recorder_records,
+    f_recorder_overwritten,
 }
 
 function _get_length(tvb, pinfo, offset)
@@ -94,16 +168,302 @@ function _dissect_tracepoint_list(tvb, pinfo, tree, proto)
     return names
 end
 
-function _dissect_push_payload(tvb, pinfo, tree)
+function _dissect_format_list(tvb, pinfo, tree)
+    local formats = {}
+    local offset = header_len
+    while offset < tvb:len() do
+        local t = tree:add(f_format_list_proto, tvb(header_len, tvb:len() - header_len))
+
+        local format_id = tvb(offset, 2)
+        offset = offset + 2
+        local format_len = tvb(offset, 2)
+        offset = offset + 2
+        local format = tvb(offset, format_len:uint())
+        offset = offset + format_len:uint()
+
+        table.insert(formats, format:string())
+
+        t:add(f_format_id, format_id)
+        t:add(f_format_len, format_len)
+        t:add(f_format, format)
+    end
+
+    return formats
+end
+
+function _dissect_calibration(tvb, pinfo, tree)
+    local t = tree:add(f_calibration_proto, tvb(header_len, tvb:len() - header_len))
+
+    t:add(f_clock, tvb(header_len, 2))
+    t:add(f_ticks, tvb(header_len + 2, 8))
+    t:add(f_epoch_ns, tvb(header_len + 10, 8))
+    t:add(f_ticks_per_sec, tvb(header_len + 18, 8))
+end
+
+function _dissect_recorder_end(tvb, pinfo, tree)
+    local t = tree:add(f_recorder_end_proto, tvb(header_len, tvb:len() - header_len))
+
+    t:add(f_recorder_records, tvb(header_len, 4))
+    t:add(f_recorder_overwritten, tvb(header_len + 4, 8))
+end
+
+function _dissect_id_list(tvb, pinfo, tree)
     local names = {}
     local offset = header_len
     while offset < tvb:len() do
-        local t = tree:add(f_push_proto, tvb(header_len, tvb:len() - header_len))
+        local t = tree:add(f_id_list_proto, tvb(header_len, tvb:len() - header_len))
 
+        local id = tvb(offset, 2)
+        offset = offset + 2
         local name_len = tvb(offset, 2)
         offset = offset + 2
         local name = tvb(offset, name_len:uint())
         offset = offset + name_len:uint()
+
+        table.insert(names, name:string())
+
+        t:add(f_tracepoint_id, id)
+        t:add(f_name_len, name_len)
+        t:add(f_name, name)
+    end
+
+    return names
+end
+
+function _dissect_drop_report(tvb, pinfo, tree)
+    local names = {}
+    local offset = header_len
+    while offset < tvb:len() do
+        local t = tree:add(f_drop_report_proto, tvb(header_len, tvb:len() - header_len))
+
+        local name_len = tvb(offset, 2)
+        offset = offset + 2
+        local name = tvb(offset, name_len:uint())
+        offset = offset + name_len:uint()
+        local dropped = tvb(offset, 8)
+        offset = offset + 8
+
+        table.insert(names, name:string())
+
+        t:add(f_name_len, name_len)
+        t:add(f_name, name)
+        t:add(f_dropped, dropped)
+    end
+
+    return names
+end
+
+-- The tracepoint and timestamp only come with the first chunk of a blob
+function _dissect_blob(tvb, pinfo, tree)
+    local names = {}
+    local offset = header_len
+    local t = tree:add(f_blob_proto, tvb(header_len, tvb:len() - header_len))
+
+    t:add(f_blob_id, tvb(offset, 4))
+    t:add(f_blob_len, tvb(offset + 4, 4))
+    local chunk_offset = tvb(offset + 8, 4)
+    t:add(f_blob_offset, chunk_offset)
+    offset = offset + 12
+
+    if chunk_offset:uint() == 0 then
+        if bit.band(tvb(4, 2):uint(), flag_tracepoint_ids) ~= 0 then
+            local id = tvb(offset, 2)
+            offset = offset + 2
+            table.insert(names, string.format('#%d', id:uint()))
+            t:add(f_tracepoint_id, id)
+        else
+            local name_len = tvb(offset, 2)
+            offset = offset + 2
+            local name = tvb(offset, name_len:uint())
+            offset = offset + name_len:uint()
+            table.insert(names, name:string())
+            t:add(f_name_len, name_len)
+            t:add(f_name, name)
+        end
+        t:add(f_timestamp, tvb(offset, 8))
+        offset = offset + 8
+    end
+
+    if offset < tvb:len() then
+        t:add(f_payload, tvb(offset, tvb:len() - offset))
+    end
+
+    return names
+end
+
+-- Length continued in extra bytes of an LZ4 sequence
+function _lz4_length(block, i, len)
+    if len == 15 then
+        repeat
+            local byte = block:get_index(i)
+            i = i + 1
+            len = len + byte
+        until byte ~= 255
+    end
+
+    return len, i
+end
+
+-- Decompresses an LZ4 block into a ByteArray, behind prefix
+function _lz4_decompress(block, prefix)
+    local out = {}
+    local i = 0
+    while i < block:len() do
+        local token = block:get_index(i)
+        i = i + 1
+
+        local literal_len
+        literal_len, i = _lz4_length(block, i, bit.rshift(token, 4))
+        for k = 0, literal_len - 1 do
+            out[#out + 1] = block:get_index(i + k)
+        end
+        i = i + literal_len
+        if i >= block:len() then
+            break
+        end
+
+        local offset = block:get_index(i) + block:get_index(i + 1) * 256
+        i = i + 2
+        local match_len
+        match_len, i = _lz4_length(block, i, bit.band(token, 0x0f))
+
+        local start = #out - offset
+        for k = 1, match_len + 4 do
+            out[#out + 1] = out[start + k]
+        end
+    end
+
+    local bytes = ByteArray.new()
+    bytes:append(prefix)
+    local base = bytes:len()
+    bytes:set_size(base + #out)
+    for k = 1, #out do
+        bytes:set_index(base + k - 1, out[k])
+    end
+
+    return bytes
+end
+
+-- LEB128 varint at offset, returns its value and length in bytes
+function _varint(tvb, offset)
+    local value = 0
+    local len = 0
+    repeat
+        local byte = tvb(offset + len, 1):uint()
+        value = value + bit.band(byte, 0x7f) * 2^(7 * len)
+        len = len + 1
+    until bit.band(byte, 0x80) == 0
+
+    return value, len
+end
+
+-- The data of one package: opaque bytes, printf arguments behind a format ID,
+-- or delta encoded bytes, which can only be decoded along with the previous
+-- packages of the tracepoint
+function _add_payload(t, payload, proto)
+    if proto == f_push_formatted_proto and payload:len() >= 2 then
+        t:add(f_format_id, payload(0, 2))
+        if payload:len() > 2 then
+            t:add(f_payload, payload(2, payload:len() - 2))
+        end
+    elseif proto == f_push_delta_proto and payload:len() >= 1 then
+        t:add(f_delta_type, payload(0, 1))
+        if payload:len() > 1 then
+            t:add(f_payload, payload(1, payload:len() - 1))
+        end
+    else
+        t:add(f_payload, payload)
+    end
+end
+
+-- Compact packages: varint tracepoint ID resp. name length, zigzag varint
+-- timestamp delta, varint data length
+function _dissect_compact_push_payload(tvb, pinfo, tree, proto, ids)
+    local names = {}
+    local offset = header_len
+    local timestamp = tvb(offset, 8):uint64()
+    tree:add(f_base_timestamp, tvb(offset, 8))
+    offset = offset + 8
+
+    while offset < tvb:len() do
+        local t = tree:add(proto, tvb(header_len, tvb:len() - header_len))
+
+        local value, len = _varint(tvb, offset)
+        if ids then
+            table.insert(names, string.format('#%d', value))
+            t:add(f_tracepoint_id, tvb(offset, len), value)
+            offset = offset + len
+        else
+            t:add(f_name_len, tvb(offset, len), value)
+            offset = offset + len
+            local name = tvb(offset, value)
+            offset = offset + value
+            table.insert(names, name:string())
+            t:add(f_name, name)
+        end
+
+        value, len = _varint(tvb, offset)
+        local delta = value / 2
+        if value % 2 == 1 then
+            delta = -(value + 1) / 2
+            timestamp = timestamp - (-delta)
+        else
+            timestamp = timestamp + delta
+        end
+        t:add(f_timestamp_delta, tvb(offset, len), Int64(delta))
+        t:add(f_timestamp, tvb(offset, len), timestamp)
+        offset = offset + len
+
+        value, len = _varint(tvb, offset)
+        t:add(f_payload_len, tvb(offset, len), value)
+        offset = offset + len
+        local payload = tvb(offset, value)
+        offset = offset + value
+
+        _add_payload(t, payload, proto)
+    end
+
+    return names
+end
+
+function _dissect_push_payload(tvb, pinfo, tree, proto)
+    local names = {}
+    local flags = tvb(4, 2):uint()
+
+    -- Dissect the decompressed frame, with the original header in front
+    if bit.band(flags, flag_compressed) ~= 0 then
+        tree:add(f_uncompressed_len, tvb(header_len, 4))
+        local bytes = _lz4_decompress(tvb(header_len + 4):bytes(),
+                                      tvb(0, header_len):bytes())
+        bytes:set_index(5, bit.band(bytes:get_index(5), bit.bnot(flag_compressed)))
+        local frame = bytes:tvb("Decompressed TRACY")
+        return _dissect_push_payload(frame, pinfo, tree, proto)
+    end
+
+    local ids = bit.band(flags, flag_tracepoint_ids) ~= 0
+    if bit.band(flags, flag_compact_records) ~= 0 then
+        return _dissect_compact_push_payload(tvb, pinfo, tree, proto, ids)
+    end
+
+    local offset = header_len
+    while offset < tvb:len() do
+        local t = tree:add(proto, tvb(header_len, tvb:len() - header_len))
+
+        if ids then
+            local id = tvb(offset, 2)
+            offset = offset + 2
+            table.insert(names, string.format('#%d', id:uint()))
+            t:add(f_tracepoint_id, id)
+        else
+            local name_len = tvb(offset, 2)
+            offset = offset + 2
+            local name = tvb(offset, name_len:uint())
+            offset = offset + name_len:uint()
+            table.insert(names, name:string())
+            t:add(f_name_len, name_len)
+            t:add(f_name, name)
+        end
+
         local timestamp = tvb(offset, 8)
         offset = offset + 8
         local data_len = tvb(offset, 2)
@@ -111,13 +471,9 @@ function _dissect_push_payload(tvb, pinfo, tree)
         local payload = tvb(offset, data_len:uint())
         offset = offset + payload:len()
 
-        table.insert(names, name:string())
-
-        t:add(f_name_len, name_len)
-        t:add(f_name, name)
         t:add(f_timestamp, timestamp)
         t:add(f_payload_len, data_len)
-        t:add(f_payload, payload)
+        _add_payload(t, payload, proto)
     end
 
     return names
@@ -152,7 +508,33 @@ function _dissect(tvb, pinfo, tree)
         names = _dissect_tracepoint_list(tvb, pinfo, tree, f_disable_proto)
     elseif cmd_number:uint() == 0x05 then
         info = "TRACE_PUSH"
-        names = _dissect_push_payload(tvb(), pinfo, tree)
+        names = _dissect_push_payload(tvb(), pinfo, tree, f_push_proto)
+    elseif cmd_number:uint() == 0x06 then
+        info = "FORMAT_STRING_LIST"
+        names = _dissect_format_list(tvb(), pinfo, tree)
+    elseif cmd_number:uint() == 0x07 then
+        info = "TRACE_PUSH_FORMATTED"
+        names = _dissect_push_payload(tvb(), pinfo, tree, f_push_formatted_proto)
+    elseif cmd_number:uint() == 0x08 then
+        info = "CLOCK_CALIBRATION"
+        _dissect_calibration(tvb(), pinfo, tree)
+    elseif cmd_number:uint() == 0x09 then
+        info = "DROP_REPORT"
+        names = _dissect_drop_report(tvb(), pinfo, tree)
+    elseif cmd_number:uint() == 0x0a then
+        info = "TRACEPOINT_ID_LIST"
+        names = _dissect_id_list(tvb(), pinfo, tree)
+    elseif cmd_number:uint() == 0x0b then
+        info = "TRACE_PUSH_DELTA"
+        names = _dissect_push_payload(tvb(), pinfo, tree, f_push_delta_proto)
+    elseif cmd_number:uint() == 0x0c then
+        info = "TRACE_BLOB"
+        names = _dissect_blob(tvb(), pinfo, tree)
+    elseif cmd_number:uint() == 0x0f then
+        info = "FLIGHT_RECORDER_REQUEST"
+    elseif cmd_number:uint() == 0x10 then
+        info = "FLIGHT_RECORDER_END"
+        _dissect_recorder_end(tvb(), pinfo, tree)
     end
 
     if #names == 1 then
@@ -0,0 +1,213 @@
+// Copyright 2019, 2020 Rohde & Schwarz GmbH & Co KG
+//      philipp.stanner@rohde-schwarz.com
+//      hagen.pfeifer@rohde-schwarz.com
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Timestamp sources for submitted records. The default is the realtime
+// clock, which directly yields nanoseconds since UNIX_EPOCH. The other
+// sources are cheaper to read (and monotonic), but count from an arbitrary
+// point in time, in the case of the cycle counter even in an unknown unit.
+// For these, the tracer-thread regularly sends a Calibration to the client,
+// which maps ticks to UNIX_EPOCH nanoseconds.
+
+use std::thread;
+use std::time::{Duration, Instant};
+
+const NSEC_PER_SEC: u64 = 1_000_000_000;
+
+// Time the tracer-thread waits to estimate the cycle counter's frequency,
+// if the CPU does not tell it
+const COUNTER_ESTIMATE_TIME: Duration = Duration::from_millis(10);
+
+
+// The numbers are part of the wire protocol, see CLOCK_CALIBRATION
+#[derive(Clone, Copy, PartialEq)]
+pub(crate) enum Clock {
+    Realtime = 0,
+    MonotonicRaw = 1,
+    MonotonicCoarse = 2,
+    Counter = 3,
+}
+
+impl Clock {
+    pub(crate) fn now(self) -> u64
+    {
+        match self {
+            Clock::Realtime => clock_ns(libc::CLOCK_REALTIME),
+            Clock::MonotonicRaw => clock_ns(libc::CLOCK_MONOTONIC_RAW),
+            Clock::MonotonicCoarse => clock_ns(libc::CLOCK_MONOTONIC_COARSE),
+            Clock::Counter => read_counter(),
+        }
+    }
+
+    // Whether the client needs a Calibration to make sense of the ticks
+    pub(crate) fn needs_calibration(self) -> bool
+    {
+        self != Clock::Realtime
+    }
+
+    // The cycle counter is only available on some architectures. Elsewhere
+    // the raw monotonic clock takes its place.
+    pub(crate) fn available(self) -> Clock
+    {
+        if self == Clock::Counter && !HAVE_COUNTER {
+            eprintln!("tracy: No cycle counter on this architecture. \
+                       Using CLOCK_MONOTONIC_RAW.");
+            return Clock::MonotonicRaw;
+        }
+
+        self
+    }
+}
+
+
+fn clock_ns(clk_id: libc::clockid_t) -> u64
+{
+    let mut ts = libc::timespec { tv_sec: 0, tv_nsec: 0 };
+
+    if unsafe { libc::clock_gettime(clk_id, &mut ts) } != 0 {
+        return 0;
+    }
+
+    ts.tv_sec as u64 * NSEC_PER_SEC + ts.tv_nsec as u64
+}
+
+
+#[cfg(target_arch = "x86_64")]
+const HAVE_COUNTER: bool = true;
+
+#[cfg(target_arch = "x86_64")]
+fn read_counter() -> u64
+{
+    unsafe { std::arch::x86_64::_rdtsc() }
+}
+
+// The TSC's frequency can't be read reliably, it has to be measured
+#[cfg(target_arch = "x86_64")]
+fn counter_frequency() -> Option<u64>
+{
+    None
+}
+
+
+#[cfg(target_arch = "aarch64")]
+const HAVE_COUNTER: bool = true;
+
+#[cfg(target_arch = "aarch64")]
+fn read_counter() -> u64
+{
+    let val: u64;
+    unsafe {
+        std::arch::asm!("mrs {}, cntvct_el0", out(reg) val,
+                        options(nomem, nostack));
+    }
+    val
+}
+
+#[cfg(target_arch = "aarch64")]
+fn counter_frequency() -> Option<u64>
+{
+    let val: u64;
+    unsafe {
+        std::arch::asm!("mrs {}, cntfrq_el0", out(reg) val,
+                        options(nomem, nostack));
+    }
+
+    if val > 0 {
+        Some(val)
+    } else {
+        None
+    }
+}
+
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+const HAVE_COUNTER: bool = false;
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+fn read_counter() -> u64
+{
+    clock_ns(libc::CLOCK_MONOTONIC_RAW)
+}
+
+#[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+fn counter_frequency() -> Option<u64>
+{
+    Some(NSEC_PER_SEC)
+}
+
+
+// Maps ticks of a clock to UNIX_EPOCH nanoseconds: at `ticks`, it was
+// `epoch_ns`, and the clock advances `ticks_per_sec` per second.
+pub(crate) struct Calibration {
+    pub(crate) clock: Clock,
+    pub(crate) ticks: u64,
+    pub(crate) epoch_ns: u64,
+    pub(crate) ticks_per_sec: u64,
+}
+
+
+// Produces Calibrations for one clock. Owned by the tracer-thread.
+pub(crate) struct Calibrator {
+    clock: Clock,
+    // First reading, the frequency of the cycle counter is measured from here
+    base_ticks: u64,
+    base_instant: Instant,
+    known_frequency: Option<u64>,
+}
+
+impl Calibrator {
+    pub(crate) fn new(clock: Clock) -> Calibrator
+    {
+        let known_frequency = match clock {
+            Clock::Counter => counter_frequency(),
+            _ => Some(NSEC_PER_SEC),
+        };
+
+        let calibrator = Calibrator {
+            clock,
+            base_ticks: clock.now(),
+            base_instant: Instant::now(),
+            known_frequency,
+        };
+
+        // Get a first usable estimate before the first client arrives
+        if calibrator.known_frequency.is_none() {
+            thread::sleep(COUNTER_ESTIMATE_TIME);
+        }
+
+        calibrator
+    }
+
+    // The longer the tracer runs, the more precise the estimated frequency
+    // of the cycle counter gets
+    pub(crate) fn calibrate(&self) -> Calibration
+    {
+        // Read the clock between two readings of the realtime clock and
+        // assume it was read in the middle
+        let before = clock_ns(libc::CLOCK_REALTIME);
+        let ticks = self.clock.now();
+        let after = clock_ns(libc::CLOCK_REALTIME);
+        let elapsed = self.base_instant.elapsed();
+
+        let ticks_per_sec = match self.known_frequency {
+            Some(freq) => freq,
+            None => {
+                let nanos = elapsed.as_secs() as u128 * NSEC_PER_SEC as u128 +
+                    elapsed.subsec_nanos() as u128;
+                let delta = ticks.wrapping_sub(self.base_ticks) as u128;
+                (delta * NSEC_PER_SEC as u128 / nanos.max(1)) as u64
+            },
+        };
+
+        Calibration {
+            clock: self.clock,
+            ticks,
+            epoch_ns: before + (after.wrapping_sub(before)) / 2,
+            ticks_per_sec,
+        }
+    }
+}
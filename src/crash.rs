@@ -0,0 +1,329 @@
+// Copyright 2019, 2020 Rohde & Schwarz GmbH & Co KG
+//      philipp.stanner@rohde-schwarz.com
+//      hagen.pfeifer@rohde-schwarz.com
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Emergency flush, see tracy_emergency_flush() and
+// tracy_install_crash_handler(). Runs on whatever thread crashed, possibly in
+// a signal handler, so it must neither allocate nor take locks.
+//
+// The flushing thread works on the tracer-thread's context directly, while
+// the tracer-thread is kept out of it: the tracer-thread is busy while it
+// works on its context, and waits before becoming busy while a flush has the
+// context frozen. What can't be done async-signal-safely, like freeing the
+// records sent, is settled by the tracer-thread when it gets the context
+// back, see TracerContext::settle_emergency.
+//
+// The signal handler keeps the tracers in a fixed table and passes the
+// signal on to the action in place before, once they are flushed.
+
+use std::cell::UnsafeCell;
+use std::mem::{self, MaybeUninit};
+use std::os::raw::{c_int, c_void};
+use std::ptr;
+use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicPtr, AtomicU8, AtomicUsize, Ordering};
+use std::thread;
+use std::time::{Duration, Instant};
+
+use crate::{tcp_handler, TracerContext};
+
+// A crashing application should not hang in the flush
+const FLUSH_TIMEOUT: Duration = Duration::from_millis(200);
+// Scratch for frames with at least one record of max_submit_len
+const MIN_SCRATCH_LEN: usize = 16 * 1024;
+// Tracers covered by the signal handler
+const MAX_CRASH_TRACERS: usize = 8;
+
+const SIGNALS: [c_int; 5] = [
+    libc::SIGSEGV, libc::SIGBUS, libc::SIGILL, libc::SIGFPE, libc::SIGABRT,
+];
+
+
+// Shared by the application and the tracer-thread
+pub(crate) struct CrashState {
+    // Held by the thread flushing
+    frozen: AtomicBool,
+    // Set while the tracer-thread works on its context
+    busy: AtomicBool,
+    // Published by the tracer-thread while it runs
+    ctx: AtomicPtr<TracerContext>,
+    // Only touched while holding frozen
+    scratch: UnsafeCell<Box<[u8]>>,
+    // Left for the tracer-thread to settle: payloads sent from the front of
+    // its buffer
+    buffer_sent: AtomicUsize,
+    unsettled: AtomicBool,
+}
+
+unsafe impl Sync for CrashState {}
+unsafe impl Send for CrashState {}
+
+impl CrashState {
+    pub(crate) fn new(max_submit_len: usize) -> CrashState
+    {
+        let scratch_len = MIN_SCRATCH_LEN
+            .max(tcp_handler::emergency_frame_len(max_submit_len));
+
+        CrashState {
+            frozen: AtomicBool::new(false),
+            busy: AtomicBool::new(false),
+            ctx: AtomicPtr::new(ptr::null_mut()),
+            scratch: UnsafeCell::new(vec![0u8; scratch_len].into_boxed_slice()),
+            buffer_sent: AtomicUsize::new(0),
+            unsettled: AtomicBool::new(false),
+        }
+    }
+
+    // Called by the tracer-thread, while busy, once its context has its final
+    // place. The context is withdrawn when the guard is dropped, even if the
+    // tracer-thread panics.
+    pub(crate) fn attach(&self, ctx: *mut TracerContext) -> Attached<'_>
+    {
+        self.ctx.store(ctx, Ordering::SeqCst);
+        Attached(self)
+    }
+
+    // The tracer-thread is about to work on its context. Waits while a
+    // flush has it frozen.
+    pub(crate) fn enter(&self)
+    {
+        loop {
+            self.busy.store(true, Ordering::SeqCst);
+            if !self.frozen.load(Ordering::SeqCst) {
+                return;
+            }
+
+            self.busy.store(false, Ordering::SeqCst);
+            while self.frozen.load(Ordering::SeqCst) {
+                thread::yield_now();
+            }
+        }
+    }
+
+    pub(crate) fn leave(&self)
+    {
+        self.busy.store(false, Ordering::SeqCst);
+    }
+
+    // The number of buffered payloads emergency flushes have sent since the
+    // last call, if there have been any flushes
+    pub(crate) fn take_settlement(&self) -> Option<usize>
+    {
+        if !self.unsettled.swap(false, Ordering::SeqCst) {
+            return None;
+        }
+
+        Some(self.buffer_sent.swap(0, Ordering::SeqCst))
+    }
+
+    // Async-signal-safe. Fails if another flush is running, or if the
+    // tracer-thread does not let go of its context in time, e.g. because it
+    // is the one which crashed.
+    pub(crate) fn emergency_flush(&self) -> bool
+    {
+        if self.frozen.compare_exchange(false, true, Ordering::SeqCst,
+                                        Ordering::SeqCst).is_err() {
+            return false;
+        }
+
+        let deadline = Instant::now() + FLUSH_TIMEOUT;
+        while self.busy.load(Ordering::SeqCst) {
+            if Instant::now() >= deadline {
+                self.frozen.store(false, Ordering::SeqCst);
+                return false;
+            }
+            thread::yield_now();
+        }
+
+        let ctx = self.ctx.load(Ordering::SeqCst);
+        if !ctx.is_null() {
+            let scratch = unsafe { &mut *self.scratch.get() };
+            let skip = self.buffer_sent.load(Ordering::SeqCst);
+            let sent = tcp_handler::emergency_flush(ctx, scratch, skip,
+                                                    deadline);
+            self.buffer_sent.store(sent, Ordering::SeqCst);
+            self.unsettled.store(true, Ordering::SeqCst);
+        }
+
+        self.frozen.store(false, Ordering::SeqCst);
+        true
+    }
+}
+
+pub(crate) struct Attached<'a>(&'a CrashState);
+
+impl<'a> Drop for Attached<'a> {
+    fn drop(&mut self)
+    {
+        self.0.enter();
+        self.0.ctx.store(ptr::null_mut(), Ordering::SeqCst);
+        self.0.leave();
+    }
+}
+
+
+// The tracers the signal handler flushes. Each entry holds a reference.
+static TRACERS: [AtomicPtr<CrashState>; MAX_CRASH_TRACERS] = [
+    AtomicPtr::new(ptr::null_mut()), AtomicPtr::new(ptr::null_mut()),
+    AtomicPtr::new(ptr::null_mut()), AtomicPtr::new(ptr::null_mut()),
+    AtomicPtr::new(ptr::null_mut()), AtomicPtr::new(ptr::null_mut()),
+    AtomicPtr::new(ptr::null_mut()), AtomicPtr::new(ptr::null_mut()),
+];
+// Signal handlers currently looking at TRACERS
+static HANDLERS_RUNNING: AtomicUsize = AtomicUsize::new(0);
+
+const NOT_INSTALLED: u8 = 0;
+const INSTALLING: u8 = 1;
+const INSTALLED: u8 = 2;
+static HANDLER_STATE: AtomicU8 = AtomicU8::new(NOT_INSTALLED);
+
+// The actions in place before ours, indexed like SIGNALS. Written while
+// installing, before the handler can run.
+struct OldActions(UnsafeCell<MaybeUninit<[libc::sigaction; SIGNALS.len()]>>);
+unsafe impl Sync for OldActions {}
+
+static OLD_ACTIONS: OldActions =
+    OldActions(UnsafeCell::new(MaybeUninit::uninit()));
+
+
+// Adds the tracer to the ones flushed on fatal signals, installing the
+// signal handler with the first one. Fails if too many tracers are covered
+// already or the handler can't be installed.
+pub(crate) fn install(state: &Arc<CrashState>) -> Result<(), ()>
+{
+    let raw = Arc::into_raw(Arc::clone(state)) as *mut CrashState;
+
+    let registered = TRACERS.iter().any(|slot| {
+        slot.compare_exchange(ptr::null_mut(), raw, Ordering::SeqCst,
+                              Ordering::SeqCst).is_ok()
+    });
+    if !registered {
+        unsafe { drop(Arc::from_raw(raw)); }
+        return Err(());
+    }
+
+    // Waits for a concurrent install. Once that has failed, the handler is
+    // tried again.
+    loop {
+        let claimed = HANDLER_STATE.compare_exchange(
+            NOT_INSTALLED, INSTALLING, Ordering::SeqCst, Ordering::SeqCst);
+        match claimed {
+            Ok(_) => break,
+            Err(INSTALLED) => return Ok(()),
+            Err(_) => thread::yield_now(),
+        }
+    }
+
+    if install_handler().is_err() {
+        HANDLER_STATE.store(NOT_INSTALLED, Ordering::SeqCst);
+        uninstall(state);
+        return Err(());
+    }
+
+    HANDLER_STATE.store(INSTALLED, Ordering::SeqCst);
+    Ok(())
+}
+
+// Saves the actions in place, then replaces them. On failure, the signals
+// covered already get their actions back.
+fn install_handler() -> Result<(), ()>
+{
+    let mut action: libc::sigaction = unsafe { mem::zeroed() };
+    action.sa_sigaction = handle_signal as libc::sighandler_t;
+    action.sa_flags = libc::SA_SIGINFO | libc::SA_ONSTACK;
+    unsafe { libc::sigemptyset(&mut action.sa_mask); }
+
+    // Saved first, so the handler never sees an action it hasn't
+    let old = unsafe { &mut *(*OLD_ACTIONS.0.get()).as_mut_ptr() };
+    for (signal, old) in SIGNALS.iter().zip(old.iter_mut()) {
+        if unsafe { libc::sigaction(*signal, ptr::null(), old) } != 0 {
+            return Err(());
+        }
+    }
+
+    for (i, signal) in SIGNALS.iter().enumerate() {
+        if unsafe { libc::sigaction(*signal, &action, ptr::null_mut()) } != 0 {
+            for (signal, old) in SIGNALS[..i].iter().zip(old.iter()) {
+                unsafe { libc::sigaction(*signal, old, ptr::null_mut()); }
+            }
+            return Err(());
+        }
+    }
+
+    Ok(())
+}
+
+// Removes the tracer from the ones flushed on fatal signals. The handler
+// stays installed.
+pub(crate) fn uninstall(state: &Arc<CrashState>)
+{
+    let raw = Arc::as_ptr(state) as *mut CrashState;
+
+    for slot in TRACERS.iter() {
+        if slot.compare_exchange(raw, ptr::null_mut(), Ordering::SeqCst,
+                                 Ordering::SeqCst).is_ok() {
+            // A handler might still use it
+            while HANDLERS_RUNNING.load(Ordering::SeqCst) > 0 {
+                thread::yield_now();
+            }
+            unsafe { drop(Arc::from_raw(raw)); }
+        }
+    }
+}
+
+
+// Flushes all tracers, then hands the signal to the action in place before
+extern "C" fn handle_signal(signal: c_int, info: *mut libc::siginfo_t,
+                            context: *mut c_void)
+{
+    HANDLERS_RUNNING.fetch_add(1, Ordering::SeqCst);
+    for slot in TRACERS.iter() {
+        let state = slot.load(Ordering::SeqCst);
+        if !state.is_null() {
+            unsafe { (*state).emergency_flush(); }
+        }
+    }
+    HANDLERS_RUNNING.fetch_sub(1, Ordering::SeqCst);
+
+    let index = match SIGNALS.iter().position(|s| *s == signal) {
+        Some(index) => index,
+        None => return,
+    };
+    let old = unsafe { &(*(*OLD_ACTIONS.0.get()).as_ptr())[index] };
+
+    match old.sa_sigaction {
+        // Delivered again once the handler returns, as the signal is blocked
+        // while it runs. A fault re-raises itself anyway.
+        libc::SIG_DFL => unsafe {
+            libc::sigaction(signal, old, ptr::null_mut());
+            libc::raise(signal);
+        },
+        // A fault recurs once the handler returns, and the kernel kills the
+        // process as it would have without us
+        libc::SIG_IGN => unsafe {
+            libc::sigaction(signal, old, ptr::null_mut());
+        },
+        handler => {
+            if old.sa_flags & libc::SA_RESETHAND != 0 {
+                let mut default: libc::sigaction = unsafe { mem::zeroed() };
+                default.sa_sigaction = libc::SIG_DFL;
+                unsafe { libc::sigaction(signal, &default, ptr::null_mut()); }
+            }
+
+            if old.sa_flags & libc::SA_SIGINFO != 0 {
+                let handler: extern "C" fn(c_int, *mut libc::siginfo_t,
+                                           *mut c_void) =
+                    unsafe { mem::transmute(handler) };
+                handler(signal, info, context);
+            } else {
+                let handler: extern "C" fn(c_int) =
+                    unsafe { mem::transmute(handler) };
+                handler(signal);
+            }
+        },
+    }
+}
@@ -0,0 +1,338 @@
+// Copyright 2019, 2020 Rohde & Schwarz GmbH & Co KG
+//      philipp.stanner@rohde-schwarz.com
+//      hagen.pfeifer@rohde-schwarz.com
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Delta encoding of the payloads of one tracepoint, see tracy_set_delta().
+// Meant for tracepoints which submit the same struct over and over, with only
+// a few fields changing.
+//
+// Every encoded payload starts with its type. A keyframe carries the payload
+// as it is. A delta carries the payload XORed with the previous one, in which
+// the unchanged bytes are zeros, as pairs of
+//
+//     varint zero run length, varint literal length, literal bytes
+//
+// Zeros at the end are left out, the length is the previous payload's one.
+// A keyframe is sent every keyframe_interval payloads, and whenever the
+// length changes or the delta would not be smaller.
+
+use std::collections::HashMap;
+use std::ops::Range;
+
+const KEYFRAME: u8 = 0;
+const DELTA: u8 = 1;
+
+// Zeros within changed bytes which are cheaper to send as literals than to
+// end the literal run for
+const MIN_ZERO_RUN: usize = 3;
+
+
+// The tracepoints in delta mode, owned by the tracer-thread
+pub(crate) struct Deltas {
+    states: HashMap<usize, DeltaState>,
+    encoded: Vec<u8>,
+}
+
+impl Deltas {
+    pub(crate) fn new() -> Deltas
+    {
+        Deltas {
+            states: HashMap::new(),
+            encoded: Vec::new(),
+        }
+    }
+
+    // A keyframe_interval of 0 switches delta mode off
+    pub(crate) fn set(&mut self, handle: usize, keyframe_interval: u32)
+    {
+        if keyframe_interval == 0 {
+            self.states.remove(&handle);
+        } else {
+            self.states.insert(handle, DeltaState::new(keyframe_interval));
+        }
+    }
+
+    // Makes the next payload of every tracepoint a keyframe
+    pub(crate) fn reset(&mut self)
+    {
+        for state in self.states.values_mut() {
+            state.reset();
+        }
+    }
+
+    // Appends the encoded payload to the ones encoded since the last
+    // clear_encoded(). Returns where it is, or None if the tracepoint is not
+    // in delta mode.
+    pub(crate) fn encode(&mut self, handle: usize, data: &[u8])
+        -> Option<Range<usize>>
+    {
+        let state = self.states.get_mut(&handle)?;
+        let start = self.encoded.len();
+        state.encode(data, &mut self.encoded);
+        Some(start..self.encoded.len())
+    }
+
+    pub(crate) fn encoded(&self, range: Range<usize>) -> &[u8]
+    {
+        &self.encoded[range]
+    }
+
+    pub(crate) fn clear_encoded(&mut self)
+    {
+        self.encoded.clear();
+    }
+
+    // The payload is sent unencoded, so the client's previous payload of the
+    // tracepoint is not this one
+    pub(crate) fn skip(&mut self, handle: usize)
+    {
+        if let Some(state) = self.states.get_mut(&handle) {
+            state.reset();
+        }
+    }
+}
+
+
+struct DeltaState {
+    keyframe_interval: u32,
+    // Payloads left until the next keyframe. 0 forces a keyframe.
+    countdown: u32,
+    prev: Vec<u8>,
+}
+
+impl DeltaState {
+    fn new(keyframe_interval: u32) -> DeltaState
+    {
+        DeltaState {
+            keyframe_interval,
+            countdown: 0,
+            prev: Vec::new(),
+        }
+    }
+
+    // The client has lost track, e.g. because it just connected or data had
+    // to be dropped. The next payload is sent as keyframe.
+    fn reset(&mut self)
+    {
+        self.countdown = 0;
+    }
+
+    // Appends the encoded data to out
+    fn encode(&mut self, data: &[u8], out: &mut Vec<u8>)
+    {
+        let start = out.len();
+
+        let mut keyframe = self.countdown == 0 || self.prev.len() != data.len();
+        if !keyframe {
+            out.push(DELTA);
+            xor_runs(&self.prev, data, out);
+            keyframe = out.len() - start > data.len();
+        }
+
+        if keyframe {
+            out.truncate(start);
+            out.push(KEYFRAME);
+            out.extend_from_slice(data);
+            self.countdown = self.keyframe_interval;
+        }
+
+        self.countdown -= 1;
+        self.prev.clear();
+        self.prev.extend_from_slice(data);
+    }
+}
+
+
+fn xor_runs(prev: &[u8], data: &[u8], out: &mut Vec<u8>)
+{
+    let changed = |i: usize| prev[i] != data[i];
+    let len = data.len();
+    let mut pos = 0;
+
+    loop {
+        let zeros_start = pos;
+        while pos < len && !changed(pos) {
+            pos += 1;
+        }
+        if pos == len {
+            return;
+        }
+
+        // The literal run ends at MIN_ZERO_RUN unchanged bytes or the end
+        let literal_start = pos;
+        let mut literal_end = pos;
+        while pos < len {
+            if changed(pos) {
+                pos += 1;
+                literal_end = pos;
+            } else if pos - literal_end + 1 >= MIN_ZERO_RUN {
+                break;
+            } else {
+                pos += 1;
+            }
+        }
+        pos = literal_end;
+
+        put_varint(out, literal_start - zeros_start);
+        put_varint(out, literal_end - literal_start);
+        for i in literal_start..literal_end {
+            out.push(prev[i] ^ data[i]);
+        }
+    }
+}
+
+
+// LEB128, like the compact record encoding
+fn put_varint(out: &mut Vec<u8>, mut value: usize)
+{
+    while value >= 0x80 {
+        out.push((value & 0x7f) as u8 | 0x80);
+        value >>= 7;
+    }
+    out.push(value as u8);
+}
+
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn read_varint(encoded: &mut &[u8]) -> usize
+    {
+        let mut value = 0;
+        let mut shift = 0;
+        loop {
+            let byte = encoded[0];
+            *encoded = &encoded[1..];
+            value |= ((byte & 0x7f) as usize) << shift;
+            if byte & 0x80 == 0 {
+                return value;
+            }
+            shift += 7;
+        }
+    }
+
+    // Reference decoder, as the client does it
+    fn decode(prev: &[u8], encoded: &[u8]) -> Vec<u8>
+    {
+        let (kind, mut rest) = (encoded[0], &encoded[1..]);
+        if kind == KEYFRAME {
+            return rest.to_vec();
+        }
+
+        assert_eq!(kind, DELTA);
+        let mut data = prev.to_vec();
+        let mut pos = 0;
+        while !rest.is_empty() {
+            pos += read_varint(&mut rest);
+            let literals = read_varint(&mut rest);
+            for i in 0..literals {
+                data[pos + i] ^= rest[i];
+            }
+            rest = &rest[literals..];
+            pos += literals;
+        }
+        data
+    }
+
+    // Encodes and decodes data, returning the frame type
+    fn step(deltas: &mut Deltas, prev: &mut Vec<u8>, data: &[u8]) -> u8
+    {
+        deltas.clear_encoded();
+        let range = deltas.encode(1, data).unwrap();
+        let encoded = deltas.encoded(range).to_vec();
+
+        *prev = decode(prev, &encoded);
+        assert_eq!(prev, data);
+        encoded[0]
+    }
+
+    fn payload(seq: u8) -> Vec<u8>
+    {
+        let mut data = vec![0u8; 64];
+        data[0] = seq;
+        data[40] = seq.wrapping_mul(3);
+        data
+    }
+
+    #[test]
+    fn keyframe_every_interval()
+    {
+        let mut deltas = Deltas::new();
+        let mut prev = Vec::new();
+        deltas.set(1, 3);
+
+        let kinds: Vec<u8> = (0..7)
+            .map(|seq| step(&mut deltas, &mut prev, &payload(seq)))
+            .collect();
+        assert_eq!(kinds, vec![KEYFRAME, DELTA, DELTA, KEYFRAME, DELTA, DELTA,
+                               KEYFRAME]);
+    }
+
+    #[test]
+    fn reset_and_skip_force_a_keyframe()
+    {
+        let mut deltas = Deltas::new();
+        let mut prev = Vec::new();
+        deltas.set(1, 100);
+
+        assert_eq!(step(&mut deltas, &mut prev, &payload(1)), KEYFRAME);
+        assert_eq!(step(&mut deltas, &mut prev, &payload(2)), DELTA);
+        deltas.reset();
+        assert_eq!(step(&mut deltas, &mut prev, &payload(3)), KEYFRAME);
+        assert_eq!(step(&mut deltas, &mut prev, &payload(4)), DELTA);
+        deltas.skip(1);
+        assert_eq!(step(&mut deltas, &mut prev, &payload(5)), KEYFRAME);
+        // The countdown starts over with the keyframe
+        for seq in 6..105 {
+            assert_eq!(step(&mut deltas, &mut prev, &payload(seq)), DELTA);
+        }
+        assert_eq!(step(&mut deltas, &mut prev, &payload(105)), KEYFRAME);
+    }
+
+    #[test]
+    fn keyframe_on_length_change_or_larger_delta()
+    {
+        let mut deltas = Deltas::new();
+        let mut prev = Vec::new();
+        deltas.set(1, 100);
+
+        assert_eq!(step(&mut deltas, &mut prev, &[1, 2, 3, 4]), KEYFRAME);
+        assert_eq!(step(&mut deltas, &mut prev, &[1, 2, 3, 4, 5]), KEYFRAME);
+        // Every byte changed: the delta would not be smaller
+        assert_eq!(step(&mut deltas, &mut prev, &[9, 9, 9, 9, 9]), KEYFRAME);
+        assert_eq!(step(&mut deltas, &mut prev, &[9, 9, 9, 9, 8]), DELTA);
+    }
+
+    #[test]
+    fn short_zero_runs_stay_in_the_literal()
+    {
+        let prev = [0u8; 16];
+        let mut data = prev;
+        // Changed, 2 unchanged, changed: one literal run. Then 3 unchanged
+        // bytes end it.
+        data[2] = 1;
+        data[5] = 1;
+        data[9] = 1;
+        let mut out = Vec::new();
+        xor_runs(&prev, &data, &mut out);
+
+        assert_eq!(out, vec![2, 4, 1, 0, 0, 1, 3, 1, 1]);
+    }
+
+    #[test]
+    fn tracepoints_without_delta_mode_are_not_encoded()
+    {
+        let mut deltas = Deltas::new();
+
+        assert!(deltas.encode(1, b"data").is_none());
+        deltas.set(1, 4);
+        assert!(deltas.encode(1, b"data").is_some());
+        deltas.set(1, 0);
+        assert!(deltas.encode(1, b"data").is_none());
+    }
+}
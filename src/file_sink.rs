@@ -0,0 +1,225 @@
+// Copyright 2019, 2020 Rohde & Schwarz GmbH & Co KG
+//      philipp.stanner@rohde-schwarz.com
+//      hagen.pfeifer@rohde-schwarz.com
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// File sink, see tracy_open_file_sink(). Appends the records of the selected
+// tracepoints to size-bounded files for devices running without a client.
+// The files hold the frames a client would receive, see
+// tcp_handler::write_file_sink, each file starting over with the control
+// messages a parser needs, so every file can be read on its own.
+//
+// The current file is at the configured path. When it is full, it becomes
+// path.1, the previous path.1 becomes path.2 and so on, up to max_files
+// rotated files.
+
+use std::fs::{self, File, OpenOptions};
+use std::io;
+use std::time::Instant;
+
+use crate::MAX_TRACEPOINTS;
+
+pub(crate) const DEFAULT_FILE_SIZE: usize = 16 * 1024 * 1024;
+pub(crate) const DEFAULT_MAX_FILES: usize = 4;
+// A file takes at least a few flushes
+const MIN_FILE_SIZE: usize = 64 * 1024;
+
+#[derive(Clone, Copy, PartialEq)]
+pub(crate) enum SyncPolicy {
+    // Writing back is left to the kernel
+    Never,
+    // Each file is synced once it is complete
+    Rotate,
+    // Synced after every flush
+    Flush,
+}
+
+pub(crate) struct SinkConfig {
+    pub(crate) path: String,
+    pub(crate) file_size: usize,
+    // At least 1, the API maps 0 to DEFAULT_MAX_FILES
+    pub(crate) max_files: usize,
+    pub(crate) sync: SyncPolicy,
+    // Frames are LZ4 compressed as for a client setting FLAG_COMPRESSED
+    pub(crate) compress: bool,
+}
+
+
+// Owned by the tracer-thread
+pub(crate) struct FileSink {
+    config: Option<SinkConfig>,
+    file: Option<File>,
+    // Bytes in the current file
+    written: usize,
+    // Indexed by tracepoint handle
+    persisted: Vec<bool>,
+    persisted_count: usize,
+    // Like the fields of tcp_handler::Client, but per file
+    pub(crate) formats_announced: usize,
+    pub(crate) last_calibration: Option<Instant>,
+}
+
+impl FileSink {
+    pub(crate) fn new() -> FileSink
+    {
+        FileSink {
+            config: None,
+            file: None,
+            written: 0,
+            persisted: vec![false; MAX_TRACEPOINTS],
+            persisted_count: 0,
+            formats_announced: 0,
+            last_calibration: None,
+        }
+    }
+
+    // Replaces the sink open before. A file left at the path, e.g. by a
+    // previous run, is rotated away first.
+    pub(crate) fn open(&mut self, mut config: SinkConfig)
+    {
+        self.close();
+
+        config.file_size = config.file_size.max(MIN_FILE_SIZE);
+        self.config = Some(config);
+
+        if let Err(e) = self.rotate() {
+            self.fail(e);
+        }
+    }
+
+    pub(crate) fn close(&mut self)
+    {
+        if let Some(file) = self.file.take() {
+            if self.sync() != SyncPolicy::Never {
+                let _ = file.sync_data();
+            }
+        }
+
+        self.config = None;
+    }
+
+    pub(crate) fn set_persisted(&mut self, handle: usize, persisted: bool)
+    {
+        if self.persisted[handle] != persisted {
+            self.persisted[handle] = persisted;
+            if persisted {
+                self.persisted_count += 1;
+            } else {
+                self.persisted_count -= 1;
+            }
+        }
+    }
+
+    // Whether a file is open and any tracepoint selected
+    pub(crate) fn is_active(&self) -> bool
+    {
+        self.file.is_some() && self.persisted_count > 0
+    }
+
+    pub(crate) fn persisted(&self, handle: usize) -> bool
+    {
+        self.file.is_some() && self.persisted[handle]
+    }
+
+    pub(crate) fn compress(&self) -> bool
+    {
+        self.config.as_ref().map_or(false, |config| config.compress)
+    }
+
+    // Rotates the file if len more bytes would not fit anymore. A file takes
+    // at least one flush, however large.
+    pub(crate) fn make_room(&mut self, len: usize)
+    {
+        let file_size = match &self.config {
+            Some(config) => config.file_size,
+            None => return,
+        };
+
+        if self.written > 0 && self.written + len > file_size {
+            if let Err(e) = self.rotate() {
+                self.fail(e);
+            }
+        }
+    }
+
+    pub(crate) fn file(&self) -> Option<&File>
+    {
+        self.file.as_ref()
+    }
+
+    // After len bytes have been appended to file()
+    pub(crate) fn appended(&mut self, len: usize)
+    {
+        self.written += len;
+    }
+
+    // After everything of a flush has been appended
+    pub(crate) fn flushed(&mut self)
+    {
+        if self.sync() != SyncPolicy::Flush {
+            return;
+        }
+
+        if let Some(file) = &self.file {
+            if let Err(e) = file.sync_data() {
+                self.fail(e);
+            }
+        }
+    }
+
+    // Gives up on the sink, the disk might be full. Reopening it starts over.
+    pub(crate) fn fail(&mut self, e: io::Error)
+    {
+        if let Some(config) = &self.config {
+            eprintln!("tracy: Closed file sink {}: {}", config.path, e);
+        }
+
+        self.file = None;
+        self.config = None;
+    }
+
+    fn sync(&self) -> SyncPolicy
+    {
+        self.config.as_ref().map_or(SyncPolicy::Never, |config| config.sync)
+    }
+
+    // Shifts the rotated files by one, dropping the oldest, and starts a new
+    // current file
+    fn rotate(&mut self) -> io::Result<()>
+    {
+        if let Some(file) = self.file.take() {
+            if self.sync() != SyncPolicy::Never {
+                file.sync_data()?;
+            }
+        }
+
+        let config = self.config.as_ref().unwrap();
+        let path = &config.path;
+
+        for n in (1..config.max_files).rev() {
+            ignore_missing(fs::rename(format!("{}.{}", path, n),
+                                      format!("{}.{}", path, n + 1)))?;
+        }
+        ignore_missing(fs::rename(path, format!("{}.1", path)))?;
+
+        self.file = Some(OpenOptions::new().write(true).create(true)
+                         .truncate(true).open(path)?);
+        self.written = 0;
+        self.formats_announced = 0;
+        self.last_calibration = None;
+
+        Ok(())
+    }
+}
+
+// Rotated files only exist once there has been enough data
+fn ignore_missing(result: io::Result<()>) -> io::Result<()>
+{
+    match result {
+        Err(e) if e.kind() == io::ErrorKind::NotFound => Ok(()),
+        result => result,
+    }
+}
@@ -14,55 +14,137 @@
 
 mod udp_beacon;
 mod tcp_handler;
+mod ring;
+mod clock;
+mod lz4;
+mod delta;
+mod shm;
+mod recorder;
+mod file_sink;
+mod crash;
 
 extern crate mio;
 extern crate mio_extras;
 
 use mio::*;
-use mio::net::{TcpListener, TcpStream};
+use mio::net::TcpListener;
+use mio::unix::EventedFd;
 use mio_extras::channel;
 use mio_extras::channel::{Sender, Receiver};
 use mio_extras::timer::{Timer, Timeout};
 
 use std::thread;
-use std::time::{Duration, SystemTime};
+use std::time::{Duration, Instant};
 
 // for null-pointer-generation
 use std::ptr;
 use std::str::FromStr;
 
 use std::net::{UdpSocket, SocketAddr};
+use std::os::unix::io::AsRawFd;
+use std::os::unix::net::UnixListener;
 
 use std::ffi::CStr;
-use std::os::raw::{c_char, c_int, c_uint};
+use std::os::raw::{c_char, c_int, c_uint, c_void};
 
-use std::sync::Arc;
-use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::{mpsc, Arc, Condvar, Mutex};
+use std::sync::atomic::{AtomicU32, AtomicU64, AtomicU8, AtomicUsize, Ordering};
 
 use std::collections::{HashMap, VecDeque};
 
+use ring::{ByteRing, Slot, ThreadRing, ThreadRings};
+use clock::{Calibrator, Clock};
+
 static SERVER_VERSION: &str = "1.1.0";
-static PROTOCOLL_VERSION: &str = "1.1.0";
+// 1.2.0: Commands 6 to 16 and the header flags, see tlv_documentation.txt
+static PROTOCOLL_VERSION: &str = "1.2.0";
+
+// See EnableFlags::tracer_id
+static NEXT_TRACER_ID: AtomicU32 = AtomicU32::new(0);
 
 const MAX_TRACEPOINT_NAME_LEN: usize = 32;
-const MAX_SUBMIT_LEN: usize = 2048;
+// Size of the enable flag array, see EnableFlags. Must match
+// TRACY_MAX_TRACEPOINTS in tracy.h.
+const MAX_TRACEPOINTS: usize = 4096;
+const CACHE_LINE_LEN: usize = 64;
 
+// Defaults of the sizes tracy_init_ex can change, see Tuning
+const MAX_SUBMIT_LEN: usize = 2048;
 const QUEUE_TOTAL_SIZE: usize = 4096;
+const POLL_EVENTS: usize = 1024;
+// Data lengths are sent as u16
+const MAX_WIRE_DATA_LEN: usize = u16::MAX as usize;
+// Blob lengths and offsets are sent as u32
+const MAX_BLOB_LEN: usize = u32::MAX as usize;
 
 const TIMESTAMP_LEN: usize = 8;
 
+const MAX_FORMAT_STRINGS: usize = 1 << 16;
+const MAX_FORMAT_STRING_LEN: usize = 1024;
+const FORMAT_ID_LEN: usize = 2;
+
+// Set in the tag of ring records which carry RecordKind::Formatted payloads
+const FORMATTED_TAG: u32 = 1 << 31;
+
+// tracy_init flags
+const INIT_FLAG_RING: c_int = 0x1;
+const INIT_FLAG_THREAD_RINGS: c_int = 0x2;
+const INIT_FLAG_CLOCK_MONOTONIC_RAW: c_int = 0x4;
+const INIT_FLAG_CLOCK_MONOTONIC_COARSE: c_int = 0x8;
+const INIT_FLAG_CLOCK_COUNTER: c_int = 0x10;
+const INIT_FLAG_UNIX_SOCKET: c_int = 0x20;
+
+// How often the client is told how to convert the ticks of clocks other than
+// the realtime clock
+const CALIBRATION_INTERVAL: Duration = Duration::from_secs(1);
+
+// Overflow policies of tracy_set_budget
+const OVERFLOW_DROP_NEWEST: c_int = 0;
+const OVERFLOW_DROP_OLDEST: c_int = 1;
+const OVERFLOW_BLOCK: c_int = 2;
+
+const DEFAULT_BUDGET: usize = 16 * 1024 * 1024;
+
+// Sync policies for tracy_open_file_sink
+const SYNC_NEVER: c_int = 0;
+const SYNC_ROTATE: c_int = 1;
+const SYNC_FLUSH: c_int = 2;
+
+// tracy_submit_batch flags
+const BATCH_FLAG_TIMESTAMP_EACH: c_int = 0x1;
+// Records of a batch the ring mode selects at a time, see submit_batch
+const BATCH_CHUNK_LEN: usize = 64;
+
+const RING_SIZE: usize = 256 * 1024;
+const THREAD_RING_SIZE: usize = 64 * 1024;
+
 const QUEUE_TIMEOUT_IDENT: usize = 42;
 const UDP_TIMEOUT_IDENT: usize = 9001;
 
 const CHAN: Token = Token(1);
 const TIMER: Token = Token(2);
 const CON_NEW: Token = Token(3);
-const CON_DATA: Token = Token(4);
+const SUBMIT: Token = Token(5);
+const CON_NEW_UNIX: Token = Token(7);
+// The tokens from here on belong to the clients, see tcp_handler::data_token
+const CLIENT_TOKENS: usize = 16;
 
 
+// Control messages. Payloads take the submit path, see Submitter, except
+// for blobs, which would not fit into the rings.
 enum ChannelMessage {
-    Payload(BufferElement),
     NewTracepoint(Tracepoint),
+    // Handle, keyframe interval, see tracy_set_delta
+    SetDelta(usize, u32),
+    Blob(Blob),
+    // Capacity in bytes, see tracy_set_flight_recorder
+    SetFlightRecorder(usize),
+    // Handle, whether the flight recorder records it
+    SetRecorded(usize, bool),
+    OpenFileSink(file_sink::SinkConfig),
+    CloseFileSink,
+    // Handle, whether the file sink writes it
+    SetPersisted(usize, bool),
     Terminate,
 }
 
@@ -74,17 +156,340 @@ enum TracerState {
 }
 
 
-// Handler struct passed to the C-Application
+// Handler struct passed to the C-Application. tracy.h reads `flags` directly,
+// so it has to stay the first field.
+#[repr(C)]
 struct TracerNg {
+    flags: *const EnableFlags,
+    shared_flags: Arc<EnableFlags>,
     send_to_tracer_thread: Sender<ChannelMessage>,
-    client_connected: Arc<AtomicBool>,
-    tracepoints: HashMap<String, Arc<AtomicBool>>,
+    // Maps tracepoint names to their handles
+    tracepoints: HashMap<String, usize>,
+    // Indexed by tracepoint handle, see tracy_register_h()
+    handles: Vec<Tracepoint>,
+    submitter: Submitter,
+    formats: Arc<Mutex<FormatTable>>,
+    // Source of the record timestamps
+    clock: Clock,
+    budget: Arc<Budget>,
+    max_submit_len: usize,
+    // Shared with the tracer-thread, see tracy_emergency_flush()
+    crash: Arc<crash::CrashState>,
+}
+
+// Format strings registered for deferred printf, see tracy_register_fmt().
+// Shared with the tracer-thread, which announces them to the client before
+// sending records referring to them.
+struct FormatTable {
+    strings: Vec<String>,
+    ids: HashMap<String, usize>,
+}
+
+// The submit rings: either one ring shared by all threads, or one ring per
+// producer thread
+#[derive(Clone)]
+enum RingSet {
+    Shared(Arc<ByteRing>),
+    PerThread(Arc<ThreadRings>),
+}
+
+// Producer side of the path payloads take to the tracer-thread. By default
+// this is a channel; with INIT_FLAG_RING or INIT_FLAG_THREAD_RINGS payloads
+// are written to the submit ring(s) instead.
+struct Submitter {
+    queue: SubmitQueue,
+    wakeup: Arc<Wakeup>,
+}
+
+enum SubmitQueue {
+    Channel {
+        snd: mpsc::Sender<Submitted>,
+        // Payloads handed out by tracy_reserve, keyed by their address
+        reservations: Mutex<HashMap<usize, BufferElement>>,
+    },
+    Rings(RingSet),
+}
+
+// Consumer side of the submit path, owned by the tracer-thread
+struct SubmitDrain {
+    queue: DrainQueue,
+    registration: Registration,
+    wakeup: Arc<Wakeup>,
+}
+
+// What travels through the submit channel. A batch is sent as one message.
+enum Submitted {
+    Record(BufferElement),
+    Batch(Vec<BufferElement>),
+}
+
+enum DrainQueue {
+    Channel(mpsc::Receiver<Submitted>),
+    Rings {
+        rings: RingSet,
+        // Per-thread rings harvested so far, drained round-robin
+        thread_rings: Vec<Arc<ThreadRing>>,
+        next_thread_ring: usize,
+    },
+}
+
+// Coalesces wake-ups of the tracer-thread. Producers account every payload
+// before enqueueing it, but only wake the tracer-thread when data becomes
+// pending at all or when the pending bytes cross high_watermark (the flush
+// threshold). The first wake-up arms the flush timer, which collects
+// everything in between.
+struct Wakeup {
+    pending: AtomicUsize,
+    high_watermark: usize,
+    readiness: SetReadiness,
+}
+
+impl Wakeup {
+    fn add(&self, bytes: usize)
+    {
+        let prev = self.pending.fetch_add(bytes, Ordering::AcqRel);
+        let crossed = prev < self.high_watermark &&
+            prev + bytes >= self.high_watermark;
+
+        if prev == 0 || crossed {
+            let _ = self.readiness.set_readiness(Ready::readable());
+        }
+    }
+
+    // Called for payloads which have been consumed, or which could not be
+    // enqueued after all
+    fn sub(&self, bytes: usize)
+    {
+        self.pending.fetch_sub(bytes, Ordering::AcqRel);
+    }
+
+    fn pending(&self) -> usize
+    {
+        self.pending.load(Ordering::Acquire)
+    }
+}
+
+// Bounds the memory taken by submitted payloads which have not been handed to
+// the connection yet: on the submit path and in the tracer-thread's buffer.
+// Producers charge a payload before enqueueing it, the tracer-thread releases
+// it when the payload leaves the buffer. What happens to payloads exceeding
+// the limit depends on the policy, see tracy_set_budget(). Refused and
+// discarded payloads are counted per tracepoint and reported to the client.
+struct Budget {
+    limit: AtomicUsize,
+    policy: AtomicUsize,
+    block_timeout: AtomicU64, // ms
+    used: AtomicUsize,
+    // Producers blocked by OVERFLOW_BLOCK wait for releases here
+    lock: Mutex<()>,
+    released: Condvar,
+    // Indexed by tracepoint handle
+    dropped: Box<[AtomicU64]>,
+}
+
+impl Budget {
+    fn new() -> Budget
+    {
+        Budget {
+            limit: AtomicUsize::new(DEFAULT_BUDGET),
+            policy: AtomicUsize::new(OVERFLOW_DROP_NEWEST as usize),
+            block_timeout: AtomicU64::new(0),
+            used: AtomicUsize::new(0),
+            lock: Mutex::new(()),
+            released: Condvar::new(),
+            dropped: (0..MAX_TRACEPOINTS).map(|_| AtomicU64::new(0)).collect(),
+        }
+    }
+
+    fn policy(&self) -> c_int
+    {
+        self.policy.load(Ordering::Relaxed) as c_int
+    }
+
+    // Charges bytes for payloads about to be enqueued. Returns false if they
+    // have to be refused; the caller counts them as dropped then.
+    fn charge(&self, bytes: usize) -> bool
+    {
+        match self.policy() {
+            // The tracer-thread makes room by discarding the oldest payloads
+            OVERFLOW_DROP_OLDEST => {
+                self.used.fetch_add(bytes, Ordering::Relaxed);
+                true
+            },
+            OVERFLOW_BLOCK => self.charge_or_wait(bytes),
+            _ => self.try_charge(bytes),
+        }
+    }
+
+    fn try_charge(&self, bytes: usize) -> bool
+    {
+        let prev = self.used.fetch_add(bytes, Ordering::Relaxed);
+        if prev + bytes > self.limit.load(Ordering::Relaxed) {
+            self.used.fetch_sub(bytes, Ordering::Relaxed);
+            return false;
+        }
+
+        true
+    }
+
+    fn charge_or_wait(&self, bytes: usize) -> bool
+    {
+        if self.try_charge(bytes) {
+            return true;
+        }
+
+        let timeout = Duration::from_millis(self.block_timeout
+                                            .load(Ordering::Relaxed));
+        let deadline = Instant::now() + timeout;
+        let mut guard = match self.lock.lock() {
+            Ok(guard) => guard,
+            Err(_) => return false,
+        };
+
+        // Checked under the lock, so a release can't slip in between
+        while !self.try_charge(bytes) {
+            let now = Instant::now();
+            if now >= deadline {
+                return false;
+            }
+
+            guard = match self.released.wait_timeout(guard, deadline - now) {
+                Ok((guard, _)) => guard,
+                Err(_) => return false,
+            };
+        }
+
+        true
+    }
+
+    fn release(&self, bytes: usize)
+    {
+        if bytes == 0 {
+            return;
+        }
+
+        self.uncharge(bytes);
+        self.wake_blocked();
+    }
+
+    // release() without waking blocked producers, for the emergency flush,
+    // which can't take the lock. See TracerContext::settle_emergency.
+    fn uncharge(&self, bytes: usize)
+    {
+        self.used.fetch_sub(bytes, Ordering::Relaxed);
+    }
+
+    fn wake_blocked(&self)
+    {
+        if self.policy() == OVERFLOW_BLOCK {
+            let _guard = self.lock.lock();
+            self.released.notify_all();
+        }
+    }
+
+    fn over_limit(&self) -> bool
+    {
+        self.used.load(Ordering::Relaxed) > self.limit.load(Ordering::Relaxed)
+    }
+
+    fn count_drop(&self, handle: usize)
+    {
+        if let Some(dropped) = self.dropped.get(handle) {
+            dropped.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    // Returns the number of payloads dropped since the last call
+    fn take_dropped(&self, handle: usize) -> u64
+    {
+        match self.dropped.get(handle) {
+            Some(dropped) => dropped.swap(0, Ordering::Relaxed),
+            None => 0,
+        }
+    }
+}
+
+
+// Layout of struct tracy_record from tracy.h
+#[repr(C)]
+struct TracyRecord {
+    handle: c_int,
+    data: *const u8,
+    data_len: usize,
 }
 
 // structuring a new tracepoint to be inserted
+#[derive(Clone)]
 struct Tracepoint {
     name: String,
-    state: Arc<AtomicBool>,
+    handle: usize,
+}
+
+
+// Enable state shared by the application and the tracer-thread. Written only
+// by the tracer-thread; the application reads it, partly without calling into
+// Rust at all: the layout is mirrored by struct tracy_flags in tracy.h.
+// Each flag is either 0 or 1. The client-connected and recording flags sit on
+// a cache line of their own, as they are written on every (dis)connect.
+#[repr(C, align(64))]
+struct EnableFlags {
+    connected: AtomicU8,
+    // Set while the flight recorder or the file sink records any tracepoint
+    recording: AtomicU8,
+    _pad0: [u8; 2],
+    // Unique per process, keys the format ID cache of TRACY_SUBMIT_FMT
+    tracer_id: u32,
+    _pad: [u8; CACHE_LINE_LEN - 8],
+    // Indexed by tracepoint handle
+    enabled: [AtomicU8; MAX_TRACEPOINTS],
+}
+
+impl EnableFlags {
+    fn new() -> EnableFlags
+    {
+        // AtomicU8 is neither Copy nor Clone, so the array can't be built
+        // with the usual repeat expression
+        EnableFlags {
+            connected: AtomicU8::new(0),
+            recording: AtomicU8::new(0),
+            _pad0: [0; 2],
+            tracer_id: NEXT_TRACER_ID.fetch_add(1, Ordering::Relaxed),
+            _pad: [0; CACHE_LINE_LEN - 8],
+            enabled: unsafe { std::mem::zeroed() },
+        }
+    }
+
+    fn connected(&self) -> bool
+    {
+        self.connected.load(Ordering::Relaxed) != 0
+    }
+
+    fn set_connected(&self, state: bool)
+    {
+        self.connected.store(state as u8, Ordering::SeqCst);
+    }
+
+    fn set_recording(&self, state: bool)
+    {
+        self.recording.store(state as u8, Ordering::SeqCst);
+    }
+
+    // Whether submitted payloads go anywhere: to a client, into the flight
+    // recorder or into the file sink
+    fn accepting(&self) -> bool
+    {
+        self.connected() || self.recording.load(Ordering::Relaxed) != 0
+    }
+
+    fn enabled(&self, handle: usize) -> bool
+    {
+        self.enabled[handle].load(Ordering::Relaxed) != 0
+    }
+
+    fn set_enabled(&self, handle: usize, state: bool)
+    {
+        self.enabled[handle].store(state as u8, Ordering::SeqCst);
+    }
 }
 
 
@@ -97,14 +502,95 @@ struct InitData {
     announce_interval: Duration,
     announce_addr: Option<SocketAddr>,
     announce_iface: Option<String>,
+    clock: Clock,
+    tuning: Tuning,
+    // Abstract unix socket name, with INIT_FLAG_UNIX_SOCKET
+    unix_socket: Option<String>,
+}
+
+// Layout of struct tracy_config from tracy.h
+#[repr(C)]
+struct TracyConfig {
+    hostname: *const c_char,
+    process_name: *const c_char,
+    buffer_flush_interval: c_uint,
+    announce_interval: c_uint,
+    announce_iface: *const c_char,
+    announce_mcast_addr: *const c_char,
+    flags: c_int,
+    flush_threshold: usize,
+    max_submit_len: usize,
+    recv_buf_size: usize,
+    poll_events: usize,
+    ring_size: usize,
+    thread_ring_size: usize,
+    backlog_limit: usize,
+    max_clients: usize,
+}
+
+// Buffer sizes of one tracer. tracy_init uses the defaults, tracy_init_ex
+// takes them from struct tracy_config.
+#[derive(Clone, Copy)]
+struct Tuning {
+    // Buffered bytes which are sent without waiting for the flush interval.
+    // Also the size of the frames the buffer is sent in.
+    queue_size: usize,
+    max_submit_len: usize,
+    // Read buffer for messages from the client
+    recv_buf_size: usize,
+    poll_events: usize,
+    ring_size: usize,
+    thread_ring_size: usize,
+    backlog_limit: usize,
+    max_clients: usize,
+}
+
+impl Tuning {
+    // Zeroes select the defaults. Fails if max_submit_len can't be sent.
+    fn from_config(config: &TracyConfig) -> Option<Tuning>
+    {
+        let or = |value: usize, default: usize| {
+            if value == 0 { default } else { value }
+        };
+
+        let tuning = Tuning {
+            queue_size: or(config.flush_threshold, QUEUE_TOTAL_SIZE),
+            max_submit_len: or(config.max_submit_len, MAX_SUBMIT_LEN),
+            recv_buf_size: or(config.recv_buf_size, tcp_handler::REC_BUF_SZ),
+            poll_events: or(config.poll_events, POLL_EVENTS),
+            ring_size: or(config.ring_size, RING_SIZE),
+            thread_ring_size: or(config.thread_ring_size, THREAD_RING_SIZE),
+            backlog_limit: or(config.backlog_limit, tcp_handler::BACKLOG_LIMIT),
+            max_clients: or(config.max_clients, tcp_handler::MAX_CLIENTS),
+        };
+
+        if tuning.max_submit_len > MAX_WIRE_DATA_LEN {
+            return None;
+        }
+
+        Some(tuning)
+    }
+}
+
+// Raw payloads are sent as submitted. Formatted payloads consist of a format
+// string ID followed by the raw printf arguments, and are sent in frames of
+// their own, to be formatted by the client.
+#[derive(Clone, Copy, PartialEq)]
+enum RecordKind {
+    Raw,
+    Formatted,
 }
 
 // structures data from application in submit-function: tracepoint name,
-// associated data and a timestamp when the data was submitted.
+// associated data and a timestamp (in ticks of the tracer's clock, by default
+// ns since UNIX_EPOCH) when the data was submitted.
 // Enqueued in tracer-thread, later serialized and sent over TCP
 struct BufferElement {
     tracepoint: String,
-    timestamp: SystemTime,
+    // Sent instead of the name if the client asked for tracepoint IDs
+    handle: usize,
+    timestamp: u64,
+    kind: RecordKind,
     data: Vec<u8>,
 }
 
@@ -115,6 +601,14 @@ impl BufferElement {
     }
 }
 
+// A payload of tracy_submit_blob, which is sent in chunks, see
+// tcp_handler::Blobs. Charged to the budget until it has been sent.
+struct Blob {
+    handle: usize,
+    timestamp: u64,
+    data: Vec<u8>,
+}
+
 
 struct TracerContext {
     app_cfg: InitData,
@@ -130,25 +624,89 @@ struct TracerContext {
 
     udp_sock: Option<UdpSocket>,
     listener: TcpListener,
-    connection: Option<TcpStream>,
-    // TODO: Check if just checking the Hashmap is faster
-    client_connected: Arc<AtomicBool>,
-    tracepoints: HashMap<String, Arc<AtomicBool>>,
+    // Only with INIT_FLAG_UNIX_SOCKET
+    unix_listener: Option<UnixListener>,
+    // Indexed by slot, see tcp_handler::data_token. Closed clients leave
+    // their slot free for the next one, up to Tuning::max_clients slots.
+    clients: Vec<Option<tcp_handler::Client>>,
+    flags: Arc<EnableFlags>,
+    // Maps tracepoint names to their handles
+    tracepoints: HashMap<String, usize>,
+    // Tracepoint names indexed by handle. Filled in the same order as the
+    // handles are handed out, as NewTracepoint messages arrive in order.
+    tracepoint_names: Vec<String>,
+    submitted: SubmitDrain,
+    formats: Arc<Mutex<FormatTable>>,
     sequence_no: u64,
+    // Only for clocks which need calibration
+    calibrator: Option<Calibrator>,
+    send_scratch: tcp_handler::SendScratch,
+    // Tracepoints whose payloads are sent delta encoded
+    deltas: delta::Deltas,
+    budget: Arc<Budget>,
+    // Bytes the payloads in buffer are charged to the budget with
+    buffer_charged: usize,
+    // Blob IDs, the blobs themselves are queued per client
+    blobs: tcp_handler::Blobs,
+    recorder: recorder::FlightRecorder,
+    file_sink: file_sink::FileSink,
+    crash: Arc<crash::CrashState>,
 }
 
 impl TracerContext {
-    fn append(&mut self, element: BufferElement)
-    {
-        self.buffer_occupancy += element.len();
-        self.buffer.push_back(element);
-    }
-
-    #[allow(dead_code)]
+    // Payloads of recorded tracepoints move on into the flight recorder,
+    // whether they have been sent or not
     fn clear_buffer(&mut self)
     {
+        if self.recorder.is_active() {
+            for element in self.buffer.drain(..) {
+                self.recorder.record(element);
+            }
+        }
+
         self.buffer.clear();
         self.buffer_occupancy = 0;
+        self.budget.release(self.buffer_charged);
+        self.buffer_charged = 0;
+    }
+
+    // Catches up on the emergency flushes since the tracer-thread last
+    // worked on its context: the payloads they sent from the front of the
+    // buffer leave it now. Their budget has been released already.
+    fn settle_emergency(&mut self)
+    {
+        let sent = match self.crash.take_settlement() {
+            Some(sent) => sent,
+            None => return,
+        };
+
+        for element in self.buffer.drain(..sent) {
+            self.buffer_occupancy -= element.len();
+            self.buffer_charged -= TIMESTAMP_LEN + element.data.len();
+            if self.recorder.is_active() {
+                self.recorder.record(element);
+            }
+        }
+
+        self.budget.wake_blocked();
+    }
+
+    // OVERFLOW_DROP_OLDEST: Discards the oldest payloads until the budget
+    // is kept again
+    fn trim_buffer(&mut self)
+    {
+        while self.budget.over_limit() {
+            let element = match self.buffer.pop_front() {
+                Some(element) => element,
+                None => return,
+            };
+
+            let charged = TIMESTAMP_LEN + element.data.len();
+            self.buffer_occupancy -= element.len();
+            self.buffer_charged -= charged;
+            self.budget.release(charged);
+            self.budget.count_drop(element.handle);
+        }
     }
 
     fn check_start_queue_timer(&mut self)
@@ -193,21 +751,61 @@ impl TracerContext {
         self.udp_timeout = None;
     }
 
-    // Handler for TCP connections which either failed during usage or which are
-    // terminated on purpose by either client or library
-    fn close_and_clean_connection(&mut self)
+    fn connected(&self) -> bool
+    {
+        self.clients.iter().any(Option::is_some)
+    }
+
+    // A tracepoint is enabled while any client is subscribed to it, the
+    // flight recorder records it or the file sink writes it
+    fn update_enabled(&self, handle: usize)
+    {
+        let subscribed = self.clients.iter().flatten()
+            .any(|client| client.subscribed(handle));
+        self.flags.set_enabled(handle, subscribed ||
+                                       self.recorder.recorded(handle) ||
+                                       self.file_sink.persisted(handle));
+    }
+
+    // Whether records are kept without a client
+    fn recording(&self) -> bool
     {
-        self.client_connected.store(false, Ordering::SeqCst);
+        self.recorder.is_active() || self.file_sink.is_active()
+    }
 
-        if let Ok(tmp) = self.connection.as_mut().unwrap().try_clone() {
-            let _ = self.poll.deregister(&tmp);
+    // After the flight recorder or the file sink has changed
+    fn update_recording(&mut self)
+    {
+        for handle in self.tracepoints.values() {
+            self.update_enabled(*handle);
         }
 
-        self.connection = None;
-        self.check_stop_queue_timer();
+        self.flags.set_recording(self.recording());
+    }
+
+    // Handler for connections which either failed during usage or which are
+    // terminated on purpose by either client or library. Does nothing if the
+    // client in slot has been closed already.
+    fn close_client(&mut self, slot: usize)
+    {
+        let mut client = match self.clients[slot].take() {
+            Some(client) => client,
+            None => return,
+        };
+
+        let _ = client.deregister(&self.poll);
+        client.discard_blobs();
+
+        for handle in self.tracepoints.values() {
+            self.update_enabled(*handle);
+        }
 
-        for value in self.tracepoints.values() {
-            value.store(false, Ordering::SeqCst);
+        if !self.connected() {
+            self.flags.set_connected(false);
+            // Payloads still pending are due for the recorder or file sink
+            if !self.recording() {
+                self.check_stop_queue_timer();
+            }
         }
 
         self.check_start_udp_timer();
@@ -215,7 +813,112 @@ impl TracerContext {
 
     fn insert_tracepoint(&mut self, tracepoint: Tracepoint)
     {
-        self.tracepoints.insert(tracepoint.name, tracepoint.state);
+        self.tracepoint_names.push(tracepoint.name.clone());
+        self.tracepoints.insert(tracepoint.name, tracepoint.handle);
+    }
+
+    // Moves all payloads which have arrived on the submit path into the
+    // buffer. Returns the number of payloads moved.
+    fn drain_submitted(&mut self) -> usize
+    {
+        let drain = &mut self.submitted;
+
+        // Reset readiness before consuming, so a wake-up arriving meanwhile
+        // is not lost
+        let _ = drain.wakeup.readiness.set_readiness(Ready::empty());
+
+        let names = &self.tracepoint_names;
+        let buffer = &mut self.buffer;
+        let occupancy = &mut self.buffer_occupancy;
+        let mut consumed = 0;
+        let mut charged = 0;
+        let mut n = 0;
+        let mut to_buffer = |element: BufferElement| {
+            *occupancy += element.len();
+            charged += TIMESTAMP_LEN + element.data.len();
+            buffer.push_back(element);
+        };
+
+        match &mut drain.queue {
+            DrainQueue::Channel(rec) => {
+                while let Ok(submitted) = rec.try_recv() {
+                    match submitted {
+                        Submitted::Record(element) => {
+                            consumed += TIMESTAMP_LEN + element.data.len();
+                            to_buffer(element);
+                            n += 1;
+                        },
+                        Submitted::Batch(elements) => {
+                            for element in elements {
+                                consumed += TIMESTAMP_LEN + element.data.len();
+                                to_buffer(element);
+                                n += 1;
+                            }
+                        },
+                    }
+                }
+            },
+            DrainQueue::Rings { rings, thread_rings, next_thread_ring } => {
+                let mut from_ring = |tag: u32, record: &[u8]| {
+                    consumed += record.len();
+                    let handle = (tag & !FORMATTED_TAG) as usize;
+                    let kind = if tag & FORMATTED_TAG != 0 {
+                        RecordKind::Formatted
+                    } else {
+                        RecordKind::Raw
+                    };
+
+                    if let Some(name) = names.get(handle) {
+                        to_buffer(ring_record_to_element(name, handle, kind,
+                                                         record));
+                    }
+                };
+
+                let mut dropped = 0;
+                match rings {
+                    RingSet::Shared(ring) => {
+                        n += ring.consume(&mut from_ring);
+                        dropped += ring.take_dropped();
+                    },
+                    RingSet::PerThread(per_thread) => {
+                        per_thread.harvest(thread_rings);
+
+                        // Start with another thread each time, so no
+                        // producer is preferred when the buffer fills up
+                        let count = thread_rings.len();
+                        for i in 0..count {
+                            let ring =
+                                &thread_rings[(*next_thread_ring + i) % count];
+                            n += ring.ring.consume(&mut from_ring);
+                            dropped += ring.ring.take_dropped();
+                        }
+                        *next_thread_ring = next_thread_ring.wrapping_add(1);
+
+                        // Records of retired rings have all been committed
+                        // before retiring, so the drain above got all of them.
+                        thread_rings.retain(|ring| !ring.is_retired() ||
+                                                   !ring.ring.is_empty());
+                    },
+                }
+
+                if dropped > 0 {
+                    eprintln!("tracy: Submit ring full, dropped {} records.",
+                              dropped);
+                }
+            },
+        }
+
+        drain.wakeup.sub(consumed);
+
+        // Records of tracepoints not known yet are not buffered
+        self.buffer_charged += charged;
+        self.budget.release(consumed - charged);
+
+        if self.budget.policy() == OVERFLOW_DROP_OLDEST {
+            self.trim_buffer();
+        }
+
+        n
     }
 }
 
@@ -228,51 +931,188 @@ extern "C" fn tracy_init(hostname: *const c_char,
                          announce_iface: *const c_char,
                          announce_mcast_addr: *const c_char,
                          flags: c_int) -> *const TracerNg
+{
+    let config = TracyConfig {
+        hostname,
+        process_name,
+        buffer_flush_interval,
+        announce_interval,
+        announce_iface,
+        announce_mcast_addr,
+        flags,
+        flush_threshold: 0,
+        max_submit_len: 0,
+        recv_buf_size: 0,
+        poll_events: 0,
+        ring_size: 0,
+        thread_ring_size: 0,
+        backlog_limit: 0,
+        max_clients: 0,
+    };
+
+    init_tracer(&config)
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_init_ex(config: *const TracyConfig) -> *const TracerNg
+{
+    if config.is_null() {
+        return ptr::null();
+    }
+
+    init_tracer(unsafe{&*config})
+}
+
+
+fn init_tracer(config: &TracyConfig) -> *const TracerNg
 {
     let mut announce = false;
-    let _ = flags; // flags unused. Avoid compiler warning
-    let is_null = hostname.is_null() || process_name.is_null() ||
-                    buffer_flush_interval == 0;
+    let is_null = config.hostname.is_null() || config.process_name.is_null() ||
+                    config.buffer_flush_interval == 0;
     if is_null {
         return ptr::null();
     }
 
+    let tuning = match Tuning::from_config(config) {
+        Some(tuning) => tuning,
+        None => {
+            eprintln!("tracy: max_submit_len exceeds {}.", MAX_WIRE_DATA_LEN);
+            return ptr::null();
+        },
+    };
+
     // There can't be a client connected yet
-    let client_connected_thr = Arc::new(AtomicBool::new(false));
-    let client_connected_ret = Arc::clone(&client_connected_thr);
+    let flags_thr = Arc::new(EnableFlags::new());
+    let flags_ret = Arc::clone(&flags_thr);
+    let budget = Arc::new(Budget::new());
     let (snd, rec): (Sender<ChannelMessage>, Receiver<ChannelMessage>) = 
                      channel::channel();
 
-    let init_data = InitData {
-        hostname: rawpt_to_str(hostname)
+    let mut init_data = InitData {
+        hostname: rawpt_to_str(config.hostname)
             .expect("tracy: hostname broken."),
-        process_name: rawpt_to_str(process_name)
+        process_name: rawpt_to_str(config.process_name)
             .expect("tracy: process_name broken"),
-        send_interval: Duration::from_millis(buffer_flush_interval as u64),
+        send_interval:
+            Duration::from_millis(config.buffer_flush_interval as u64),
         announce_interval:
-            Duration::from_millis(announce_interval as u64),
-        announce_iface: rawpt_to_str(announce_iface),
-        announce_addr: rawpt_to_addr(announce_mcast_addr),
+            Duration::from_millis(config.announce_interval as u64),
+        announce_iface: rawpt_to_str(config.announce_iface),
+        announce_addr: rawpt_to_addr(config.announce_mcast_addr),
+        clock: clock_from_flags(config.flags),
+        tuning,
+        unix_socket: None,
     };
 
+    // Unique per process, and found by looking at the process list
+    if config.flags & INIT_FLAG_UNIX_SOCKET != 0 {
+        init_data.unix_socket = Some(format!("tracy-{}-{}", std::process::id(),
+                                             init_data.process_name));
+    }
+
+    let (submitter, submit_drain) = submit_path(config.flags, &tuning);
+    let crash = Arc::new(crash::CrashState::new(tuning.max_submit_len));
+
+    let formats = Arc::new(Mutex::new(FormatTable {
+        strings: Vec::new(),
+        ids: HashMap::new(),
+    }));
+
     let tracey = TracerNg {
+        flags: &*flags_ret as *const EnableFlags,
+        shared_flags: flags_ret,
         send_to_tracer_thread: snd,
-        client_connected: client_connected_ret,
         tracepoints: HashMap::with_capacity(256),
+        handles: Vec::with_capacity(256),
+        submitter,
+        formats: Arc::clone(&formats),
+        clock: init_data.clock,
+        budget: Arc::clone(&budget),
+        max_submit_len: tuning.max_submit_len,
+        crash: Arc::clone(&crash),
     };
 
-    if announce_interval > 0 && init_data.announce_iface.is_some() &&
+    if config.announce_interval > 0 && init_data.announce_iface.is_some() &&
         init_data.announce_addr.is_some() {
         announce = true;
     }
 
-    thread::spawn(move | | tracer_thread_main(init_data, client_connected_thr,
-                                              rec, announce));
+    thread::spawn(move | | tracer_thread_main(init_data, flags_thr,
+                                              rec, submit_drain, formats,
+                                              budget, crash, announce));
     // Place the struct on the heap and give control to a raw pointer
     Box::into_raw(Box::new(tracey))
 }
 
 
+// Selects the timestamp source. If several clock flags are given, the
+// cheapest clock wins.
+fn clock_from_flags(flags: c_int) -> Clock
+{
+    let clock = if flags & INIT_FLAG_CLOCK_COUNTER != 0 {
+        Clock::Counter
+    } else if flags & INIT_FLAG_CLOCK_MONOTONIC_COARSE != 0 {
+        Clock::MonotonicCoarse
+    } else if flags & INIT_FLAG_CLOCK_MONOTONIC_RAW != 0 {
+        Clock::MonotonicRaw
+    } else {
+        Clock::Realtime
+    };
+
+    clock.available()
+}
+
+
+// Creates both ends of the submit path selected by the tracy_init flags
+fn submit_path(flags: c_int, tuning: &Tuning) -> (Submitter, SubmitDrain)
+{
+    let (registration, readiness) = Registration::new2();
+    let wakeup = Arc::new(Wakeup {
+        pending: AtomicUsize::new(0),
+        high_watermark: tuning.queue_size,
+        readiness,
+    });
+
+    let rings = if flags & INIT_FLAG_THREAD_RINGS != 0 {
+        let rings = ThreadRings::new(tuning.thread_ring_size);
+        Some(RingSet::PerThread(Arc::new(rings)))
+    } else if flags & INIT_FLAG_RING != 0 {
+        Some(RingSet::Shared(Arc::new(ByteRing::new(tuning.ring_size))))
+    } else {
+        None
+    };
+
+    let (queue, drain_queue) = match rings {
+        Some(rings) => (SubmitQueue::Rings(rings.clone()), DrainQueue::Rings {
+            rings,
+            thread_rings: Vec::new(),
+            next_thread_ring: 0,
+        }),
+        None => {
+            let (snd, rec) = mpsc::channel();
+            let queue = SubmitQueue::Channel {
+                snd,
+                reservations: Mutex::new(HashMap::new()),
+            };
+            (queue, DrainQueue::Channel(rec))
+        },
+    };
+
+    let submitter = Submitter {
+        queue,
+        wakeup: Arc::clone(&wakeup),
+    };
+    let drain = SubmitDrain {
+        queue: drain_queue,
+        registration,
+        wakeup,
+    };
+
+    (submitter, drain)
+}
+
+
 fn rawpt_to_addr(cstring: *const c_char) -> Option<SocketAddr>
 {
     let s: String = rawpt_to_str(cstring)?;
@@ -314,9 +1154,7 @@ extern "C" fn tracy_register(tracy: *mut TracerNg,
                                  tp_name_param: *const c_char) -> c_int
 {
     let tracey: &mut TracerNg;
-    let tracepoint: Tracepoint;
     let tp_name: String;
-    let tracepoint_state = Arc::new(AtomicBool::new(false));
 
     if tracy.is_null() {
         eprintln!("tracy_register: Received NULL-Pointer. Ignoring request.");
@@ -333,16 +1171,11 @@ extern "C" fn tracy_register(tracy: *mut TracerNg,
         _ => return -1,
     };
 
-    tracepoint = Tracepoint {
-        name: tp_name_repaired.clone(),
-        state: Arc::clone(&tracepoint_state),
-    };
-
     if !tracey.tracepoints.contains_key(&tp_name_repaired) {
-        tracey.tracepoints.insert(tp_name_repaired, tracepoint_state);
-        let msg = ChannelMessage::NewTracepoint(tracepoint);
-        send_to_tracer(&tracey, msg);
-        0
+        match register_tracepoint(tracey, tp_name_repaired) {
+            Some(_) => 0,
+            None => -1,
+        }
     } else {
         eprintln!("tracy_register: Tracepoint already registered.");
         -1
@@ -350,105 +1183,1223 @@ extern "C" fn tracy_register(tracy: *mut TracerNg,
 }
 
 
-// FIXME Rusts os::raw does not contain the C-bool type.
+// Like tracy_register, but returns the tracepoint's handle. Registering a
+// name twice is not an error here, the existing handle is returned instead.
 #[no_mangle]
-extern "C" fn tracy_tracepoint_enabled(tracy: *const TracerNg,
-                                           tp_name_param: *const c_char) -> bool
+extern "C" fn tracy_register_h(tracy: *mut TracerNg,
+                               tp_name_param: *const c_char) -> c_int
 {
-    let tracey: &TracerNg;
+    let tracey: &mut TracerNg;
     let tp_name: String;
 
+    if tracy.is_null() || tp_name_param.is_null() {
+        eprintln!("tracy_register_h: Received NULL-Pointer. Ignoring request.");
+        return -1;
+    }
+
     unsafe {
-        tracey = &*tracy;
+        tracey = &mut *tracy;
         tp_name = CStr::from_ptr(tp_name_param).to_string_lossy().into_owned();
     }
 
-    tracepoint_enabled(&tracey, &tp_name)
+    let tp_name_repaired = match fix_tracepoint_str(tp_name) {
+        Ok(x) => x,
+        _ => return -1,
+    };
+
+    let handle = match tracey.tracepoints.get(&tp_name_repaired) {
+        Some(handle) => *handle,
+        None => match register_tracepoint(tracey, tp_name_repaired) {
+            Some(handle) => handle,
+            None => return -1,
+        },
+    };
+
+    handle as c_int
 }
 
 
-#[no_mangle]
-extern "C" fn tracy_finit(tracey: *mut TracerNg)
+// Inserts a not yet registered tracepoint and informs the tracer-thread.
+// Returns the new tracepoint's handle, or None if all MAX_TRACEPOINTS enable
+// flags are taken.
+fn register_tracepoint(tracey: &mut TracerNg, tp_name: String) -> Option<usize>
 {
-    let tracer: TracerNg;
+    let handle = tracey.handles.len();
+    if handle >= MAX_TRACEPOINTS {
+        eprintln!("tracy: More than {} tracepoints. Ignoring {}.",
+                  MAX_TRACEPOINTS, tp_name);
+        return None;
+    }
+
+    let tracepoint = Tracepoint {
+        name: tp_name.clone(),
+        handle,
+    };
+
+    tracey.tracepoints.insert(tp_name, handle);
+    tracey.handles.push(tracepoint.clone());
+    send_to_tracer(&tracey, ChannelMessage::NewTracepoint(tracepoint));
+
+    Some(handle)
+}
+
+
+// FIXME Rusts os::raw does not contain the C-bool type.
+#[no_mangle]
+extern "C" fn tracy_tracepoint_enabled(tracy: *const TracerNg,
+                                           tp_name_param: *const c_char) -> bool
+{
+    let tracey: &TracerNg;
+    let tp_name: String;
+
+    unsafe {
+        tracey = &*tracy;
+        tp_name = CStr::from_ptr(tp_name_param).to_string_lossy().into_owned();
+    }
+
+    tracepoint_enabled(&tracey, &tp_name)
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_enabled_h(tracy: *const TracerNg, handle: c_int) -> bool
+{
+    if tracy.is_null() {
+        return false;
+    }
+
+    let tracey = unsafe{&*tracy};
+    match handle_to_tracepoint(tracey, handle) {
+        Some(tracepoint) => tracey.shared_flags.enabled(tracepoint.handle),
+        None => false,
+    }
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_set_budget(tracy: *const TracerNg, bytes: usize,
+                               policy: c_int, block_timeout_ms: c_uint)
+    -> c_int
+{
+    if tracy.is_null() {
+        eprintln!("tracy_set_budget: Received NULL-pointer. Ignoring request.");
+        return -1;
+    }
+
+    match policy {
+        OVERFLOW_DROP_NEWEST | OVERFLOW_DROP_OLDEST | OVERFLOW_BLOCK => (),
+        _ => {
+            eprintln!("tracy_set_budget: Unknown policy {}.", policy);
+            return -1;
+        },
+    }
+
+    let budget = unsafe{&(*tracy).budget};
+    budget.limit.store(bytes, Ordering::Relaxed);
+    budget.block_timeout.store(block_timeout_ms as u64, Ordering::Relaxed);
+    budget.policy.store(policy as usize, Ordering::Relaxed);
+
+    // Blocked producers reevaluate against the new limit and policy
+    if let Ok(_guard) = budget.lock.lock() {
+        budget.released.notify_all();
+    }
+
+    0
+}
+
+
+// Payloads too large for tracy_submit_h. Sent in chunks, interleaved with
+// the other records, see tcp_handler::send_blob_chunks.
+#[no_mangle]
+extern "C" fn tracy_submit_blob(tmp_tracey: *const TracerNg,
+                                handle: c_int,
+                                data: *const u8,
+                                data_len: usize) -> c_int
+{
+    if tmp_tracey.is_null() || data.is_null() {
+        eprintln!("tracy_submit_blob: Received NULL-pointer. Ignoring request.");
+        return -1;
+    }
+
+    let tracey = unsafe{&*tmp_tracey};
+
+    if data_len == 0 || data_len > MAX_BLOB_LEN {
+        eprintln!("tracy_submit_blob: Invalid data_length. Ignoring request.");
+        return -1;
+    }
+
+    let tracepoint = match handle_to_tracepoint(tracey, handle) {
+        Some(tp) => tp,
+        None => {
+            eprintln!("tracy_submit_blob: Invalid tracepoint handle. Ignoring.");
+            return -1;
+        },
+    };
+
+    if !tracey.shared_flags.enabled(tracepoint.handle) {
+        return -1;
+    }
+
+    let timestamp = tracey.clock.now();
+    if !tracey.budget.charge(TIMESTAMP_LEN + data_len) {
+        tracey.budget.count_drop(tracepoint.handle);
+        return -1;
+    }
+
+    let blob = Blob {
+        handle: tracepoint.handle,
+        timestamp,
+        data: unsafe{ std::slice::from_raw_parts(data, data_len) }.to_vec(),
+    };
+    send_to_tracer(tracey, ChannelMessage::Blob(blob));
+
+    0
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_set_delta(tracy: *const TracerNg, handle: c_int,
+                              keyframe_interval: c_uint) -> c_int
+{
+    if tracy.is_null() {
+        eprintln!("tracy_set_delta: Received NULL-pointer. Ignoring request.");
+        return -1;
+    }
+
+    let tracey = unsafe{&*tracy};
+    let tracepoint = match handle_to_tracepoint(tracey, handle) {
+        Some(tracepoint) => tracepoint,
+        None => {
+            eprintln!("tracy_set_delta: Invalid handle {}.", handle);
+            return -1;
+        },
+    };
+
+    // The payloads are encoded where they are sent
+    send_to_tracer(tracey, ChannelMessage::SetDelta(tracepoint.handle,
+                                                    keyframe_interval));
+    0
+}
+
+
+// The flight recorder keeps recording while no client is connected, see
+// recorder::FlightRecorder. A capacity of 0 switches it off.
+#[no_mangle]
+extern "C" fn tracy_set_flight_recorder(tracy: *const TracerNg,
+                                        capacity: usize) -> c_int
+{
+    if tracy.is_null() {
+        eprintln!("tracy_set_flight_recorder: Received NULL-pointer. \
+                  Ignoring request.");
+        return -1;
+    }
+
+    let tracey = unsafe{&*tracy};
+    send_to_tracer(tracey, ChannelMessage::SetFlightRecorder(capacity));
+    0
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_set_recorded(tracy: *const TracerNg, handle: c_int,
+                                 recorded: bool) -> c_int
+{
+    if tracy.is_null() {
+        eprintln!("tracy_set_recorded: Received NULL-pointer. Ignoring request.");
+        return -1;
+    }
+
+    let tracey = unsafe{&*tracy};
+    let tracepoint = match handle_to_tracepoint(tracey, handle) {
+        Some(tracepoint) => tracepoint,
+        None => {
+            eprintln!("tracy_set_recorded: Invalid handle {}.", handle);
+            return -1;
+        },
+    };
+
+    send_to_tracer(tracey, ChannelMessage::SetRecorded(tracepoint.handle,
+                                                       recorded));
+    0
+}
+
+
+// Layout of struct tracy_file_sink from tracy.h
+#[repr(C)]
+struct TracyFileSink {
+    path: *const c_char,
+    file_size: usize,
+    max_files: c_uint,
+    sync: c_int,
+    compress: bool,
+}
+
+// The files are opened by the tracer-thread, which writes them, see
+// file_sink::FileSink. Failing to open them is only reported on stderr.
+#[no_mangle]
+extern "C" fn tracy_open_file_sink(tracy: *const TracerNg,
+                                   sink: *const TracyFileSink) -> c_int
+{
+    if tracy.is_null() || sink.is_null() {
+        eprintln!("tracy_open_file_sink: Received NULL-pointer. Ignoring request.");
+        return -1;
+    }
+
+    let tracey = unsafe{&*tracy};
+    let sink = unsafe{&*sink};
+
+    if sink.path.is_null() {
+        eprintln!("tracy_open_file_sink: No path given. Ignoring request.");
+        return -1;
+    }
+    let path = match unsafe{ CStr::from_ptr(sink.path) }.to_str() {
+        Ok(path) if !path.is_empty() => path.to_string(),
+        _ => {
+            eprintln!("tracy_open_file_sink: Invalid path. Ignoring request.");
+            return -1;
+        },
+    };
+
+    let sync = match sink.sync {
+        SYNC_NEVER => file_sink::SyncPolicy::Never,
+        SYNC_ROTATE => file_sink::SyncPolicy::Rotate,
+        SYNC_FLUSH => file_sink::SyncPolicy::Flush,
+        _ => {
+            eprintln!("tracy_open_file_sink: Unknown sync policy {}.", sink.sync);
+            return -1;
+        },
+    };
+
+    let or = |value: usize, default: usize| {
+        if value == 0 { default } else { value }
+    };
+    let config = file_sink::SinkConfig {
+        path,
+        file_size: or(sink.file_size, file_sink::DEFAULT_FILE_SIZE),
+        max_files: or(sink.max_files as usize, file_sink::DEFAULT_MAX_FILES),
+        sync,
+        compress: sink.compress,
+    };
+
+    send_to_tracer(tracey, ChannelMessage::OpenFileSink(config));
+    0
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_close_file_sink(tracy: *const TracerNg) -> c_int
+{
+    if tracy.is_null() {
+        eprintln!("tracy_close_file_sink: Received NULL-pointer. Ignoring request.");
+        return -1;
+    }
+
+    let tracey = unsafe{&*tracy};
+    send_to_tracer(tracey, ChannelMessage::CloseFileSink);
+    0
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_set_persisted(tracy: *const TracerNg, handle: c_int,
+                                  persisted: bool) -> c_int
+{
+    if tracy.is_null() {
+        eprintln!("tracy_set_persisted: Received NULL-pointer. Ignoring request.");
+        return -1;
+    }
+
+    let tracey = unsafe{&*tracy};
+    let tracepoint = match handle_to_tracepoint(tracey, handle) {
+        Some(tracepoint) => tracepoint,
+        None => {
+            eprintln!("tracy_set_persisted: Invalid handle {}.", handle);
+            return -1;
+        },
+    };
+
+    send_to_tracer(tracey, ChannelMessage::SetPersisted(tracepoint.handle,
+                                                        persisted));
+    0
+}
+
+
+// Flushes the tracer on SIGSEGV, SIGBUS, SIGILL, SIGFPE and SIGABRT, see
+// crash.rs. The handler is installed with the first tracer and stays, other
+// tracers are added to it.
+#[no_mangle]
+extern "C" fn tracy_install_crash_handler(tracy: *const TracerNg) -> c_int
+{
+    if tracy.is_null() {
+        eprintln!("tracy_install_crash_handler: Received NULL-pointer. \
+                  Ignoring request.");
+        return -1;
+    }
+
+    let tracey = unsafe{&*tracy};
+    if crash::install(&tracey.crash).is_err() {
+        eprintln!("tracy_install_crash_handler: Could not install crash \
+                  handler.");
+        return -1;
+    }
+
+    0
+}
+
+
+// Async-signal-safe, so nothing is printed here
+#[no_mangle]
+extern "C" fn tracy_emergency_flush(tracy: *const TracerNg) -> c_int
+{
+    if tracy.is_null() {
+        return -1;
+    }
+
+    let tracey = unsafe{&*tracy};
+    if !tracey.crash.emergency_flush() {
+        return -1;
+    }
+
+    0
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_finit(tracey: *mut TracerNg)
+{
+    let tracer: TracerNg;
     // Box takes ownership and deallocates the heap-located TracerNg struct
-    // when going out of scope, including the Arc<AtomicBool>
+    // when going out of scope, including its reference to the EnableFlags
     tracer = unsafe{ *Box::from_raw(tracey) };
 
-    send_to_tracer(&tracer, ChannelMessage::Terminate);
+    crash::uninstall(&tracer.crash);
+    send_to_tracer(&tracer, ChannelMessage::Terminate);
+}
+
+
+// TODO:
+// submit checks de facto two times if the client is conncted: Once with
+// the client-connected flag, later again by looking in the HashMap if the
+// tracepoint is activated. Maybe only checking the HashMap is better
+#[no_mangle]
+extern "C" fn tracy_submit(tmp_tracey: *const TracerNg,
+                               tp_name_param: *const c_char,
+                               data: *const u8,
+                               data_len: usize)
+{
+    let tracey: &TracerNg;
+
+    if tmp_tracey.is_null() || tp_name_param.is_null() || data.is_null() {
+        eprintln!("tracy_submit: Received NULL-pointer. Ignoring request.");
+        return;
+    }
+    
+    // Don't pack raw pointer in a Box, otherwise the memory of tmp_tracey
+    // would get deallocated when submit returns.
+    tracey = unsafe{&*tmp_tracey};
+
+    if data_len == 0 || data_len > tracey.max_submit_len {
+        eprintln!("tracy_submit: Invalid data_length. Ignoring request.");
+        return;
+    }
+
+    if !tracey.shared_flags.accepting() {
+        return;
+    }
+
+    let tp_name = unsafe{ CStr::from_ptr(tp_name_param) };
+    let handle = match lookup_tracepoint(&tracey, tp_name) {
+        Ok(Some(handle)) => handle,
+        Ok(None) => return,
+        Err(_) => {
+            eprintln!("tracy_submit: Tracepoint-String broken. Ignoring.");
+            return;
+        },
+    };
+
+    if !tracey.shared_flags.enabled(handle) {
+        return;
+    }
+
+    let data = unsafe{ std::slice::from_raw_parts(data, data_len) };
+    submit_record(&tracey, handle, data);
+}
+
+
+// Same as tracy_submit, but the tracepoint is addressed by the handle returned
+// from tracy_register_h, which spares the name-processing on every call.
+#[no_mangle]
+extern "C" fn tracy_submit_h(tmp_tracey: *const TracerNg,
+                             handle: c_int,
+                             data: *const u8,
+                             data_len: usize)
+{
+    let tracey: &TracerNg;
+
+    if tmp_tracey.is_null() || data.is_null() {
+        eprintln!("tracy_submit_h: Received NULL-pointer. Ignoring request.");
+        return;
+    }
+
+    tracey = unsafe{&*tmp_tracey};
+
+    if data_len == 0 || data_len > tracey.max_submit_len {
+        eprintln!("tracy_submit_h: Invalid data_length. Ignoring request.");
+        return;
+    }
+
+    if !tracey.shared_flags.accepting() {
+        return;
+    }
+
+    let tracepoint = match handle_to_tracepoint(tracey, handle) {
+        Some(tp) => tp,
+        None => {
+            eprintln!("tracy_submit_h: Invalid tracepoint handle. Ignoring.");
+            return;
+        },
+    };
+
+    if !tracey.shared_flags.enabled(tracepoint.handle) {
+        return;
+    }
+
+    let data = unsafe{ std::slice::from_raw_parts(data, data_len) };
+    submit_record(&tracey, handle as usize, data);
+}
+
+
+// Registers a format string for deferred printf and returns its ID. The
+// same string always yields the same ID.
+#[no_mangle]
+extern "C" fn tracy_register_fmt(tmp_tracey: *const TracerNg,
+                                 fmt: *const c_char) -> c_int
+{
+    if tmp_tracey.is_null() || fmt.is_null() {
+        eprintln!("tracy_register_fmt: Received NULL-pointer. Ignoring request.");
+        return -1;
+    }
+
+    let tracey = unsafe{&*tmp_tracey};
+    let fmt = unsafe{ CStr::from_ptr(fmt) }.to_string_lossy().into_owned();
+    if fmt.len() > MAX_FORMAT_STRING_LEN {
+        eprintln!("tracy_register_fmt: Format string too long. Ignoring.");
+        return -1;
+    }
+
+    let mut formats = match tracey.formats.lock() {
+        Ok(formats) => formats,
+        Err(_) => return -1,
+    };
+
+    if let Some(id) = formats.ids.get(&fmt) {
+        return *id as c_int;
+    }
+
+    if formats.strings.len() >= MAX_FORMAT_STRINGS {
+        eprintln!("tracy_register_fmt: Too many format strings. Ignoring.");
+        return -1;
+    }
+
+    let id = formats.strings.len();
+    formats.strings.push(fmt.clone());
+    formats.ids.insert(fmt, id);
+
+    id as c_int
+}
+
+
+// Submits the raw arguments of a deferred printf call, as encoded by
+// tracy_submit_fmt() in tracy.h. The record carries the format string ID in
+// front of the arguments.
+#[no_mangle]
+extern "C" fn tracy_submit_fmt_args(tmp_tracey: *const TracerNg,
+                                    handle: c_int,
+                                    fmt_id: c_int,
+                                    args: *const u8,
+                                    args_len: usize)
+{
+    if tmp_tracey.is_null() || (args.is_null() && args_len > 0) {
+        eprintln!("tracy_submit_fmt_args: Received NULL-pointer. Ignoring \
+                  request.");
+        return;
+    }
+
+    let tracey = unsafe{&*tmp_tracey};
+
+    if fmt_id < 0 || fmt_id as usize >= MAX_FORMAT_STRINGS ||
+        args_len > tracey.max_submit_len.saturating_sub(FORMAT_ID_LEN) {
+        eprintln!("tracy_submit_fmt_args: Invalid parameters. Ignoring request.");
+        return;
+    }
+
+    if !tracey.shared_flags.accepting() {
+        return;
+    }
+
+    let args = if args_len > 0 {
+        unsafe{ std::slice::from_raw_parts(args, args_len) }
+    } else {
+        &[]
+    };
+    let id = (fmt_id as u16).to_be_bytes();
+
+    match handle_to_tracepoint(tracey, handle) {
+        Some(tp) if tracey.shared_flags.enabled(tp.handle) => submit_gathered(&tracey,
+            handle as usize, RecordKind::Formatted, FORMAT_ID_LEN + args_len,
+            std::iter::once(&id[..]).chain(std::iter::once(args))),
+        _ => (),
+    }
+}
+
+
+// Gathering variant of tracy_submit: the payload is given as an array of
+// struct iovec and copied piece by piece into the record.
+#[no_mangle]
+extern "C" fn tracy_submitv(tmp_tracey: *const TracerNg,
+                            tp_name_param: *const c_char,
+                            iov: *const libc::iovec,
+                            iovcnt: c_int)
+{
+    if tmp_tracey.is_null() || tp_name_param.is_null() || iov.is_null() {
+        eprintln!("tracy_submitv: Received NULL-pointer. Ignoring request.");
+        return;
+    }
+
+    let tracey = unsafe{&*tmp_tracey};
+
+    let iov = match iov_to_slice(iov, iovcnt, tracey.max_submit_len) {
+        Some(iov) => iov,
+        None => {
+            eprintln!("tracy_submitv: Invalid iovec. Ignoring request.");
+            return;
+        },
+    };
+
+    if !tracey.shared_flags.accepting() {
+        return;
+    }
+
+    let tp_name = unsafe{ CStr::from_ptr(tp_name_param) };
+    let handle = match lookup_tracepoint(&tracey, tp_name) {
+        Ok(Some(handle)) => handle,
+        Ok(None) => return,
+        Err(_) => {
+            eprintln!("tracy_submitv: Tracepoint-String broken. Ignoring.");
+            return;
+        },
+    };
+
+    if !tracey.shared_flags.enabled(handle) {
+        return;
+    }
+
+    submit_gathered(&tracey, handle, RecordKind::Raw, iov_total_len(iov),
+                    iov_parts(iov));
 }
 
 
-// TODO:
-// submit checks de facto two times if the client is conncted: Once with
-// the AtomicBool client_connected, later again by looking in the HashMap if the
-// tracepoint is activated. Maybe only checking the HashMap is better
 #[no_mangle]
-extern "C" fn tracy_submit(tmp_tracey: *const TracerNg,
-                               tp_name_param: *const c_char,
-                               data: *const u8,
-                               data_len: usize)
+extern "C" fn tracy_submitv_h(tmp_tracey: *const TracerNg,
+                              handle: c_int,
+                              iov: *const libc::iovec,
+                              iovcnt: c_int)
 {
-    let tracey: &TracerNg;
-    let buffer_element: BufferElement;
-    let tracepoint: String;
+    if tmp_tracey.is_null() || iov.is_null() {
+        eprintln!("tracy_submitv_h: Received NULL-pointer. Ignoring request.");
+        return;
+    }
 
-    if tmp_tracey.is_null() || tp_name_param.is_null() || data.is_null() {
-        eprintln!("tracy_submit: Received NULL-pointer. Ignoring request.");
+    let tracey = unsafe{&*tmp_tracey};
+
+    let iov = match iov_to_slice(iov, iovcnt, tracey.max_submit_len) {
+        Some(iov) => iov,
+        None => {
+            eprintln!("tracy_submitv_h: Invalid iovec. Ignoring request.");
+            return;
+        },
+    };
+
+    if !tracey.shared_flags.accepting() {
         return;
     }
-    
-    if data_len == 0 || data_len > MAX_SUBMIT_LEN {
-        eprintln!("tracy_submit: Invalid data_length. Ignoring request.");
+
+    match handle_to_tracepoint(tracey, handle) {
+        Some(tp) if tracey.shared_flags.enabled(tp.handle) => submit_gathered(&tracey,
+            handle as usize, RecordKind::Raw, iov_total_len(iov),
+            iov_parts(iov)),
+        _ => (),
+    }
+}
+
+
+// Checks the iovec array passed by the application. Fails if the array is
+// empty, an element without memory has a length, or the total length is 0 or
+// larger than max_len.
+fn iov_to_slice<'a>(iov: *const libc::iovec, iovcnt: c_int, max_len: usize)
+    -> Option<&'a [libc::iovec]>
+{
+    if iovcnt <= 0 {
+        return None;
+    }
+
+    let iov = unsafe{ std::slice::from_raw_parts(iov, iovcnt as usize) };
+    let mut total: usize = 0;
+    for vec in iov {
+        if vec.iov_base.is_null() && vec.iov_len > 0 {
+            return None;
+        }
+        total = total.checked_add(vec.iov_len)?;
+    }
+
+    if total == 0 || total > max_len {
+        return None;
+    }
+
+    Some(iov)
+}
+
+
+fn iov_total_len(iov: &[libc::iovec]) -> usize
+{
+    iov.iter().map(|vec| vec.iov_len).sum()
+}
+
+
+fn iov_parts<'a>(iov: &'a [libc::iovec])
+    -> impl Iterator<Item = &'a [u8]> + 'a
+{
+    iov.iter()
+        .filter(|vec| vec.iov_len > 0)
+        .map(|vec| iov_bytes(vec))
+}
+
+
+// An iovec over bytes which are only read, as by writev
+fn iovec(bytes: &[u8]) -> libc::iovec
+{
+    libc::iovec {
+        iov_base: bytes.as_ptr() as *mut c_void,
+        iov_len: bytes.len(),
+    }
+}
+
+
+fn iov_bytes(iov: &libc::iovec) -> &[u8]
+{
+    unsafe{ std::slice::from_raw_parts(iov.iov_base as *const u8, iov.iov_len) }
+}
+
+
+// Drops the first len bytes of a partially written iovec
+fn advance_iovec(iov: &mut libc::iovec, len: usize)
+{
+    iov.iov_base = (iov.iov_base as *mut u8).wrapping_add(len) as *mut c_void;
+    iov.iov_len -= len;
+}
+
+
+// Hands a payload for an enabled tracepoint over to the tracer-thread, either
+// through the submit ring(s) or the channel.
+fn submit_record(tracey: &TracerNg, handle: usize, data: &[u8])
+{
+    submit_gathered(tracey, handle, RecordKind::Raw, data.len(),
+                    std::iter::once(data));
+}
+
+
+// Like submit_record, but the payload consists of several parts, which sum up
+// to data_len bytes. The parts are copied directly into the record.
+fn submit_gathered<'a, I>(tracey: &TracerNg, handle: usize, kind: RecordKind,
+                          data_len: usize, parts: I)
+    where I: Iterator<Item = &'a [u8]>
+{
+    let timestamp = tracey.clock.now();
+    let submitter = &tracey.submitter;
+    let pending = TIMESTAMP_LEN + data_len;
+
+    if !tracey.budget.charge(pending) {
+        tracey.budget.count_drop(handle);
         return;
     }
 
-    // Don't pack raw pointer in a Box, otherwise the memory of tmp_tracey
-    // would get deallocated when submit returns.
-    tracey = unsafe{&*tmp_tracey};
-    if !tracey.client_connected.load(Ordering::SeqCst) {
+    // Account before enqueueing, so the tracer-thread never consumes bytes
+    // it has not seen being added
+    submitter.wakeup.add(pending);
+
+    let enqueued = match &submitter.queue {
+        SubmitQueue::Rings(rings) => {
+            let timestamp = timestamp.to_ne_bytes();
+            let parts = std::iter::once(&timestamp[..])
+                .chain(parts.map(|part| &part[..]));
+            let tag = match kind {
+                RecordKind::Raw => handle as u32,
+                RecordKind::Formatted => handle as u32 | FORMATTED_TAG,
+            };
+
+            // Ring full: the record is dropped and counted by the ring
+            match rings {
+                RingSet::Shared(ring) => ring.push(tag, pending, parts),
+                RingSet::PerThread(rings) => rings
+                    .with_local(|ring| ring.push_exclusive(tag, pending, parts))
+                    .unwrap_or(false),
+            }
+        },
+        SubmitQueue::Channel { snd, .. } => {
+            let mut data = Vec::with_capacity(data_len);
+            for part in parts {
+                data.extend_from_slice(part);
+            }
+
+            let buffer_element = BufferElement {
+                tracepoint: tracey.handles[handle].name.clone(),
+                handle,
+                timestamp,
+                kind,
+                data,
+            };
+
+            snd.send(Submitted::Record(buffer_element)).is_ok()
+        },
+    };
+
+    if !enqueued {
+        submitter.wakeup.sub(pending);
+        tracey.budget.release(pending);
+        tracey.budget.count_drop(handle);
+    }
+}
+
+
+// Submits several records, possibly to different tracepoints, at once. The
+// connection is checked once; records to invalid handles or disabled
+// tracepoints and records with an invalid length are skipped. All records
+// share one timestamp, unless BATCH_FLAG_TIMESTAMP_EACH is set.
+#[no_mangle]
+extern "C" fn tracy_submit_batch(tmp_tracey: *const TracerNg,
+                                 recs: *const TracyRecord,
+                                 n: usize,
+                                 flags: c_int)
+{
+    if tmp_tracey.is_null() || recs.is_null() {
+        eprintln!("tracy_submit_batch: Received NULL-pointer. Ignoring request.");
         return;
     }
 
-    unsafe {
-        tracepoint = CStr::from_ptr(tp_name_param)
-            .to_string_lossy().into_owned();
+    let tracey = unsafe{&*tmp_tracey};
+    if n == 0 || !tracey.shared_flags.accepting() {
+        return;
     }
 
-    let tracepoint_repaired = match fix_tracepoint_str(tracepoint) {
-        Ok(x) => x,
-        _ => {
-            eprintln!("tracy_submit: Tracepoint-String broken. Ignoring.");
+    let recs = unsafe{ std::slice::from_raw_parts(recs, n) };
+    submit_batch(&tracey, recs, flags & BATCH_FLAG_TIMESTAMP_EACH != 0);
+}
+
+
+// Returns handle and payload of a batch record which is to be submitted
+fn batch_record<'a>(tracey: &TracerNg, rec: &'a TracyRecord)
+    -> Option<(usize, &'a [u8])>
+{
+    if rec.data.is_null() || rec.data_len == 0 ||
+        rec.data_len > tracey.max_submit_len {
+        return None;
+    }
+
+    let tracepoint = handle_to_tracepoint(tracey, rec.handle)?;
+    if !tracey.shared_flags.enabled(tracepoint.handle) {
+        return None;
+    }
+
+    Some((tracepoint.handle,
+          unsafe{ std::slice::from_raw_parts(rec.data, rec.data_len) }))
+}
+
+
+// Records are selected once, so the bytes charged are the bytes enqueued even
+// if a tracepoint is switched meanwhile. The channel takes the batch in one
+// message. The rings take it in chunks selected on the stack, each charged
+// and announced as a whole.
+fn submit_batch(tracey: &TracerNg, recs: &[TracyRecord], timestamp_each: bool)
+{
+    let submitter = &tracey.submitter;
+    let batch_timestamp = tracey.clock.now();
+    let timestamp = || if timestamp_each {
+        tracey.clock.now()
+    } else {
+        batch_timestamp
+    };
+
+    let snd = match &submitter.queue {
+        SubmitQueue::Channel { snd, .. } => snd,
+        SubmitQueue::Rings(rings) => {
+            for chunk in recs.chunks(BATCH_CHUNK_LEN) {
+                let mut records = [(0, &[][..]); BATCH_CHUNK_LEN];
+                let mut count = 0;
+                for record in chunk.iter()
+                    .filter_map(|rec| batch_record(tracey, rec)) {
+                    records[count] = record;
+                    count += 1;
+                }
+                push_batch(tracey, rings, &records[..count], &timestamp);
+            }
             return;
         },
     };
 
-    if !tracepoint_enabled(&tracey, &tracepoint_repaired) {
+    let elements: Vec<BufferElement> = recs.iter()
+        .filter_map(|rec| batch_record(tracey, rec))
+        .map(|(handle, data)| BufferElement {
+            tracepoint: tracey.handles[handle].name.clone(),
+            handle,
+            timestamp: timestamp(),
+            kind: RecordKind::Raw,
+            data: data.to_vec(),
+        })
+        .collect();
+    let pending: usize = elements.iter().map(|e| TIMESTAMP_LEN + e.data.len())
+        .sum();
+    if pending == 0 {
+        return;
+    }
+
+    // The batch is charged as a whole
+    if !tracey.budget.charge(pending) {
+        for element in &elements {
+            tracey.budget.count_drop(element.handle);
+        }
+        return;
+    }
+
+    // One wake-up for the whole batch, see submit_gathered
+    submitter.wakeup.add(pending);
+
+    if snd.send(Submitted::Batch(elements)).is_err() {
+        submitter.wakeup.sub(pending);
+        tracey.budget.release(pending);
+    }
+}
+
+
+// Pushes a chunk of records returned by batch_record to the rings
+fn push_batch(tracey: &TracerNg, rings: &RingSet, records: &[(usize, &[u8])],
+              timestamp: &dyn Fn() -> u64)
+{
+    let submitter = &tracey.submitter;
+    let pending: usize = records.iter()
+        .map(|(_, data)| TIMESTAMP_LEN + data.len())
+        .sum();
+    if pending == 0 {
+        return;
+    }
+
+    if !tracey.budget.charge(pending) {
+        for (handle, _) in records {
+            tracey.budget.count_drop(*handle);
+        }
+        return;
+    }
+
+    submitter.wakeup.add(pending);
+
+    let push = |ring: &ByteRing, exclusive: bool| {
+        let mut enqueued = 0;
+        for &(handle, data) in records {
+            let len = TIMESTAMP_LEN + data.len();
+            let timestamp = timestamp().to_ne_bytes();
+            let parts = std::iter::once(&timestamp[..])
+                .chain(std::iter::once(data));
+            let pushed = if exclusive {
+                ring.push_exclusive(handle as u32, len, parts)
+            } else {
+                ring.push(handle as u32, len, parts)
+            };
+            if pushed {
+                enqueued += len;
+            } else {
+                tracey.budget.count_drop(handle);
+            }
+        }
+        enqueued
+    };
+
+    let enqueued = match rings {
+        RingSet::Shared(ring) => push(ring, false),
+        RingSet::PerThread(rings) => rings
+            .with_local(|ring| push(ring, true))
+            .unwrap_or(0),
+    };
+
+    if enqueued < pending {
+        submitter.wakeup.sub(pending - enqueued);
+        tracey.budget.release(pending - enqueued);
+    }
+}
+
+
+// Reserves data_len bytes for a payload to the given tracepoint. The
+// application writes the payload to the returned memory and publishes it with
+// tracy_commit. Returns NULL under the same conditions under which
+// tracy_submit would ignore the request.
+#[no_mangle]
+extern "C" fn tracy_reserve(tmp_tracey: *const TracerNg,
+                            tp_name_param: *const c_char,
+                            data_len: usize) -> *mut u8
+{
+    if tmp_tracey.is_null() || tp_name_param.is_null() {
+        eprintln!("tracy_reserve: Received NULL-pointer. Ignoring request.");
+        return ptr::null_mut();
+    }
+
+    let tracey = unsafe{&*tmp_tracey};
+
+    if data_len == 0 || data_len > tracey.max_submit_len {
+        eprintln!("tracy_reserve: Invalid data_length. Ignoring request.");
+        return ptr::null_mut();
+    }
+
+    if !tracey.shared_flags.accepting() {
+        return ptr::null_mut();
+    }
+
+    let tp_name = unsafe{ CStr::from_ptr(tp_name_param) };
+    let handle = match lookup_tracepoint(&tracey, tp_name) {
+        Ok(Some(handle)) => handle,
+        Ok(None) => return ptr::null_mut(),
+        Err(_) => {
+            eprintln!("tracy_reserve: Tracepoint-String broken. Ignoring.");
+            return ptr::null_mut();
+        },
+    };
+
+    if !tracey.shared_flags.enabled(handle) {
+        return ptr::null_mut();
+    }
+
+    reserve_record(&tracey, handle, data_len)
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_reserve_h(tmp_tracey: *const TracerNg,
+                              handle: c_int,
+                              data_len: usize) -> *mut u8
+{
+    if tmp_tracey.is_null() {
+        eprintln!("tracy_reserve_h: Received NULL-pointer. Ignoring request.");
+        return ptr::null_mut();
+    }
+
+    let tracey = unsafe{&*tmp_tracey};
+
+    if data_len == 0 || data_len > tracey.max_submit_len {
+        eprintln!("tracy_reserve_h: Invalid data_length. Ignoring request.");
+        return ptr::null_mut();
+    }
+
+    if !tracey.shared_flags.accepting() {
+        return ptr::null_mut();
+    }
+
+    match handle_to_tracepoint(tracey, handle) {
+        Some(tp) if tracey.shared_flags.enabled(tp.handle) =>
+            reserve_record(&tracey, handle as usize, data_len),
+        _ => ptr::null_mut(),
+    }
+}
+
+
+#[no_mangle]
+extern "C" fn tracy_commit(tmp_tracey: *const TracerNg, reservation: *mut u8)
+{
+    if tmp_tracey.is_null() || reservation.is_null() {
+        eprintln!("tracy_commit: Received NULL-pointer. Ignoring request.");
         return;
     }
 
+    let tracey = unsafe{&*tmp_tracey};
+    if !commit_record(&tracey, reservation) {
+        eprintln!("tracy_commit: Unknown reservation. Ignoring request.");
+    }
+}
+
+
+// In ring mode, the payload is reserved directly in the submit ring, behind
+// the timestamp. Otherwise it is allocated and kept aside until commit.
+fn reserve_record(tracey: &TracerNg, handle: usize, data_len: usize) -> *mut u8
+{
+    let timestamp = tracey.clock.now();
+    let submitter = &tracey.submitter;
+    let pending = TIMESTAMP_LEN + data_len;
+
+    if !tracey.budget.charge(pending) {
+        tracey.budget.count_drop(handle);
+        return ptr::null_mut();
+    }
+
+    let reservation = match &submitter.queue {
+        SubmitQueue::Rings(rings) => {
+            submitter.wakeup.add(pending);
+
+            let reservation = match rings {
+                RingSet::Shared(ring) => place_reservation(ring,
+                    ring.reserve(pending), handle, timestamp),
+                RingSet::PerThread(rings) => rings
+                    .with_local(|ring| place_reservation(ring,
+                        ring.reserve_exclusive(pending), handle, timestamp))
+                    .unwrap_or(ptr::null_mut()),
+            };
+
+            if reservation.is_null() {
+                submitter.wakeup.sub(pending);
+            }
+            reservation
+        },
+        SubmitQueue::Channel { reservations, .. } => {
+            let mut element = BufferElement {
+                tracepoint: tracey.handles[handle].name.clone(),
+                handle,
+                timestamp,
+                kind: RecordKind::Raw,
+                data: vec![0u8; data_len],
+            };
+
+            // Moving the element does not move the payload memory
+            let reservation = element.data.as_mut_ptr();
+            match reservations.lock() {
+                Ok(mut reservations) => {
+                    reservations.insert(reservation as usize, element);
+                    reservation
+                },
+                Err(_) => ptr::null_mut(),
+            }
+        },
+    };
+
+    if reservation.is_null() {
+        tracey.budget.release(pending);
+        tracey.budget.count_drop(handle);
+    }
+    reservation
+}
+
+
+fn place_reservation(ring: &ByteRing, slot: Option<Slot>, handle: usize,
+                     timestamp: u64) -> *mut u8
+{
+    let slot = match slot {
+        Some(slot) => slot,
+        None => return ptr::null_mut(),
+    };
+
+    ring.set_tag(&slot, handle as u32);
+    let record = ring.payload(&slot);
     unsafe {
-        buffer_element = BufferElement {
-            tracepoint: tracepoint_repaired.clone(),
-            timestamp: SystemTime::now(),
-            data: std::slice::from_raw_parts(data, data_len).to_vec(),
-        };
+        ptr::copy_nonoverlapping(timestamp.to_ne_bytes().as_ptr(), record,
+                                 TIMESTAMP_LEN);
+        record.add(TIMESTAMP_LEN)
+    }
+}
+
+
+// Returns false if the reservation is unknown
+fn commit_record(tracey: &TracerNg, reservation: *mut u8) -> bool
+{
+    let submitter = &tracey.submitter;
+
+    match &submitter.queue {
+        SubmitQueue::Rings(rings) => {
+            // Already accounted for when reserving
+            let record = reservation.wrapping_sub(TIMESTAMP_LEN);
+            let committed = match rings {
+                RingSet::Shared(ring) => ring.commit_payload(record),
+                RingSet::PerThread(rings) => rings
+                    .with_local(|ring| ring.commit_payload(record))
+                    .flatten(),
+            };
+
+            committed.is_some()
+        },
+        SubmitQueue::Channel { snd, reservations } => {
+            let element = match reservations.lock() {
+                Ok(mut reservations) =>
+                    reservations.remove(&(reservation as usize)),
+                Err(_) => None,
+            };
+
+            let element = match element {
+                Some(element) => element,
+                None => return false,
+            };
+
+            let pending = TIMESTAMP_LEN + element.data.len();
+            submitter.wakeup.add(pending);
+            if snd.send(Submitted::Record(element)).is_err() {
+                submitter.wakeup.sub(pending);
+                tracey.budget.release(pending);
+            }
+            true
+        },
+    }
+}
+
+
+// Resolves a tracepoint name passed by the application to its handle.
+// Names which already are in canonical form (ASCII, lowercase, not too long)
+// are looked up without allocating; all others take the slow path through
+// fix_tracepoint_str.
+fn lookup_tracepoint(tracey: &TracerNg, tp_name: &CStr)
+    -> Result<Option<usize>, ()>
+{
+    let bytes = tp_name.to_bytes();
+    let canonical = bytes.len() <= MAX_TRACEPOINT_NAME_LEN &&
+        bytes.iter().all(|b| b.is_ascii() && !b.is_ascii_uppercase());
+
+    if canonical {
+        let name = std::str::from_utf8(bytes).map_err(|_| ())?;
+        return Ok(tracey.tracepoints.get(name).copied());
+    }
+
+    let name = fix_tracepoint_str(tp_name.to_string_lossy().into_owned())?;
+    Ok(tracey.tracepoints.get(&name).copied())
+}
+
+
+fn handle_to_tracepoint(tracey: &TracerNg, handle: c_int) -> Option<&Tracepoint>
+{
+    if handle < 0 {
+        return None;
     }
 
-    let msg = ChannelMessage::Payload(buffer_element);
-    send_to_tracer(&tracey, msg);
+    tracey.handles.get(handle as usize)
 }
 
 
 fn tracepoint_enabled(tracey: &TracerNg, tracepoint: &String) -> bool
 {
     match tracey.tracepoints.get(tracepoint) {
-        Some(truth) => truth.load(Ordering::SeqCst),
+        Some(handle) => tracey.shared_flags.enabled(*handle),
         None => false,
     }
 }
 
 
+// A ring record consists of the timestamp followed by the payload
+fn ring_record_to_element(tracepoint: &String, handle: usize,
+                          kind: RecordKind, record: &[u8]) -> BufferElement
+{
+    let mut timestamp = [0u8; TIMESTAMP_LEN];
+    timestamp.copy_from_slice(&record[..TIMESTAMP_LEN]);
+
+    BufferElement {
+        tracepoint: tracepoint.clone(),
+        handle,
+        timestamp: u64::from_ne_bytes(timestamp),
+        kind,
+        data: record[TIMESTAMP_LEN..].to_vec(),
+    }
+}
+
+
 fn send_to_tracer(tracey: &TracerNg, chan_msg: ChannelMessage)
 {
     if let Err(e) = tracey.send_to_tracer_thread.send(chan_msg) {
@@ -475,12 +2426,22 @@ fn fix_tracepoint_str(mut tracepoint: String) -> Result<String, ()>
 
 
 fn tracer_thread_main(app_cfg_data: InitData,
-                      client_connected_in: Arc<AtomicBool>,
+                      flags: Arc<EnableFlags>,
                       rec_param: Receiver<ChannelMessage>,
+                      submitted: SubmitDrain,
+                      formats: Arc<Mutex<FormatTable>>,
+                      budget: Arc<Budget>,
+                      crash: Arc<crash::CrashState>,
                       announce: bool)
 {
-    let mut events = Events::with_capacity(1024);
+    let mut events = Events::with_capacity(app_cfg_data.tuning.poll_events);
+    let tuning = app_cfg_data.tuning;
     let udp_iface = app_cfg_data.announce_iface.clone();
+    let calibrator = if app_cfg_data.clock.needs_calibration() {
+        Some(Calibrator::new(app_cfg_data.clock))
+    } else {
+        None
+    };
 
     let mut ctx = TracerContext {
         app_cfg: app_cfg_data,
@@ -495,10 +2456,23 @@ fn tracer_thread_main(app_cfg_data: InitData,
         udp_sock: None, 
         listener: tcp_handler::init()
             .expect("tracy: Could not bind TCP socket."),
-        connection: None,
-        client_connected: client_connected_in,
+        unix_listener: None,
+        clients: Vec::with_capacity(tuning.max_clients),
+        flags,
         tracepoints: HashMap::with_capacity(128),
+        tracepoint_names: Vec::with_capacity(128),
+        submitted,
+        formats,
         sequence_no: 0,
+        calibrator,
+        send_scratch: tcp_handler::SendScratch::new(tuning.queue_size),
+        deltas: delta::Deltas::new(),
+        budget,
+        buffer_charged: 0,
+        blobs: tcp_handler::Blobs::new(),
+        recorder: recorder::FlightRecorder::new(),
+        file_sink: file_sink::FileSink::new(),
+        crash: Arc::clone(&crash),
     };
 
     // If the parameters given by the caller indicate that he wishes
@@ -520,13 +2494,39 @@ fn tracer_thread_main(app_cfg_data: InitData,
         .expect("tracy: Panicked at registering timer in poll.");
     ctx.poll.register(&ctx.listener, CON_NEW, Ready::readable(), PollOpt::edge())
         .expect("tracy: Panicked at registering TcpListener in poll.");
+    // Without the unix socket, clients can still connect over TCP
+    if let Some(name) = &ctx.app_cfg.unix_socket {
+        ctx.unix_listener = tcp_handler::init_unix(name);
+    }
+    if let Some(listener) = &ctx.unix_listener {
+        ctx.poll.register(&EventedFd(&listener.as_raw_fd()), CON_NEW_UNIX,
+                          Ready::readable(), PollOpt::edge())
+            .expect("tracy: Panicked at registering UnixListener in poll.");
+    }
+    ctx.poll.register(&ctx.submitted.registration, SUBMIT, Ready::readable(),
+                      PollOpt::edge())
+        .expect("tracy: Panicked at registering submit path in poll.");
+
+    // Emergency flushes work on the context while the tracer-thread polls,
+    // see crash.rs
+    crash.enter();
+    let _attached = crash.attach(&mut ctx);
 
     loop {
-        ctx.poll.poll(&mut events, None).expect("tracy: Panicked in poll.");
+        let timeout = tcp_handler::poll_timeout(&ctx);
+        crash.leave();
+        ctx.poll.poll(&mut events, timeout).expect("tracy: Panicked in poll.");
+        crash.enter();
+        ctx.settle_emergency();
 
         if let TracerState::Terminate = event_handler(&events, &mut ctx) {
             return;
         }
+
+        tcp_handler::send_shm_backlogs(&mut ctx);
+        // Blob chunks are sent between polls, one round at a time, so
+        // records arriving meanwhile don't have to wait for whole blobs
+        tcp_handler::send_blob_chunks(&mut ctx);
     }
 }
 
@@ -546,11 +2546,11 @@ fn event_handler(events: &Events,
                 state => ret = state,
             },
             TIMER => timer_handler(&mut ctx),
-            CON_NEW => if ctx.connection.is_none() {
-                    tcp_handler::establish_connection(&mut ctx);
-                    ctx.check_stop_udp_timer();
-            },
-            CON_DATA => tcp_handler::receive(&mut ctx),
+            CON_NEW => tcp_handler::accept_clients(&mut ctx, false),
+            CON_NEW_UNIX => tcp_handler::accept_clients(&mut ctx, true),
+            SUBMIT => submit_handler(&mut ctx),
+            token if token.0 >= CLIENT_TOKENS =>
+                tcp_handler::client_event(&mut ctx, token),
             _ => (),
         }
     }
@@ -565,15 +2565,41 @@ fn channel_handler(mut ctx: &mut TracerContext) -> TracerState
 
     while let Ok(data) = ctx.rec.try_recv() {
         match data {
-            ChannelMessage::Payload(payload) => 
-                channel_data_handler(&mut ctx, payload),
             ChannelMessage::NewTracepoint(tracepoint) => 
                 ctx.insert_tracepoint(tracepoint),
+            ChannelMessage::SetDelta(handle, keyframe_interval) =>
+                ctx.deltas.set(handle, keyframe_interval),
+            ChannelMessage::Blob(blob) => tcp_handler::share_blob(&mut ctx, blob),
+            ChannelMessage::SetFlightRecorder(capacity) => {
+                ctx.recorder.set_capacity(capacity);
+                ctx.update_recording();
+            },
+            ChannelMessage::SetRecorded(handle, recorded) => {
+                ctx.recorder.set_recorded(handle, recorded);
+                ctx.update_recording();
+            },
+            ChannelMessage::OpenFileSink(config) => {
+                ctx.file_sink.open(config);
+                ctx.update_recording();
+            },
+            ChannelMessage::CloseFileSink => {
+                // Whatever has been submitted so far goes in as well
+                ctx.drain_submitted();
+                flush(&mut ctx);
+                ctx.file_sink.close();
+                ctx.update_recording();
+            },
+            ChannelMessage::SetPersisted(handle, persisted) => {
+                ctx.file_sink.set_persisted(handle, persisted);
+                ctx.update_recording();
+            },
             ChannelMessage::Terminate => {
                 // Send remaining data one last time before killing thread
-                if ctx.connection.is_some() {
+                ctx.drain_submitted();
+                if ctx.connected() || ctx.file_sink.is_active() {
                     tcp_handler::send_trace_data(&mut ctx);
                 }
+                ctx.file_sink.close();
                 return TracerState::Terminate;
             },
         }
@@ -590,7 +2616,13 @@ fn timer_handler(mut ctx: &mut TracerContext)
         match timeout {
             QUEUE_TIMEOUT_IDENT => {
                 ctx.queue_timeout = None;
-                tcp_handler::send_trace_data(&mut ctx);
+                ctx.drain_submitted();
+                flush(&mut ctx);
+
+                // Payloads submitted while draining did not wake us up
+                if ctx.submitted.wakeup.pending() > 0 {
+                    ctx.check_start_queue_timer();
+                }
             },
             UDP_TIMEOUT_IDENT => {
                 ctx.udp_timeout = None;
@@ -603,15 +2635,51 @@ fn timer_handler(mut ctx: &mut TracerContext)
 }
 
 
-fn channel_data_handler(mut ctx: &mut TracerContext, data: BufferElement)
+// Producers only wake the tracer-thread when payloads start to be pending
+// or when a lot of them are. In the first case, the flush timer does the rest.
+fn submit_handler(mut ctx: &mut TracerContext)
 {
-    // Append data in any case, as it is already allocated.
-    ctx.append(data);
+    // Reset readiness before looking at the pending bytes, so a producer
+    // crossing the watermark meanwhile wakes us up again
+    let wakeup = &ctx.submitted.wakeup;
+    let _ = wakeup.readiness.set_readiness(Ready::empty());
+    if wakeup.pending() < wakeup.high_watermark {
+        ctx.check_start_queue_timer();
+        return;
+    }
 
-    if ctx.buffer_occupancy > QUEUE_TOTAL_SIZE {
+    if ctx.drain_submitted() > 0 {
+        check_flush(&mut ctx);
+    }
+
+    // Producers announce payloads before enqueueing them, so some may not
+    // have been drained yet, and payloads added meanwhile did not wake us up
+    if ctx.submitted.wakeup.pending() > 0 {
+        ctx.check_start_queue_timer();
+    }
+}
+
+
+// Sends the buffer if it is full enough, otherwise makes sure it gets sent
+// when the flush interval has passed
+fn check_flush(mut ctx: &mut TracerContext)
+{
+    if ctx.buffer_occupancy > ctx.app_cfg.tuning.queue_size {
         ctx.check_stop_queue_timer();
-        tcp_handler::send_trace_data(&mut ctx);
+        flush(&mut ctx);
     } else {
         ctx.check_start_queue_timer();
     }
 }
+
+
+// Payloads can still arrive shortly after the client has disconnected. They
+// are of no use to anyone then, except to the flight recorder.
+fn flush(mut ctx: &mut TracerContext)
+{
+    if ctx.connected() || ctx.file_sink.is_active() {
+        tcp_handler::send_trace_data(&mut ctx);
+    } else {
+        ctx.clear_buffer();
+    }
+}
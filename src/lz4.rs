@@ -0,0 +1,273 @@
+// Copyright 2019, 2020 Rohde & Schwarz GmbH & Co KG
+//      philipp.stanner@rohde-schwarz.com
+//      hagen.pfeifer@rohde-schwarz.com
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Compressor for the LZ4 block format, used for TRACE_PUSH frames. Any LZ4
+// block decoder can decompress the output.
+//
+// A block is a sequence of sequences. Each sequence consists of a token (high
+// nibble: literal count, low nibble: match length - 4), optional length bytes
+// for counts of 15 and more, the literals, and a 2 byte little endian offset
+// to the match plus optional length bytes for the match. The last sequence
+// only holds literals.
+//
+// Matches are found through a hash table of 4 byte sequences, greedily and
+// without looking back. That trades compression ratio for speed, which is the
+// right trade for the tracer-thread.
+
+const MIN_MATCH: usize = 4;
+// The format requires the last 5 bytes to be literals, and the last match to
+// start at least 12 bytes before the end of the block
+const LAST_LITERALS: usize = 5;
+const MF_LIMIT: usize = 12;
+const MAX_OFFSET: usize = 65535;
+
+const HASH_LOG: u32 = 12;
+// Misses in a row after which the search starts skipping bytes, so
+// incompressible data is passed through quickly
+const SKIP_TRIGGER: usize = 6;
+
+
+pub(crate) struct Compressor {
+    // Last position of each hashed 4 byte sequence
+    table: Box<[u32]>,
+}
+
+impl Compressor {
+    pub(crate) fn new() -> Compressor
+    {
+        Compressor {
+            table: vec![0u32; 1 << HASH_LOG].into_boxed_slice(),
+        }
+    }
+
+    // Appends the compressed input to out
+    pub(crate) fn compress(&mut self, input: &[u8], out: &mut Vec<u8>)
+    {
+        let len = input.len();
+        let mut anchor = 0;
+
+        for entry in self.table.iter_mut() {
+            *entry = 0;
+        }
+
+        if len > MF_LIMIT {
+            let match_limit = len - LAST_LITERALS;
+            let mut pos = 0;
+            let mut misses = 0;
+
+            while pos + MF_LIMIT <= len {
+                let seq = read_u32(input, pos);
+                let slot = hash(seq);
+                let candidate = self.table[slot] as usize;
+                self.table[slot] = pos as u32;
+
+                // Positions in the table are only hints, the bytes decide
+                let found = candidate < pos && pos - candidate <= MAX_OFFSET &&
+                    read_u32(input, candidate) == seq;
+                if !found {
+                    misses += 1;
+                    pos += 1 + (misses >> SKIP_TRIGGER);
+                    continue;
+                }
+
+                let mut match_len = MIN_MATCH;
+                while pos + match_len < match_limit &&
+                    input[candidate + match_len] == input[pos + match_len] {
+                    match_len += 1;
+                }
+
+                put_sequence(out, &input[anchor..pos], pos - candidate,
+                             match_len);
+                pos += match_len;
+                anchor = pos;
+                misses = 0;
+            }
+        }
+
+        put_literals(out, &input[anchor..]);
+    }
+}
+
+
+fn read_u32(input: &[u8], pos: usize) -> u32
+{
+    let mut bytes = [0u8; 4];
+    bytes.copy_from_slice(&input[pos..pos + 4]);
+    u32::from_le_bytes(bytes)
+}
+
+
+fn hash(seq: u32) -> usize
+{
+    (seq.wrapping_mul(2654435761) >> (32 - HASH_LOG)) as usize
+}
+
+
+fn put_sequence(out: &mut Vec<u8>, literals: &[u8], offset: usize,
+                match_len: usize)
+{
+    let literal_len = literals.len();
+    let match_len = match_len - MIN_MATCH;
+
+    out.push((literal_len.min(15) << 4 | match_len.min(15)) as u8);
+    if literal_len >= 15 {
+        put_length(out, literal_len - 15);
+    }
+    out.extend_from_slice(literals);
+    out.extend_from_slice(&(offset as u16).to_le_bytes());
+    if match_len >= 15 {
+        put_length(out, match_len - 15);
+    }
+}
+
+
+fn put_literals(out: &mut Vec<u8>, literals: &[u8])
+{
+    let literal_len = literals.len();
+
+    out.push((literal_len.min(15) << 4) as u8);
+    if literal_len >= 15 {
+        put_length(out, literal_len - 15);
+    }
+    out.extend_from_slice(literals);
+}
+
+
+fn put_length(out: &mut Vec<u8>, mut len: usize)
+{
+    while len >= 255 {
+        out.push(255);
+        len -= 255;
+    }
+    out.push(len as u8);
+}
+
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Reference decoder, which also checks the end of block rules
+    fn decompress(mut block: &[u8], len: usize) -> Vec<u8>
+    {
+        let mut out = Vec::new();
+        let mut match_starts = Vec::new();
+
+        fn length(block: &mut &[u8], nibble: usize) -> usize
+        {
+            let mut len = nibble;
+            if nibble == 15 {
+                loop {
+                    let byte = block[0];
+                    *block = &block[1..];
+                    len += byte as usize;
+                    if byte != 255 {
+                        break;
+                    }
+                }
+            }
+            len
+        }
+
+        loop {
+            let token = block[0] as usize;
+            block = &block[1..];
+
+            let literal_len = length(&mut block, token >> 4);
+            out.extend_from_slice(&block[..literal_len]);
+            block = &block[literal_len..];
+            if block.is_empty() {
+                break;
+            }
+
+            let offset = u16::from_le_bytes([block[0], block[1]]) as usize;
+            block = &block[2..];
+            let match_len = length(&mut block, token & 15) + MIN_MATCH;
+            assert!(offset > 0 && offset <= out.len());
+
+            match_starts.push((out.len(), match_len));
+            let start = out.len() - offset;
+            for i in 0..match_len {
+                let byte = out[start + i];
+                out.push(byte);
+            }
+        }
+
+        assert_eq!(out.len(), len);
+        for (start, match_len) in match_starts {
+            assert!(start + MF_LIMIT <= len);
+            assert!(start + match_len <= len - LAST_LITERALS);
+        }
+        out
+    }
+
+    fn round_trip(input: &[u8]) -> usize
+    {
+        let mut compressed = Vec::new();
+        Compressor::new().compress(input, &mut compressed);
+        assert_eq!(decompress(&compressed, input.len()), input);
+        compressed.len()
+    }
+
+    #[test]
+    fn short_inputs_are_literals_only()
+    {
+        for len in 0..=MF_LIMIT + 1 {
+            let input = vec![0xaa; len];
+            let compressed_len = round_trip(&input);
+            if len <= MF_LIMIT {
+                assert_eq!(compressed_len, 1 + len);
+            }
+        }
+    }
+
+    #[test]
+    fn match_stops_before_the_literal_tail()
+    {
+        // Matches everywhere, up to the very end
+        for len in MF_LIMIT + 1..100 {
+            let input = vec![7u8; len];
+            round_trip(&input);
+        }
+
+        let mut input = b"0123456789abcdef".repeat(8);
+        input.extend_from_slice(b"01234");
+        assert!(round_trip(&input) < input.len() / 2);
+    }
+
+    #[test]
+    fn long_literal_and_match_lengths()
+    {
+        // Incompressible run of more than 15 + 255 literals, then a match of
+        // more than 15 + 255 + 4 bytes
+        let mut seed: u32 = 1;
+        let mut input: Vec<u8> = (0..600).map(|_| {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            (seed >> 16) as u8
+        }).collect();
+        let head = input[..400].to_vec();
+        input.extend_from_slice(&head);
+        input.extend_from_slice(b"end of it");
+
+        assert!(round_trip(&input) < 700);
+    }
+
+    #[test]
+    fn compressor_is_reusable()
+    {
+        let mut compressor = Compressor::new();
+        let first = b"abcdabcdabcdabcdabcdabcdabcdabcd".to_vec();
+        let second = b"xyzxyzxyzxyzxyzxyzxyzxyzxyzxyzxy".to_vec();
+
+        for input in [&first, &second, &first].iter() {
+            let mut compressed = Vec::new();
+            compressor.compress(input, &mut compressed);
+            assert_eq!(decompress(&compressed, input.len()), **input);
+        }
+    }
+}
@@ -0,0 +1,208 @@
+// Copyright 2019, 2020 Rohde & Schwarz GmbH & Co KG
+//      philipp.stanner@rohde-schwarz.com
+//      hagen.pfeifer@rohde-schwarz.com
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Flight recorder, see tracy_set_flight_recorder(). Keeps the latest records
+// of the selected tracepoints, whether a client is connected or not, within a
+// fixed number of bytes: new records overwrite the oldest ones. Clients get
+// the contents as a burst when they connect or ask for it.
+//
+// Records are kept as the buffer elements they arrived in. They are moved
+// here once the buffer has been sent, so recording copies nothing.
+
+use std::collections::VecDeque;
+
+use crate::{BufferElement, MAX_TRACEPOINTS};
+
+
+// Owned by the tracer-thread
+pub(crate) struct FlightRecorder {
+    records: VecDeque<BufferElement>,
+    // Bytes of the records, counted like the buffer's occupancy
+    occupancy: usize,
+    // 0 while switched off
+    capacity: usize,
+    // Indexed by tracepoint handle
+    recorded: Vec<bool>,
+    recorded_count: usize,
+    // Records overwritten since the recorder was switched on
+    overwritten: u64,
+}
+
+impl FlightRecorder {
+    pub(crate) fn new() -> FlightRecorder
+    {
+        FlightRecorder {
+            records: VecDeque::new(),
+            occupancy: 0,
+            capacity: 0,
+            recorded: vec![false; MAX_TRACEPOINTS],
+            recorded_count: 0,
+            overwritten: 0,
+        }
+    }
+
+    // A capacity of 0 switches the recorder off and discards its contents.
+    // Shrinking it discards the oldest records.
+    pub(crate) fn set_capacity(&mut self, capacity: usize)
+    {
+        if self.capacity == 0 {
+            self.overwritten = 0;
+        }
+
+        self.capacity = capacity;
+        self.make_room(0);
+    }
+
+    pub(crate) fn set_recorded(&mut self, handle: usize, recorded: bool)
+    {
+        if self.recorded[handle] != recorded {
+            self.recorded[handle] = recorded;
+            if recorded {
+                self.recorded_count += 1;
+            } else {
+                self.recorded_count -= 1;
+            }
+        }
+    }
+
+    // Whether the recorder is switched on and selects any tracepoint
+    pub(crate) fn is_active(&self) -> bool
+    {
+        self.capacity > 0 && self.recorded_count > 0
+    }
+
+    pub(crate) fn recorded(&self, handle: usize) -> bool
+    {
+        self.capacity > 0 && self.recorded[handle]
+    }
+
+    // Takes the element if its tracepoint is recorded
+    pub(crate) fn record(&mut self, element: BufferElement)
+    {
+        if !self.recorded(element.handle) || element.len() > self.capacity {
+            return;
+        }
+
+        self.make_room(element.len());
+        self.occupancy += element.len();
+        self.records.push_back(element);
+    }
+
+    pub(crate) fn records(&self) -> &VecDeque<BufferElement>
+    {
+        &self.records
+    }
+
+    pub(crate) fn overwritten(&self) -> u64
+    {
+        self.overwritten
+    }
+
+    // Discards the oldest records until len more bytes fit
+    fn make_room(&mut self, len: usize)
+    {
+        while self.occupancy + len > self.capacity {
+            let element = match self.records.pop_front() {
+                Some(element) => element,
+                None => return,
+            };
+
+            self.occupancy -= element.len();
+            self.overwritten += 1;
+        }
+    }
+}
+
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::RecordKind;
+
+    // 100 bytes counted against the capacity, the timestamp telling the
+    // records apart
+    fn element(handle: usize, timestamp: u64) -> BufferElement
+    {
+        BufferElement {
+            tracepoint: String::from("tp"),
+            handle,
+            timestamp,
+            kind: RecordKind::Raw,
+            data: vec![0; 90],
+        }
+    }
+
+    fn timestamps(recorder: &FlightRecorder) -> Vec<u64>
+    {
+        recorder.records().iter().map(|e| e.timestamp).collect()
+    }
+
+    #[test]
+    fn evicts_the_oldest_by_bytes()
+    {
+        let mut recorder = FlightRecorder::new();
+        recorder.set_capacity(350);
+        recorder.set_recorded(1, true);
+
+        for timestamp in 0..3 {
+            recorder.record(element(1, timestamp));
+        }
+        assert_eq!(timestamps(&recorder), vec![0, 1, 2]);
+        assert_eq!(recorder.overwritten(), 0);
+
+        recorder.record(element(1, 3));
+        recorder.record(element(1, 4));
+        assert_eq!(timestamps(&recorder), vec![2, 3, 4]);
+        assert_eq!(recorder.overwritten(), 2);
+    }
+
+    #[test]
+    fn skips_unrecorded_and_oversized_records()
+    {
+        let mut recorder = FlightRecorder::new();
+        recorder.set_recorded(1, true);
+        // Switched off
+        recorder.record(element(1, 0));
+        assert!(recorder.records().is_empty());
+
+        recorder.set_capacity(150);
+        recorder.record(element(2, 1));
+        recorder.record(element(1, 2));
+        let mut big = element(1, 3);
+        big.data = vec![0; 200];
+        // Would evict everything and still not fit
+        recorder.record(big);
+
+        assert_eq!(timestamps(&recorder), vec![2]);
+        assert_eq!(recorder.overwritten(), 0);
+    }
+
+    #[test]
+    fn shrinking_and_switching_off()
+    {
+        let mut recorder = FlightRecorder::new();
+        recorder.set_capacity(500);
+        recorder.set_recorded(1, true);
+        for timestamp in 0..5 {
+            recorder.record(element(1, timestamp));
+        }
+
+        recorder.set_capacity(250);
+        assert_eq!(timestamps(&recorder), vec![3, 4]);
+        assert_eq!(recorder.overwritten(), 3);
+
+        recorder.set_capacity(0);
+        assert!(recorder.records().is_empty());
+        assert!(!recorder.is_active());
+
+        // The count starts over when switched on again
+        recorder.set_capacity(250);
+        assert!(recorder.is_active());
+        assert_eq!(recorder.overwritten(), 0);
+    }
+}
@@ -0,0 +1,543 @@
+// Copyright 2019, 2020 Rohde & Schwarz GmbH & Co KG
+//      philipp.stanner@rohde-schwarz.com
+//      hagen.pfeifer@rohde-schwarz.com
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Preallocated, lock-free byte ring. Any number of producers reserve space
+// for a record, write it in place and commit it; exactly one consumer (the
+// tracer-thread, or an emergency flush while it is kept out, see crash.rs)
+// walks the committed records in order and releases them.
+//
+// Every record starts with an 8 byte header: a 32 bit state word (length and
+// flags, see below) and a 32 bit tag the producer may use freely. Records are
+// 8 byte aligned. A record which would cross the end of the memory is
+// preceded by a padding record filling the remaining space, so the payload of
+// a record is always contiguous.
+//
+// Consumed memory is zeroed before it is handed back to the producers. A
+// producer therefore always finds an uncommitted (zero) header at the start of
+// its reservation, and the consumer can not mistake old payload bytes for a
+// committed header. While a record is reserved, its state word already holds
+// the length, but not the COMMITTED flag.
+
+use std::cell::{RefCell, UnsafeCell};
+use std::sync::{Arc, Mutex};
+use std::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, AtomicUsize, Ordering};
+
+pub(crate) const RECORD_HEADER_LEN: usize = 8;
+
+const COMMITTED: u32 = 1 << 31;
+const PADDING: u32 = 1 << 30;
+const LEN_MASK: u32 = PADDING - 1;
+
+// Keeps producer- and consumer-side counters on different cache lines
+#[repr(align(64))]
+struct CachePadded<T>(T);
+
+
+pub(crate) struct ByteRing {
+    mem: Box<[UnsafeCell<u64>]>,
+    mask: usize,
+    // Reservation cursor, moved by the producers
+    head: CachePadded<AtomicUsize>,
+    // Release cursor, moved by the consumer
+    tail: CachePadded<AtomicUsize>,
+    // Records which were refused because the ring was full
+    dropped: AtomicU64,
+}
+
+// The memory is only ever accessed through the reserve / commit / consume
+// protocol, which hands every byte to exactly one party at a time.
+unsafe impl Sync for ByteRing {}
+unsafe impl Send for ByteRing {}
+
+// A reserved, not yet committed record
+pub(crate) struct Slot {
+    offset: usize,
+    len: usize,
+}
+
+
+impl ByteRing {
+    // The capacity is rounded up to the next power of two.
+    pub(crate) fn new(capacity: usize) -> ByteRing
+    {
+        let capacity = capacity.max(4096).next_power_of_two();
+        let mem: Vec<UnsafeCell<u64>> = (0..capacity / 8)
+            .map(|_| UnsafeCell::new(0))
+            .collect();
+
+        ByteRing {
+            mem: mem.into_boxed_slice(),
+            mask: capacity - 1,
+            head: CachePadded(AtomicUsize::new(0)),
+            tail: CachePadded(AtomicUsize::new(0)),
+            dropped: AtomicU64::new(0),
+        }
+    }
+
+    pub(crate) fn capacity(&self) -> usize
+    {
+        self.mask + 1
+    }
+
+    pub(crate) fn is_empty(&self) -> bool
+    {
+        let tail = self.tail.0.load(Ordering::Acquire);
+        self.head.0.load(Ordering::Acquire) == tail
+    }
+
+    pub(crate) fn take_dropped(&self) -> u64
+    {
+        self.dropped.swap(0, Ordering::Relaxed)
+    }
+
+    // Reserves len bytes of payload. Returns None if the ring is full, the
+    // record is counted as dropped in this case. May be called concurrently
+    // from any number of threads.
+    pub(crate) fn reserve(&self, len: usize) -> Option<Slot>
+    {
+        let total = record_size(len);
+        if total > self.capacity() / 2 {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+            return None;
+        }
+
+        let mut head = self.head.0.load(Ordering::Relaxed);
+        loop {
+            let tail = self.tail.0.load(Ordering::Acquire);
+            let pad = self.padding_for(head, total);
+
+            if head.wrapping_sub(tail) + pad + total > self.capacity() {
+                self.dropped.fetch_add(1, Ordering::Relaxed);
+                return None;
+            }
+
+            match self.head.0.compare_exchange_weak(head,
+                    head.wrapping_add(pad + total),
+                    Ordering::AcqRel, Ordering::Relaxed) {
+                Ok(_) => return Some(self.claim(head, pad, len)),
+                Err(current) => head = current,
+            }
+        }
+    }
+
+    // Returns a pointer to the payload memory of a reserved slot
+    pub(crate) fn payload(&self, slot: &Slot) -> *mut u8
+    {
+        unsafe { self.byte_ptr(slot.offset + RECORD_HEADER_LEN) }
+    }
+
+    pub(crate) fn set_tag(&self, slot: &Slot, tag: u32)
+    {
+        unsafe {
+            (self.byte_ptr(slot.offset + 4) as *mut u32).write(tag);
+        }
+    }
+
+    // Publishes a reserved record to the consumer
+    pub(crate) fn commit(&self, slot: Slot)
+    {
+        self.state_word(slot.offset)
+            .store(slot.len as u32 | COMMITTED, Ordering::Release);
+    }
+
+    // Commits the reserved record whose payload starts at 'payload', as
+    // returned by payload(). Returns the payload length, or None if the
+    // pointer does not belong to a reserved record of this ring.
+    pub(crate) fn commit_payload(&self, payload: *const u8) -> Option<usize>
+    {
+        let base = self.mem.as_ptr() as usize;
+        let addr = payload as usize;
+        if addr < base + RECORD_HEADER_LEN || addr >= base + self.capacity() ||
+            (addr - base) % 8 != 0 {
+            return None;
+        }
+
+        let offset = addr - base - RECORD_HEADER_LEN;
+        let state = self.state_word(offset).load(Ordering::Relaxed);
+        if state == 0 || state & (COMMITTED | PADDING) != 0 {
+            return None;
+        }
+
+        let len = (state & LEN_MASK) as usize;
+        self.commit(Slot { offset, len });
+        Some(len)
+    }
+
+    // Same as reserve(), but without the compare-and-swap loop. Only valid if
+    // the calling thread is the only producer of this ring.
+    pub(crate) fn reserve_exclusive(&self, len: usize) -> Option<Slot>
+    {
+        let total = record_size(len);
+        let head = self.head.0.load(Ordering::Relaxed);
+        let tail = self.tail.0.load(Ordering::Acquire);
+        let pad = self.padding_for(head, total);
+
+        if total > self.capacity() / 2 ||
+            head.wrapping_sub(tail) + pad + total > self.capacity() {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+            return None;
+        }
+
+        self.head.0.store(head.wrapping_add(pad + total), Ordering::Release);
+        Some(self.claim(head, pad, len))
+    }
+
+    // Copies the parts, which have to sum up to len bytes, into a new record
+    // and commits it. Returns false if the ring was full.
+    pub(crate) fn push<'a, I>(&self, tag: u32, len: usize, parts: I) -> bool
+        where I: IntoIterator<Item = &'a [u8]>
+    {
+        match self.reserve(len) {
+            Some(slot) => {
+                self.fill_commit(slot, tag, parts);
+                true
+            },
+            None => false,
+        }
+    }
+
+    // push() for rings with a single producer, see reserve_exclusive()
+    pub(crate) fn push_exclusive<'a, I>(&self, tag: u32, len: usize, parts: I)
+        -> bool
+        where I: IntoIterator<Item = &'a [u8]>
+    {
+        match self.reserve_exclusive(len) {
+            Some(slot) => {
+                self.fill_commit(slot, tag, parts);
+                true
+            },
+            None => false,
+        }
+    }
+
+    fn fill_commit<'a, I>(&self, slot: Slot, tag: u32, parts: I)
+        where I: IntoIterator<Item = &'a [u8]>
+    {
+        self.set_tag(&slot, tag);
+
+        let mut dst = self.payload(&slot);
+        let mut left = slot.len;
+        for part in parts {
+            let n = part.len().min(left);
+            unsafe {
+                std::ptr::copy_nonoverlapping(part.as_ptr(), dst, n);
+                dst = dst.add(n);
+            }
+            left -= n;
+        }
+
+        self.commit(slot);
+    }
+
+    // Hands every committed record, in order, to the closure and releases
+    // it afterwards. Stops at the first record still being written.
+    // Must only be called by one thread at a time.
+    pub(crate) fn consume<F>(&self, mut f: F) -> usize
+        where F: FnMut(u32, &[u8])
+    {
+        let mut records = 0;
+        let end = self.peek(None, |tag, payload| {
+            f(tag, payload);
+            records += 1;
+        });
+        self.release(end);
+
+        records
+    }
+
+    // Hands the committed records up to end, or all of them, in order to the
+    // closure without releasing them. Returns the position after the last
+    // one, for release() or the next peek(). Allocates nothing, so it can be
+    // used by the emergency flush, see crash.rs.
+    pub(crate) fn peek<F>(&self, end: Option<usize>, mut f: F) -> usize
+        where F: FnMut(u32, &[u8])
+    {
+        let head = end.unwrap_or_else(|| self.head.0.load(Ordering::Acquire));
+        let mut tail = self.tail.0.load(Ordering::Relaxed);
+
+        while tail != head {
+            let offset = tail & self.mask;
+            let state = self.state_word(offset).load(Ordering::Acquire);
+            if state & COMMITTED == 0 {
+                break;
+            }
+
+            if state & PADDING != 0 {
+                tail = tail.wrapping_add((state & LEN_MASK) as usize);
+                continue;
+            }
+
+            let len = (state & LEN_MASK) as usize;
+            unsafe {
+                let tag = (self.byte_ptr(offset + 4) as *const u32).read();
+                let payload = std::slice::from_raw_parts(
+                    self.byte_ptr(offset + RECORD_HEADER_LEN), len);
+                f(tag, payload);
+            }
+            tail = tail.wrapping_add(record_size(len));
+        }
+
+        tail
+    }
+
+    // Hands the records before end, as returned by peek(), back to the
+    // producers
+    pub(crate) fn release(&self, end: usize)
+    {
+        let start = self.tail.0.load(Ordering::Relaxed);
+        let mut tail = start;
+
+        while tail != end {
+            let offset = tail & self.mask;
+            let state = self.state_word(offset).load(Ordering::Relaxed);
+            let total = if state & PADDING != 0 {
+                (state & LEN_MASK) as usize
+            } else {
+                record_size((state & LEN_MASK) as usize)
+            };
+
+            self.state_word(offset).store(0, Ordering::Relaxed);
+            unsafe {
+                std::ptr::write_bytes(self.byte_ptr(offset + 4), 0, total - 4);
+            }
+            tail = tail.wrapping_add(total);
+        }
+
+        if tail != start {
+            self.tail.0.store(tail, Ordering::Release);
+        }
+    }
+
+    fn padding_for(&self, head: usize, total: usize) -> usize
+    {
+        let offset = head & self.mask;
+        if offset + total > self.capacity() {
+            self.capacity() - offset
+        } else {
+            0
+        }
+    }
+
+    fn claim(&self, head: usize, pad: usize, len: usize) -> Slot
+    {
+        let offset = head & self.mask;
+        if pad > 0 {
+            self.state_word(offset)
+                .store(pad as u32 | PADDING | COMMITTED, Ordering::Release);
+        }
+
+        let offset = (offset + pad) & self.mask;
+        self.state_word(offset).store(len as u32, Ordering::Relaxed);
+
+        Slot { offset, len }
+    }
+
+    fn state_word(&self, offset: usize) -> &AtomicU32
+    {
+        unsafe { &*(self.byte_ptr(offset) as *const AtomicU32) }
+    }
+
+    unsafe fn byte_ptr(&self, offset: usize) -> *mut u8
+    {
+        (self.mem.as_ptr() as *mut u8).add(offset)
+    }
+}
+
+
+fn record_size(len: usize) -> usize
+{
+    (RECORD_HEADER_LEN + len + 7) & !7
+}
+
+
+// One single-producer ring per thread and tracer. Producer threads create
+// their ring lazily on their first submit and publish it in 'new_rings', from
+// where the tracer-thread harvests it. When the producer thread exits, its
+// ring is marked retired and freed by the tracer-thread once drained.
+pub(crate) struct ThreadRings {
+    tracer_id: usize,
+    ring_size: usize,
+    new_rings: Mutex<Vec<Arc<ThreadRing>>>,
+}
+
+pub(crate) struct ThreadRing {
+    pub(crate) ring: ByteRing,
+    retired: AtomicBool,
+}
+
+// Entry in the thread-local ring list. Dropped on thread exit.
+struct LocalRing {
+    tracer_id: usize,
+    ring: Arc<ThreadRing>,
+}
+
+impl Drop for LocalRing {
+    fn drop(&mut self)
+    {
+        self.ring.retired.store(true, Ordering::Release);
+    }
+}
+
+static NEXT_TRACER_ID: AtomicUsize = AtomicUsize::new(0);
+
+thread_local! {
+    static LOCAL_RINGS: RefCell<Vec<LocalRing>> = RefCell::new(Vec::new());
+}
+
+
+impl ThreadRings {
+    pub(crate) fn new(ring_size: usize) -> ThreadRings
+    {
+        ThreadRings {
+            tracer_id: NEXT_TRACER_ID.fetch_add(1, Ordering::Relaxed),
+            ring_size,
+            new_rings: Mutex::new(Vec::new()),
+        }
+    }
+
+    // Runs f with the calling thread's ring, creating it if necessary.
+    // Returns None if the thread-local storage is not available anymore,
+    // which is the case while the thread is being torn down.
+    pub(crate) fn with_local<F, R>(&self, f: F) -> Option<R>
+        where F: FnOnce(&ByteRing) -> R
+    {
+        LOCAL_RINGS.try_with(|rings| {
+            let mut rings = rings.borrow_mut();
+
+            if let Some(local) = rings.iter()
+                .find(|local| local.tracer_id == self.tracer_id) {
+                return f(&local.ring.ring);
+            }
+
+            // Rings of terminated tracers are only referenced from here
+            rings.retain(|local| Arc::strong_count(&local.ring) > 1);
+
+            let ring = Arc::new(ThreadRing {
+                ring: ByteRing::new(self.ring_size),
+                retired: AtomicBool::new(false),
+            });
+            if let Ok(mut new_rings) = self.new_rings.lock() {
+                new_rings.push(Arc::clone(&ring));
+            }
+
+            let ret = f(&ring.ring);
+            rings.push(LocalRing { tracer_id: self.tracer_id, ring });
+            ret
+        }).ok()
+    }
+
+    // Moves rings created since the last call to 'rings'
+    pub(crate) fn harvest(&self, rings: &mut Vec<Arc<ThreadRing>>)
+    {
+        if let Ok(mut new_rings) = self.new_rings.lock() {
+            rings.append(&mut new_rings);
+        }
+    }
+}
+
+
+impl ThreadRing {
+    // A retired ring will never receive new records
+    pub(crate) fn is_retired(&self) -> bool
+    {
+        self.retired.load(Ordering::Acquire)
+    }
+}
+
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn push_bytes(ring: &ByteRing, tag: u32, data: &[u8]) -> bool
+    {
+        ring.push(tag, data.len(), std::iter::once(data))
+    }
+
+    fn drain(ring: &ByteRing) -> Vec<(u32, Vec<u8>)>
+    {
+        let mut records = Vec::new();
+        ring.consume(|tag, payload| records.push((tag, payload.to_vec())));
+        records
+    }
+
+    #[test]
+    fn wraps_around_with_padding()
+    {
+        let ring = ByteRing::new(4096);
+
+        // 3008 bytes in, 3008 out: the next record of 1500 bytes does not fit
+        // before the end and has to be preceded by padding
+        assert!(push_bytes(&ring, 1, &[1; 1504 - RECORD_HEADER_LEN]));
+        assert!(push_bytes(&ring, 1, &[1; 1504 - RECORD_HEADER_LEN]));
+        assert_eq!(drain(&ring).len(), 2);
+
+        let payload: Vec<u8> = (0..1500).map(|i| i as u8).collect();
+        assert!(push_bytes(&ring, 2, &payload));
+        assert!(push_bytes(&ring, 3, b"tail"));
+
+        let records = drain(&ring);
+        assert_eq!(records, vec![(2, payload), (3, b"tail".to_vec())]);
+        assert!(ring.is_empty());
+        // Padding is not a record of its own
+        assert_eq!(ring.take_dropped(), 0);
+
+        // The head has wrapped, and the memory handed back is zeroed
+        let head = ring.head.0.load(Ordering::Relaxed);
+        assert!(head > ring.capacity());
+        assert!(ring.mem.iter().all(|word| unsafe { *word.get() } == 0));
+    }
+
+    #[test]
+    fn refuses_records_when_full()
+    {
+        let ring = ByteRing::new(4096);
+        let record = [7u8; 1016];
+
+        // 1024 bytes per record with the header
+        for tag in 0..4 {
+            assert!(push_bytes(&ring, tag, &record));
+        }
+        assert!(!push_bytes(&ring, 4, &record));
+        assert!(!push_bytes(&ring, 5, b"x"));
+        assert_eq!(ring.take_dropped(), 2);
+        assert_eq!(ring.take_dropped(), 0);
+
+        let records = drain(&ring);
+        assert_eq!(records.iter().map(|r| r.0).collect::<Vec<_>>(),
+                   vec![0, 1, 2, 3]);
+        assert!(push_bytes(&ring, 6, &record));
+    }
+
+    #[test]
+    fn refuses_records_larger_than_half()
+    {
+        let ring = ByteRing::new(4096);
+
+        assert!(!push_bytes(&ring, 0, &[0; 2048]));
+        assert_eq!(ring.take_dropped(), 1);
+        assert!(ring.is_empty());
+    }
+
+    #[test]
+    fn stops_at_uncommitted_records()
+    {
+        let ring = ByteRing::new(4096);
+
+        let slot = ring.reserve(4).unwrap();
+        assert!(push_bytes(&ring, 2, b"next"));
+        assert!(drain(&ring).is_empty());
+
+        ring.set_tag(&slot, 1);
+        unsafe { std::ptr::copy_nonoverlapping(b"frst".as_ptr(),
+                                               ring.payload(&slot), 4); }
+        ring.commit(slot);
+        assert_eq!(drain(&ring), vec![(1, b"frst".to_vec()),
+                                      (2, b"next".to_vec())]);
+    }
+}
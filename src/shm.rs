@@ -0,0 +1,210 @@
+// Copyright 2019, 2020 Rohde & Schwarz GmbH & Co KG
+//      philipp.stanner@rohde-schwarz.com
+//      hagen.pfeifer@rohde-schwarz.com
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+// Shared-memory transport for a collector on the same host, see SHM_REQUEST.
+// The tracer-thread writes the byte stream it would otherwise send over the
+// socket into a ring in a memfd, which the collector maps as well. Neither
+// side makes a syscall per frame: the tracer-thread publishes how far it has
+// written, the collector how far it has read.
+//
+// Layout of the memfd, counters in native byte order:
+//
+//     0    u64 head: bytes written since the ring was set up
+//     64   u64 tail: bytes consumed by the collector
+//     128  capacity bytes of data, byte n of the stream at n % capacity
+
+use std::io;
+use std::mem;
+use std::os::raw::{c_char, c_int, c_void};
+use std::ptr;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use crate::{iovec, advance_iovec, iov_bytes};
+
+// Head and tail on cache lines of their own
+const HEAD_OFFSET: usize = 0;
+const TAIL_OFFSET: usize = 64;
+const DATA_OFFSET: usize = 128;
+
+pub(crate) const DEFAULT_CAPACITY: usize = 4 * 1024 * 1024;
+const MIN_CAPACITY: usize = 64 * 1024;
+const MAX_CAPACITY: usize = 1024 * 1024 * 1024;
+
+// Room for a control message carrying one file descriptor, aligned like
+// cmsghdr. Holds CMSG_SPACE(sizeof(int)).
+type FdCmsgBuf = [libc::cmsghdr; 2];
+
+// The tracer's side of the ring, owned by the tracer-thread
+pub(crate) struct ShmRing {
+    base: *mut u8,
+    map_len: usize,
+    capacity: usize,
+    fd: c_int,
+}
+
+impl ShmRing {
+    // The capacity is rounded up to a power of two within sane bounds, 0
+    // selects the default
+    pub(crate) fn new(capacity: usize) -> io::Result<ShmRing>
+    {
+        let capacity = if capacity == 0 {
+            DEFAULT_CAPACITY
+        } else {
+            capacity.max(MIN_CAPACITY).min(MAX_CAPACITY).next_power_of_two()
+        };
+        let map_len = DATA_OFFSET + capacity;
+
+        let fd = unsafe {
+            libc::memfd_create(b"tracy\0".as_ptr() as *const c_char,
+                               libc::MFD_CLOEXEC)
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        // Fresh memfd pages read as zeroes, so head and tail start at 0
+        if unsafe { libc::ftruncate(fd, map_len as libc::off_t) } != 0 {
+            let e = io::Error::last_os_error();
+            unsafe { libc::close(fd); }
+            return Err(e);
+        }
+
+        let base = unsafe {
+            libc::mmap(ptr::null_mut(), map_len,
+                       libc::PROT_READ | libc::PROT_WRITE, libc::MAP_SHARED,
+                       fd, 0)
+        };
+        if base == libc::MAP_FAILED {
+            let e = io::Error::last_os_error();
+            unsafe { libc::close(fd); }
+            return Err(e);
+        }
+
+        Ok(ShmRing {
+            base: base as *mut u8,
+            map_len,
+            capacity,
+            fd,
+        })
+    }
+
+    pub(crate) fn capacity(&self) -> usize
+    {
+        self.capacity
+    }
+
+    pub(crate) fn fd(&self) -> c_int
+    {
+        self.fd
+    }
+
+    fn counter(&self, offset: usize) -> &AtomicU64
+    {
+        unsafe { &*(self.base.add(offset) as *const AtomicU64) }
+    }
+
+    // Copies as much of the iovecs as there is room for. Behaves like
+    // writev on a non-blocking socket: a partially written iovec is advanced
+    // in place, and the index of the first iovec not written completely is
+    // returned. Fails if the collector has moved the tail outside of the
+    // bytes written, as the ring can't be trusted then.
+    pub(crate) fn write_iovecs(&self, iovecs: &mut [libc::iovec])
+        -> io::Result<usize>
+    {
+        let head = self.counter(HEAD_OFFSET).load(Ordering::Relaxed);
+        // Pairs with the collector's release of the bytes it has consumed
+        let tail = self.counter(TAIL_OFFSET).load(Ordering::Acquire);
+        let used = head.wrapping_sub(tail);
+        if used > self.capacity as u64 {
+            return Err(io::Error::new(io::ErrorKind::InvalidData,
+                                      "shared memory tail out of range"));
+        }
+        let mut free = self.capacity - used as usize;
+        let mut pos = head;
+        let mut first = 0;
+
+        while first < iovecs.len() && free > 0 {
+            let iov = &mut iovecs[first];
+            let len = iov.iov_len.min(free);
+            self.copy_in(pos, &iov_bytes(iov)[..len]);
+            pos = pos.wrapping_add(len as u64);
+            free -= len;
+
+            if len < iov.iov_len {
+                advance_iovec(iov, len);
+                break;
+            }
+            first += 1;
+        }
+
+        // Publishes the data written above
+        self.counter(HEAD_OFFSET).store(pos, Ordering::Release);
+        Ok(first)
+    }
+
+    // Writes data at stream position pos, wrapping around the end
+    fn copy_in(&self, pos: u64, data: &[u8])
+    {
+        let start = pos as usize & (self.capacity - 1);
+        let first_len = data.len().min(self.capacity - start);
+
+        unsafe {
+            let ring = self.base.add(DATA_OFFSET);
+            ptr::copy_nonoverlapping(data.as_ptr(), ring.add(start), first_len);
+            ptr::copy_nonoverlapping(data[first_len..].as_ptr(), ring,
+                                     data.len() - first_len);
+        }
+    }
+}
+
+impl Drop for ShmRing {
+    // The collector keeps its own mapping
+    fn drop(&mut self)
+    {
+        unsafe {
+            libc::munmap(self.base as *mut c_void, self.map_len);
+            libc::close(self.fd);
+        }
+    }
+}
+
+
+// Sends data over the unix socket, with fd attached if given. Fails unless
+// the socket takes all of it at once.
+pub(crate) fn send_with_fd(socket: c_int, data: &[u8], fd: Option<c_int>)
+    -> io::Result<()>
+{
+    let mut iov = iovec(data);
+    let mut cmsg_buf: FdCmsgBuf = unsafe { mem::zeroed() };
+    let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+
+    if let Some(fd) = fd {
+        let fd_len = mem::size_of::<c_int>() as u32;
+        msg.msg_control = cmsg_buf.as_mut_ptr() as *mut c_void;
+        msg.msg_controllen = unsafe { libc::CMSG_SPACE(fd_len) } as _;
+        unsafe {
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            (*cmsg).cmsg_level = libc::SOL_SOCKET;
+            (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+            (*cmsg).cmsg_len = libc::CMSG_LEN(fd_len) as _;
+            ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut c_int, fd);
+        }
+    }
+
+    let ret = unsafe { libc::sendmsg(socket, &msg, libc::MSG_NOSIGNAL) };
+    if ret < 0 {
+        return Err(io::Error::last_os_error());
+    }
+    if ret as usize != data.len() {
+        return Err(io::ErrorKind::WriteZero.into());
+    }
+
+    Ok(())
+}
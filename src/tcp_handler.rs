@@ -8,263 +8,1976 @@
 
 use mio::*;
 use mio::net::{TcpListener, TcpStream};
+use mio::unix::EventedFd;
 
 use std::net::{SocketAddr, IpAddr, Ipv6Addr};
-use std::io::{ErrorKind, BufReader, Read, Write};
-use std::sync::atomic::Ordering;
+use std::io::{ErrorKind, BufReader, Read};
 
-use std::time::{SystemTime, UNIX_EPOCH};
+use std::collections::VecDeque;
+use std::fs::File;
+use std::mem;
+use std::ops::Range;
+use std::os::raw::{c_int, c_void};
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::os::unix::net::{UnixListener, UnixStream};
+use std::rc::Rc;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+use crate::{delta, lz4, shm};
+use crate::clock::Calibrator;
+use crate::file_sink::FileSink;
+use crate::ring::ByteRing;
+use crate::{TracerContext, BufferElement, Blob, Budget, FormatTable,
+            RecordKind, DrainQueue, RingSet, iovec, iov_bytes, advance_iovec,
+            CLIENT_TOKENS, MAX_TRACEPOINTS, MAX_TRACEPOINT_NAME_LEN,
+            MAX_WIRE_DATA_LEN, CALIBRATION_INTERVAL, TIMESTAMP_LEN,
+            FORMATTED_TAG};
+
+pub const HEADER_LEN: usize = 12;
+
+// magic nr: 'RuSt'
+pub const MAGIC_NUMB: [u8; 4] = [0x52, 0x75, 0x53, 0x74];
+// Default, see Tuning
+pub(crate) const REC_BUF_SZ: usize = 4096;
+// Tracepoint name length and data length preceding the name resp. the data
+// of each record
+const RECORD_PREFIX_LEN: usize = 2 + 2;
+// From <limits.h>
+const IOV_MAX: usize = 1024;
+// Default of the unsent bytes above which trace data is dropped instead of
+// queued, see Backlog
+pub(crate) const BACKLOG_LIMIT: usize = 8 * 1024 * 1024;
+// Default of the clients served at the same time, see Client
+pub(crate) const MAX_CLIENTS: usize = 8;
+
+// Header flags. Set by the client in any request, they select the encoding
+// of the records for the rest of the connection. The tracer sets them on its
+// TRACE_PUSH frames accordingly.
+// Records carry the tracepoint's ID instead of its name. The tracer announces
+// the IDs with TRACEPOINT_ID_LIST.
+pub(crate) const FLAG_TRACEPOINT_IDS: u16 = 0x0001;
+// Frames start with a base timestamp, records carry the difference to their
+// predecessor's timestamp. Lengths, IDs and differences are varints.
+const FLAG_COMPACT_RECORDS: u16 = 0x0002;
+// Frames may be LZ4 compressed. Only set on the frames which actually are.
+const FLAG_COMPRESSED: u16 = 0x0004;
+const KNOWN_FLAGS: u16 = FLAG_TRACEPOINT_IDS | FLAG_COMPACT_RECORDS |
+    FLAG_COMPRESSED;
+// Tracepoint ID preceding the timestamp and data length preceding the data
+// of each record in FLAG_TRACEPOINT_IDS mode
+const ID_RECORD_PREFIX_LEN: usize = 2 + 2;
+// A u64 as LEB128 varint
+const MAX_VARINT_LEN: usize = 10;
+// Frames smaller than this are not worth compressing
+const MIN_COMPRESS_LEN: usize = 256;
+
+// Clock ID, ticks, UNIX_EPOCH nanoseconds, ticks per second
+const CALIBRATION_LEN: usize = 2 + 8 + 8 + 8;
+// Blob ID, total length and offset preceding each blob chunk
+const BLOB_CHUNK_PREFIX_LEN: usize = 4 + 4 + 4;
+// Records in the burst, records overwritten since the recorder was switched on
+const FLIGHT_RECORDER_END_LEN: usize = 4 + 8;
+// The ring does not signal when the collector has made room, so a backlog
+// in front of it is retried this often
+const SHM_RETRY_INTERVAL: Duration = Duration::from_millis(1);
+
+// Clients an emergency flush serves at most, see emergency_flush
+const MAX_EMERGENCY_CLIENTS: usize = 64;
+
+extern "C" {
+}
+
+#[repr(u16)]
+#[derive(Clone, Copy, PartialEq)]
+enum Command {
+    TracepointListRequest       = 1,
+    TracepointListReply         = 2,
+    TracepointEnableRequest     = 3,
+    TracepointDisableRequest    = 4,
+    TracePush                   = 5,
+    FormatStringList            = 6,
+    TracePushFormatted          = 7,
+    ClockCalibration            = 8,
+    DropReport                  = 9,
+    TracepointIdList            = 10,
+    TracePushDelta              = 11,
+    TraceBlob                   = 12,
+    ShmRequest                  = 13,
+    ShmReply                    = 14,
+    FlightRecorderRequest       = 15,
+    FlightRecorderEnd           = 16,
+    Invalid                     = 42,
+}
+
+
+pub(crate) fn init() -> Option<TcpListener>
+{
+    let mut listener: Option<TcpListener> = None;
+    // random port to minimize risk for conflicts
+    for port in 61455u16..u16::max_value() {
+        let addr = SocketAddr::new(
+            IpAddr::V6(Ipv6Addr::new(0, 0, 0, 0, 0, 0, 0, 0)), port);
+
+        if let Ok(l) = TcpListener::bind(&addr) {
+            println!("tracy: TCP: Bound to port number {} on all interfaces.",
+                     port);
+            listener = Some(l);
+            break;
+        }
+    }
+
+    listener
+}
+
+
+// Listens on a socket in the abstract namespace, for collectors on the same
+// host. Abstract sockets need no file system path, and vanish with the
+// process.
+pub(crate) fn init_unix(name: &str) -> Option<UnixListener>
+{
+    let mut addr: libc::sockaddr_un = unsafe { mem::zeroed() };
+    addr.sun_family = libc::AF_UNIX as libc::sa_family_t;
+    // The leading 0 byte selects the abstract namespace
+    let path_len = addr.sun_path.len();
+    let name = &name.as_bytes()[..name.len().min(path_len - 1)];
+    for (dst, src) in addr.sun_path[1..].iter_mut().zip(name) {
+        *dst = *src as libc::c_char;
+    }
+    let len = (mem::size_of::<libc::sa_family_t>() + 1 + name.len())
+        as libc::socklen_t;
+
+    let fd = unsafe {
+        libc::socket(libc::AF_UNIX,
+                     libc::SOCK_STREAM | libc::SOCK_NONBLOCK |
+                     libc::SOCK_CLOEXEC, 0)
+    };
+    if fd < 0 {
+        eprintln!("tracy: Could not create unix socket: {}",
+                  std::io::Error::last_os_error());
+        return None;
+    }
+
+    let addr_ptr = &addr as *const libc::sockaddr_un as *const libc::sockaddr;
+    if unsafe { libc::bind(fd, addr_ptr, len) } != 0 ||
+        unsafe { libc::listen(fd, 1) } != 0 {
+        eprintln!("tracy: Could not bind unix socket @{}: {}",
+                  String::from_utf8_lossy(name),
+                  std::io::Error::last_os_error());
+        unsafe { libc::close(fd); }
+        return None;
+    }
+
+    println!("tracy: Unix: Listening on @{}.", String::from_utf8_lossy(name));
+    Some(unsafe { UnixListener::from_raw_fd(fd) })
+}
+
+
+// A connection to a client, over TCP or, for clients on the same host, over
+// the unix socket. Both speak the same protocol.
+pub(crate) enum Stream {
+    Tcp(TcpStream),
+    Unix(UnixStream),
+}
+
+impl Stream {
+    fn try_clone(&self) -> std::io::Result<Stream>
+    {
+        match self {
+            Stream::Tcp(stream) => stream.try_clone().map(Stream::Tcp),
+            Stream::Unix(stream) => stream.try_clone().map(Stream::Unix),
+        }
+    }
+
+    fn register(&self, poll: &Poll, token: Token, interest: Ready)
+        -> std::io::Result<()>
+    {
+        match self {
+            Stream::Tcp(stream) =>
+                poll.register(stream, token, interest, PollOpt::edge()),
+            Stream::Unix(stream) =>
+                poll.register(&EventedFd(&stream.as_raw_fd()), token,
+                              interest, PollOpt::edge()),
+        }
+    }
+
+    pub(crate) fn deregister(&self, poll: &Poll) -> std::io::Result<()>
+    {
+        match self {
+            Stream::Tcp(stream) => poll.deregister(stream),
+            Stream::Unix(stream) =>
+                poll.deregister(&EventedFd(&stream.as_raw_fd())),
+        }
+    }
+}
+
+impl Read for Stream {
+    fn read(&mut self, buf: &mut [u8]) -> std::io::Result<usize>
+    {
+        match self {
+            Stream::Tcp(stream) => stream.read(buf),
+            Stream::Unix(stream) => stream.read(buf),
+        }
+    }
+}
+
+impl AsRawFd for Stream {
+    fn as_raw_fd(&self) -> RawFd
+    {
+        match self {
+            Stream::Tcp(stream) => stream.as_raw_fd(),
+            Stream::Unix(stream) => stream.as_raw_fd(),
+        }
+    }
+}
+
+
+// Accepts a client on the TCP listener, or with unix set, on the unix socket
+fn accept(ctx: &TracerContext, unix: bool) -> std::io::Result<Stream>
+{
+    if !unix {
+        return ctx.listener.accept().map(|(socket, _addr)| Stream::Tcp(socket));
+    }
+
+    let listener = match &ctx.unix_listener {
+        Some(listener) => listener,
+        None => return Err(ErrorKind::NotConnected.into()),
+    };
+    let (socket, _addr) = listener.accept()?;
+    socket.set_nonblocking(true)?;
+    Ok(Stream::Unix(socket))
+}
+
+
+// A connected client, owned by the tracer-thread. Every client has its own
+// encoding, subscriptions and backlog, so a slow or picky one does not hold
+// up the others. A tracepoint is enabled while any client is subscribed.
+pub(crate) struct Client {
+    stream: Stream,
+    // Replaces the stream for the data sent to the client, see setup_shm
+    shm: Option<shm::ShmRing>,
+    // Header flags the client asked for, which select the record encoding
+    // of TRACE_PUSH frames, see FLAG_TRACEPOINT_IDS
+    record_flags: u16,
+    // Number of format strings the client already knows
+    formats_announced: usize,
+    // Number of tracepoint IDs the client already knows
+    ids_announced: usize,
+    // When the client was last sent a calibration, None after connecting
+    last_calibration: Option<Instant>,
+    // Indexed by tracepoint handle
+    subscribed: Vec<bool>,
+    backlog: Backlog,
+    // Payloads only this client missed, by tracepoint handle, until the
+    // next drop report
+    dropped: Vec<u64>,
+    // Blobs being sent to this client in chunks, in the order their next
+    // chunk is sent in
+    blobs: VecDeque<PendingBlob>,
+}
+
+impl Client {
+    fn new(stream: Stream, backlog_limit: usize) -> Client
+    {
+        Client {
+            stream,
+            shm: None,
+            record_flags: 0,
+            formats_announced: 0,
+            ids_announced: 0,
+            last_calibration: None,
+            subscribed: vec![false; MAX_TRACEPOINTS],
+            backlog: Backlog::new(backlog_limit),
+            dropped: Vec::new(),
+            blobs: VecDeque::new(),
+        }
+    }
+
+    pub(crate) fn subscribed(&self, handle: usize) -> bool
+    {
+        self.subscribed[handle]
+    }
+
+    pub(crate) fn deregister(&self, poll: &Poll) -> std::io::Result<()>
+    {
+        self.stream.deregister(poll)
+    }
+
+    fn count_drops(&mut self, handle: usize, count: u64)
+    {
+        if self.dropped.len() <= handle {
+            self.dropped.resize(handle + 1, 0);
+        }
+        self.dropped[handle] += count;
+    }
+
+    // The client is gone. Blobs nobody else gets are reported as dropped,
+    // should another client come.
+    pub(crate) fn discard_blobs(&mut self)
+    {
+        for pending in self.blobs.drain(..) {
+            if Rc::strong_count(&pending.blob) == 1 {
+                let shared = &pending.blob;
+                shared.budget.count_drop(shared.blob.handle);
+            }
+        }
+    }
+
+    // Whether the client gets the same frames as other
+    fn same_frames(&self, other: &Client) -> bool
+    {
+        self.record_flags == other.record_flags &&
+            self.subscribed == other.subscribed
+    }
+}
+
+
+// The client in slot n has the poll tokens CLIENT_TOKENS + 2 * n for its
+// requests and the one after it for CON_WRITE, when the backlog can be sent on
+fn data_token(slot: usize) -> Token
+{
+    Token(CLIENT_TOKENS + 2 * slot)
+}
+
+fn write_token(slot: usize) -> Token
+{
+    Token(CLIENT_TOKENS + 2 * slot + 1)
+}
+
+
+// Accepts the clients waiting on the TCP listener, or with unix set, on the
+// unix socket. The listeners are edge-triggered, so all of them at once.
+pub(crate) fn accept_clients(ctx: &mut TracerContext, unix: bool)
+{
+    loop {
+        match accept(&ctx, unix) {
+            Ok(socket) => establish_connection(ctx, socket),
+            Err(ref e) if e.kind() == ErrorKind::WouldBlock => return,
+            Err(_) => {
+                eprintln!("tracy: Could not establish connection.");
+                return;
+            },
+        }
+    }
+}
+
+
+// Takes the first free slot. Without one, the socket is closed right away.
+fn establish_connection(ctx: &mut TracerContext, socket: Stream)
+{
+    let slot = match ctx.clients.iter().position(Option::is_none) {
+        Some(slot) => slot,
+        None if ctx.clients.len() < ctx.app_cfg.tuning.max_clients => {
+            ctx.clients.push(None);
+            ctx.clients.len() - 1
+        },
+        None => {
+            eprintln!("tracy: Refused client, too many connected.");
+            return;
+        },
+    };
+
+    let temp_con = socket.try_clone().unwrap();
+    temp_con.register(&ctx.poll, data_token(slot), Ready::readable())
+        .expect("Panicked at registering socket in poll.");
+    // Signals when the backlog can be sent on
+    socket.register(&ctx.poll, write_token(slot), Ready::writable())
+        .expect("Panicked at registering socket in poll.");
+
+    ctx.clients[slot] = Some(Client::new(socket,
+                                         ctx.app_cfg.tuning.backlog_limit));
+    // Deltas are encoded once for all clients, so everybody gets keyframes
+    ctx.deltas.reset();
+    ctx.flags.set_connected(true);
+
+    // Nobody else could connect anyway
+    if ctx.clients.len() == ctx.app_cfg.tuning.max_clients &&
+        ctx.clients.iter().all(Option::is_some) {
+        ctx.check_stop_udp_timer();
+    }
+
+    // What happened before the client came
+    if !ctx.recorder.records().is_empty() {
+        send_flight_recording(ctx, slot);
+    }
+}
+
+
+// Dispatches the events of the client sockets, see data_token
+pub(crate) fn client_event(ctx: &mut TracerContext, token: Token)
+{
+    let slot = (token.0 - CLIENT_TOKENS) / 2;
+
+    // Left over from a client closed while handling the same events
+    if ctx.clients.get(slot).map_or(true, Option::is_none) {
+        return;
+    }
+
+    if token == data_token(slot) {
+        receive(ctx, slot);
+    } else {
+        send_backlog(ctx, slot);
+    }
+}
+
+
+fn receive(mut ctx: &mut TracerContext, slot: usize)
+{
+    let stream = &ctx.clients[slot].as_ref().unwrap().stream;
+    let mut reader = BufReader::with_capacity(ctx.app_cfg.tuning.recv_buf_size,
+                                              stream.try_clone().unwrap());
+    let mut header: [u8; 12] = [0; 12];
+
+    // Stops once a request has closed the connection
+    while ctx.clients[slot].is_some() {
+        if let Err(e) = reader.read_exact(&mut header) {
+            if e.kind() != ErrorKind::WouldBlock {
+                ctx.close_client(slot);
+            }
+            return;
+        }
+
+        // In case of invalid header: Close the connection
+        let (cmd, flags, len) = match check_parse_header(&header) {
+            Ok(parsed) => parsed,
+            Err(_) => {
+                ctx.close_client(slot);
+                read_empty(&mut reader, &mut ctx, slot);
+                return;
+            },
+        };
+
+        // Sticks for the rest of the connection. Switched on between two
+        // flushes, so no frame mixes encodings.
+        let client = ctx.clients[slot].as_mut().unwrap();
+        let new_flags = flags & !client.record_flags;
+        client.record_flags |= flags;
+        if new_flags & FLAG_TRACEPOINT_IDS != 0 && !send_new_ids(&mut ctx, slot) {
+            return;
+        }
+
+        execute_command(&mut ctx, slot, cmd, len, &mut reader);
+    }
+}
+
+
+fn execute_command(mut ctx: &mut TracerContext,
+                   slot: usize,
+                   cmd: Command,
+                   len: u32,
+                   mut reader: &mut BufReader<Stream>)
+{
+    match cmd {
+        Command::TracepointListRequest => send_tracepoint_list(&mut ctx, slot),
+        Command::TracepointEnableRequest =>
+            set_tracepoints(&mut ctx, slot, len, &mut reader, true),
+        Command::TracepointDisableRequest =>
+            set_tracepoints(&mut ctx, slot, len, &mut reader, false),
+        Command::ShmRequest => setup_shm(&mut ctx, slot, len, &mut reader),
+        Command::FlightRecorderRequest => send_flight_recording(&mut ctx, slot),
+        _ => (), // can never occur, because check_parse_header()
+    }
+}
+
+
+fn send_tracepoint_list(mut ctx: &mut TracerContext, slot: usize)
+{
+    let mut msg: Vec<u8> = Vec::with_capacity(1024);
+
+    for tracepoint in ctx.tracepoints.keys() {
+        msg.extend_from_slice(&(tracepoint.len() as u16).to_be_bytes());
+        msg.extend_from_slice(tracepoint.as_bytes());
+    }
+
+    let client = ctx.clients[slot].as_mut().unwrap();
+    if send_message(client, Command::TracepointListReply, &msg).is_err() {
+        ctx.close_client(slot);
+        return;
+    }
+
+    send_new_formats(&mut ctx, slot);
+}
+
+
+// Announces the format strings registered since the last announcement, so
+// the client can format deferred printf records. Returns false if the
+// connection has been closed.
+fn send_new_formats(ctx: &mut TracerContext, slot: usize) -> bool
+{
+    let client = ctx.clients[slot].as_mut().unwrap();
+    let msg = new_formats(&ctx.formats, &mut client.formats_announced);
+
+    if msg.is_empty() {
+        return true;
+    }
+
+    if send_message(client, Command::FormatStringList, &msg).is_err() {
+        ctx.close_client(slot);
+        return false;
+    }
+
+    true
+}
+
+
+// The FORMAT_STRING_LIST payload of the format strings registered since
+// announced, which is advanced
+fn new_formats(formats: &Mutex<FormatTable>, announced: &mut usize) -> Vec<u8>
+{
+    let mut msg: Vec<u8> = Vec::new();
+
+    if let Ok(formats) = formats.lock() {
+        for (id, fmt) in formats.strings.iter().enumerate().skip(*announced) {
+            msg.extend_from_slice(&(id as u16).to_be_bytes());
+            msg.extend_from_slice(&(fmt.len() as u16).to_be_bytes());
+            msg.extend_from_slice(fmt.as_bytes());
+        }
+        *announced = formats.strings.len();
+    }
+
+    msg
+}
+
+
+// Announces the IDs of the tracepoints registered since the last
+// announcement, if the client asked for IDs. Returns false if the connection
+// has been closed.
+fn send_new_ids(ctx: &mut TracerContext, slot: usize) -> bool
+{
+    let client = ctx.clients[slot].as_mut().unwrap();
+    if client.record_flags & FLAG_TRACEPOINT_IDS == 0 {
+        return true;
+    }
+
+    let mut msg: Vec<u8> = Vec::new();
+
+    for (id, name) in ctx.tracepoint_names.iter().enumerate()
+        .skip(client.ids_announced) {
+        msg.extend_from_slice(&(id as u16).to_be_bytes());
+        msg.extend_from_slice(&(name.len() as u16).to_be_bytes());
+        msg.extend_from_slice(name.as_bytes());
+    }
+    client.ids_announced = ctx.tracepoint_names.len();
+
+    if msg.is_empty() {
+        return true;
+    }
+
+    if send_message(client, Command::TracepointIdList, &msg).is_err() {
+        ctx.close_client(slot);
+        return false;
+    }
+
+    true
+}
+
+
+// Tells the client how to convert the timestamps to UNIX_EPOCH nanoseconds,
+// if the tracer's clock needs it: right after connecting, and then every
+// CALIBRATION_INTERVAL. Returns false if the connection has been closed.
+fn send_calibration(ctx: &mut TracerContext, slot: usize) -> bool
+{
+    let client = ctx.clients[slot].as_mut().unwrap();
+    let msg = match calibration_due(&ctx.calibrator, client.last_calibration) {
+        Some(msg) => msg,
+        None => return true,
+    };
+
+    if send_message(client, Command::ClockCalibration, &msg).is_err() {
+        ctx.close_client(slot);
+        return false;
+    }
+
+    client.last_calibration = Some(Instant::now());
+    true
+}
+
+
+// The CLOCK_CALIBRATION payload, if the clock needs calibration and the last
+// one was sent CALIBRATION_INTERVAL ago
+fn calibration_due(calibrator: &Option<Calibrator>, last: Option<Instant>)
+    -> Option<[u8; CALIBRATION_LEN]>
+{
+    let calibration = match (calibrator, last) {
+        (Some(calibrator), None) => calibrator.calibrate(),
+        (Some(calibrator), Some(last))
+            if last.elapsed() >= CALIBRATION_INTERVAL =>
+            calibrator.calibrate(),
+        _ => return None,
+    };
+
+    let mut msg = [0u8; CALIBRATION_LEN];
+    msg[..2].copy_from_slice(&(calibration.clock as u16).to_be_bytes());
+    msg[2..10].copy_from_slice(&calibration.ticks.to_be_bytes());
+    msg[10..18].copy_from_slice(&calibration.epoch_ns.to_be_bytes());
+    msg[18..].copy_from_slice(&calibration.ticks_per_sec.to_be_bytes());
+    Some(msg)
+}
+
+
+// Hands the payloads dropped because of the budget to the drop reports of
+// all clients connected now
+fn take_drops(ctx: &mut TracerContext)
+{
+    for handle in 0..ctx.tracepoint_names.len() {
+        let dropped = ctx.budget.take_dropped(handle);
+        if dropped == 0 {
+            continue;
+        }
+
+        for client in ctx.clients.iter_mut().flatten() {
+            client.count_drops(handle, dropped);
+        }
+    }
+}
+
+
+// Tells the client how many payloads of which tracepoints have been dropped
+// since the last report, because of the budget or the client not keeping up.
+// Returns false if the connection has been closed.
+fn send_drop_report(ctx: &mut TracerContext, slot: usize) -> bool
+{
+    let client = ctx.clients[slot].as_mut().unwrap();
+    let mut msg: Vec<u8> = Vec::new();
+
+    for (handle, dropped) in client.dropped.iter_mut().enumerate() {
+        if *dropped == 0 {
+            continue;
+        }
+
+        let name = &ctx.tracepoint_names[handle];
+        msg.extend_from_slice(&(name.len() as u16).to_be_bytes());
+        msg.extend_from_slice(name.as_bytes());
+        msg.extend_from_slice(&dropped.to_be_bytes());
+        *dropped = 0;
+    }
+
+    if msg.is_empty() {
+        return true;
+    }
+
+    if send_message(client, Command::DropReport, &msg).is_err() {
+        ctx.close_client(slot);
+        return false;
+    }
+
+    true
+}
+
+
+// Sends the whole buffer at once. Frame headers and record prefixes are
+// serialized into the reused scratch buffer, the payloads are sent from where
+// they are, all with as few sendmsg calls as possible (usually one). Clients
+// only get the records of the tracepoints they are subscribed to; those with
+// the same encoding and subscriptions share the serialized frames.
+pub(crate) fn send_trace_data(mut ctx: &mut TracerContext)
+{
+    take_drops(&mut ctx);
+
+    // Formats and IDs have to be known to the client before records refer to
+    // them, and so does the clock
+    for slot in 0..ctx.clients.len() {
+        if ctx.clients[slot].is_some() {
+            let _ = send_calibration(&mut ctx, slot) &&
+                send_new_formats(&mut ctx, slot) &&
+                send_new_ids(&mut ctx, slot) &&
+                send_drop_report(&mut ctx, slot);
+        }
+    }
+
+    if ctx.buffer.is_empty() {
+        return;
+    }
+
+    write_file_sink(&mut ctx);
+    if !ctx.connected() {
+        ctx.clear_buffer();
+        return;
+    }
+
+    encode_deltas(&mut ctx);
+
+    for slot in 0..ctx.clients.len() {
+        let client = match &ctx.clients[slot] {
+            Some(client) => client,
+            None => continue,
+        };
+
+        // Served along with an earlier one
+        if ctx.clients[..slot].iter().flatten()
+            .any(|other| other.same_frames(client)) {
+            continue;
+        }
+
+        if !serialize_frames(&mut ctx, slot) {
+            continue;
+        }
+
+        for other in slot..ctx.clients.len() {
+            let same = match (&ctx.clients[slot], &ctx.clients[other]) {
+                (Some(client), Some(other)) => client.same_frames(other),
+                _ => false,
+            };
+            if same {
+                send_frames(&mut ctx, other);
+            }
+        }
+    }
+
+    ctx.clear_buffer();
+}
+
+
+// Delta encodes the payloads of tracepoints in delta mode, once for all
+// clients. Clients subscribed to such a tracepoint all get its payloads, and
+// whenever one of them loses track, all of them get a keyframe.
+fn encode_deltas(ctx: &mut TracerContext)
+{
+    let encoded = &mut ctx.send_scratch.encoded;
+
+    encoded.clear();
+    ctx.deltas.clear_encoded();
+
+    for element in ctx.buffer.iter() {
+        encoded.push(delta_encode(&mut ctx.deltas, element));
+    }
+}
+
+
+// Serializes the frames of the buffered records the client in slot is
+// subscribed to into the scratch buffer. Returns false if there are none.
+fn serialize_frames(ctx: &mut TracerContext, slot: usize) -> bool
+{
+    let client = ctx.clients[slot].as_ref().unwrap();
+
+    serialize(&mut ctx.send_scratch, &ctx.buffer, Some(&ctx.deltas),
+              client.record_flags, ctx.app_cfg.tuning.queue_size,
+              |element| client.subscribed(element.handle))
+}
+
+
+// Serializes the frames of the records include selects into the scratch
+// buffer, with the payloads delta encoded by encode_deltas if deltas is
+// given. Returns false if there are none.
+fn serialize(scratch: &mut SendScratch, records: &VecDeque<BufferElement>,
+             deltas: Option<&delta::Deltas>, flags: u16, frame_limit: usize,
+             include: impl Fn(&BufferElement) -> bool) -> bool
+{
+    let mut frame: Option<usize> = None;
+    let mut frame_len = 0;
+    let mut cmd = Command::TracePush;
+    // Timestamp of the previous record, for FLAG_COMPACT_RECORDS
+    let mut prev = 0;
+
+    scratch.clear();
+
+    for (index, element) in records.iter().enumerate() {
+        if !include(element) {
+            continue;
+        }
+
+        let encoded = deltas.and_then(|deltas| {
+            scratch.encoded[index].clone().map(|range| deltas.encoded(range))
+        });
+        let data_len = encoded.map_or(element.data.len(), |data| data.len());
+        let record_cmd = match (encoded, element.kind) {
+            (Some(_), _) => Command::TracePushDelta,
+            (None, RecordKind::Raw) => Command::TracePush,
+            (None, RecordKind::Formatted) => Command::TracePushFormatted,
+        };
+
+        // A frame only contains records of one command and stays below the
+        // flush threshold
+        let fits = record_cmd == cmd && frame_len +
+            record_len(element, data_len, flags, prev) + HEADER_LEN <
+            frame_limit;
+        if frame.is_none() || !fits {
+            if let Some(start) = frame {
+                scratch.finish_frame(start, frame_len, flags);
+            }
+            cmd = record_cmd;
+            frame = Some(scratch.begin_frame(cmd, flags));
+            frame_len = 0;
+
+            if flags & FLAG_COMPACT_RECORDS != 0 {
+                scratch.put(&element.timestamp.to_be_bytes());
+                frame_len += TIMESTAMP_LEN;
+                prev = element.timestamp;
+            }
+        }
+
+        frame_len += record_len(element, data_len, flags, prev);
+        scratch.put_record(index, element, encoded, flags, prev);
+        prev = element.timestamp;
+    }
+
+    match frame {
+        Some(start) => {
+            scratch.finish_frame(start, frame_len, flags);
+            true
+        },
+        None => false,
+    }
+}
+
+
+// Sends the frames in the scratch buffer to the client in slot
+fn send_frames(ctx: &mut TracerContext, slot: usize)
+{
+    let client = ctx.clients[slot].as_mut().unwrap();
+    let iovecs = ctx.send_scratch.iovecs(&ctx.buffer);
+    let result = send_iovecs(&mut client.backlog,
+                             output(&client.stream, &client.shm), iovecs, true);
+
+    match result {
+        Ok(true) => (),
+        // Reported with the client's next drop report. The client misses the
+        // payloads deltas would refer to.
+        Ok(false) => {
+            for element in &ctx.buffer {
+                if client.subscribed(element.handle) {
+                    client.count_drops(element.handle, 1);
+                }
+            }
+            ctx.deltas.reset();
+        },
+        Err(_) => ctx.close_client(slot),
+    }
+}
+
+
+// Appends the records of the tracepoints the file sink writes to its current
+// file, preceded by the control messages due for the file. The frames are
+// encoded as for a client which has set no flags, or only FLAG_COMPRESSED if
+// the sink compresses, and go out with one writev call per flush.
+fn write_file_sink(ctx: &mut TracerContext)
+{
+    let sink = &mut ctx.file_sink;
+    if !sink.is_active() {
+        return;
+    }
+
+    let flags = if sink.compress() { FLAG_COMPRESSED } else { 0 };
+    if !serialize(&mut ctx.send_scratch, &ctx.buffer, None, flags,
+                  ctx.app_cfg.tuning.queue_size,
+                  |element| sink.persisted(element.handle)) {
+        return;
+    }
+
+    let iovecs = ctx.send_scratch.iovecs(&ctx.buffer);
+    let records_len: usize = iovecs.iter().map(|iov| iov.iov_len).sum();
+    sink.make_room(records_len);
+    // Rotating failed, the sink gave up
+    if sink.file().is_none() {
+        ctx.update_recording();
+        return;
+    }
+
+    // A new file starts over with the formats and the calibration
+    let mut control = Vec::new();
+    if let Some(msg) = calibration_due(&ctx.calibrator, sink.last_calibration) {
+        control.extend_from_slice(&header(Command::ClockCalibration, 0,
+                                          msg.len() as u32));
+        control.extend_from_slice(&msg);
+        sink.last_calibration = Some(Instant::now());
+    }
+    let msg = new_formats(&ctx.formats, &mut sink.formats_announced);
+    if !msg.is_empty() {
+        control.extend_from_slice(&header(Command::FormatStringList, 0,
+                                          msg.len() as u32));
+        control.extend_from_slice(&msg);
+    }
+
+    let mut control_iovec = [iovec(&control)];
+    let file = sink.file().unwrap();
+    let result = write_iovecs(Output::File(file), &mut control_iovec)
+        .and_then(|_| write_iovecs(Output::File(file), iovecs));
+
+    match result {
+        Ok(_) => {
+            sink.appended(control.len() + records_len);
+            sink.flushed();
+        },
+        Err(e) => sink.fail(e),
+    }
+
+    // The sink gives up on errors
+    if !ctx.file_sink.is_active() {
+        ctx.update_recording();
+    }
+}
+
+
+// Sends the flight recorder's contents to the client in slot, followed by
+// FLIGHT_RECORDER_END. All of them, whatever the client is subscribed to; the
+// recorder keeps them for the next client. Not delta encoded, so the client
+// needs no state to decode them.
+fn send_flight_recording(mut ctx: &mut TracerContext, slot: usize)
+{
+    if !(send_calibration(&mut ctx, slot) && send_new_formats(&mut ctx, slot) &&
+         send_new_ids(&mut ctx, slot)) {
+        return;
+    }
+
+    let client = ctx.clients[slot].as_mut().unwrap();
+    let records = ctx.recorder.records();
+
+    if serialize(&mut ctx.send_scratch, records, None, client.record_flags,
+                 ctx.app_cfg.tuning.queue_size, |_| true) {
+        // Bounded by the recorder's capacity, so not dropped
+        let iovecs = ctx.send_scratch.iovecs(records);
+        let result = send_iovecs(&mut client.backlog,
+                                 output(&client.stream, &client.shm), iovecs,
+                                 false);
+        if result.is_err() {
+            ctx.close_client(slot);
+            return;
+        }
+    }
+
+    let mut msg = [0u8; FLIGHT_RECORDER_END_LEN];
+    msg[..4].copy_from_slice(&(records.len() as u32).to_be_bytes());
+    msg[4..].copy_from_slice(&ctx.recorder.overwritten().to_be_bytes());
+
+    if send_message(client, Command::FlightRecorderEnd, &msg).is_err() {
+        ctx.close_client(slot);
+    }
+}
+
+
+// Continues sending the backlog once the socket is writable again
+fn send_backlog(ctx: &mut TracerContext, slot: usize)
+{
+    let client = ctx.clients[slot].as_mut().unwrap();
+    if client.backlog.is_empty() {
+        return;
+    }
+
+    if client.backlog.flush(output(&client.stream, &client.shm)).is_err() {
+        ctx.close_client(slot);
+    }
+}
+
+
+// The shared-memory ring does not signal CON_WRITE
+pub(crate) fn send_shm_backlogs(ctx: &mut TracerContext)
+{
+    for slot in 0..ctx.clients.len() {
+        if ctx.clients[slot].as_ref().map_or(false, |c| c.shm.is_some()) {
+            send_backlog(ctx, slot);
+        }
+    }
+}
+
+
+// Sends the buffered records and those still in the submit rings to the
+// clients and the file sink, possibly from a thread which just crashed: no
+// allocations, no locks, plain writes which wait for a full socket until the
+// deadline. The frames are encoded as for a client which has set no flags and
+// built in the preallocated scratch. The first skip records of the buffer
+// have been sent by an earlier emergency flush. Returns the number of
+// buffered records which have been sent now, see
+// TracerContext::settle_emergency; records taken from the rings are
+// released right away.
+//
+// Not covered: records still in the submit channel, rings of threads which
+// submitted for the first time since the last drain, and clients using
+// shared memory. Formats are not announced, and the file sink is not
+// rotated.
+pub(crate) fn emergency_flush(ctx: *mut TracerContext, scratch: &mut [u8],
+                              skip: usize, deadline: Instant) -> usize
+{
+    // Only the fields the tracer-thread leaves alone while it polls
+    let (clients, sink, buffer, names, submitted, budget) = unsafe {
+        (&mut (*ctx).clients, &mut (*ctx).file_sink, &(*ctx).buffer,
+         &(*ctx).tracepoint_names, &(*ctx).submitted, &(*ctx).budget)
+    };
+
+    // The clients by slot, and the file sink after them
+    let mut alive = [false; MAX_EMERGENCY_CLIENTS + 1];
+    for (slot, client) in clients.iter_mut().enumerate()
+        .take(MAX_EMERGENCY_CLIENTS) {
+        if let Some(client) = client {
+            alive[slot] = client.shm.is_none() &&
+                emergency_backlog(client, deadline);
+        }
+    }
+    alive[MAX_EMERGENCY_CLIENTS] = sink.is_active();
+    if !alive.iter().any(|alive| *alive) {
+        return skip;
+    }
+
+    let mut frames = EmergencyFrames {
+        buf: scratch,
+        len: 0,
+        frame: None,
+        written: 0,
+    };
+
+    let sent = buffer.len();
+    if skip < sent {
+        let mut charged = 0;
+        for element in buffer.iter().skip(skip) {
+            charged += TIMESTAMP_LEN + element.data.len();
+        }
+
+        emergency_send(clients, sink, &mut alive, &mut frames, deadline,
+                       &|visit| {
+            for element in buffer.iter().skip(skip) {
+                visit(element.handle, &element.tracepoint, element.timestamp,
+                      element.kind, &element.data);
+            }
+        });
+        budget.uncharge(charged);
+    }
+
+    let mut from_ring = |ring: &ByteRing| {
+        // Records committed meanwhile are left to the tracer-thread
+        let mut consumed = 0;
+        let end = ring.peek(None, |_, record| consumed += record.len());
+        if consumed == 0 {
+            return;
+        }
+
+        emergency_send(clients, sink, &mut alive, &mut frames, deadline,
+                       &|visit| {
+            ring.peek(Some(end), |tag, record| {
+                let handle = (tag & !FORMATTED_TAG) as usize;
+                let kind = if tag & FORMATTED_TAG != 0 {
+                    RecordKind::Formatted
+                } else {
+                    RecordKind::Raw
+                };
+                let mut timestamp = [0u8; TIMESTAMP_LEN];
+                timestamp.copy_from_slice(&record[..TIMESTAMP_LEN]);
+
+                if let Some(name) = names.get(handle) {
+                    visit(handle, name, u64::from_ne_bytes(timestamp), kind,
+                          &record[TIMESTAMP_LEN..]);
+                }
+            });
+        });
+
+        ring.release(end);
+        submitted.wakeup.sub(consumed);
+        budget.uncharge(consumed);
+    };
+
+    if let DrainQueue::Rings { rings, thread_rings, .. } = &submitted.queue {
+        match rings {
+            RingSet::Shared(ring) => from_ring(ring),
+            RingSet::PerThread(_) => {
+                for ring in thread_rings {
+                    from_ring(&ring.ring);
+                }
+            },
+        }
+    }
+
+    sent
+}
+
+
+// Visits records as handle, tracepoint name, timestamp, kind and payload
+type EmergencyRecords<'a> =
+    dyn Fn(&mut dyn FnMut(usize, &str, u64, RecordKind, &[u8])) + 'a;
+
+// Sends the records to every destination still alive. A client which fails
+// in the middle of a frame is shut down, the tracer-thread closes it then.
+fn emergency_send(clients: &[Option<Client>], sink: &mut FileSink,
+                  alive: &mut [bool; MAX_EMERGENCY_CLIENTS + 1],
+                  frames: &mut EmergencyFrames, deadline: Instant,
+                  records: &EmergencyRecords)
+{
+    for slot in 0..MAX_EMERGENCY_CLIENTS {
+        if !alive[slot] {
+            continue;
+        }
+
+        let client = clients[slot].as_ref().unwrap();
+        let fd = client.stream.as_raw_fd();
+        if !frames.send(EmergencyOut::Socket(fd), deadline, records,
+                        |handle| client.subscribed(handle)) {
+            alive[slot] = false;
+            unsafe { libc::shutdown(fd, libc::SHUT_RDWR); }
+        }
+    }
+
+    if alive[MAX_EMERGENCY_CLIENTS] {
+        let out = EmergencyOut::File(sink.file().unwrap().as_raw_fd());
+        let ok = frames.send(out, deadline, records,
+                             |handle| sink.persisted(handle));
+        sink.appended(frames.written);
+        alive[MAX_EMERGENCY_CLIENTS] = ok;
+    }
+}
+
+
+// Sends what is left of the client's backlog, so the frames which follow are
+// not interleaved with it. Returns false if it did not get through.
+fn emergency_backlog(client: &mut Client, deadline: Instant) -> bool
+{
+    let backlog = &mut client.backlog;
+    let pending = &backlog.bytes[backlog.offset..];
+
+    let out = EmergencyOut::Socket(client.stream.as_raw_fd());
+    backlog.offset += write_until(out, pending, deadline);
+    backlog.is_empty()
+}
+
+
+// Where an emergency flush writes to
+#[derive(Clone, Copy)]
+enum EmergencyOut {
+    // A client which has gone away must not raise SIGPIPE in a crash handler
+    Socket(RawFd),
+    File(RawFd),
+}
+
+
+// Frames of an emergency flush, built in the preallocated scratch and
+// written out whenever it is full
+struct EmergencyFrames<'a> {
+    buf: &'a mut [u8],
+    len: usize,
+    // Start and command of the frame being built
+    frame: Option<(usize, Command)>,
+    // Bytes the last send() wrote
+    written: usize,
+}
+
+impl<'a> EmergencyFrames<'a> {
+    // Writes the records include selects to out. Returns false if they did
+    // not get through.
+    fn send(&mut self, out: EmergencyOut, deadline: Instant,
+            records: &EmergencyRecords, include: impl Fn(usize) -> bool)
+        -> bool
+    {
+        let mut ok = true;
+        self.written = 0;
+
+        records(&mut |handle, name, timestamp, kind, data| {
+            if ok && include(handle) {
+                ok = self.put(out, deadline, name, timestamp, kind, data);
+            }
+        });
+
+        let ok = ok && self.write_out(out, deadline);
+        self.len = 0;
+        self.frame = None;
+        ok
+    }
 
-use std::collections::VecDeque;
+    // Appends the record, writing out the frames before it if it does not
+    // fit anymore. The scratch holds at least one record of max_submit_len.
+    fn put(&mut self, out: EmergencyOut, deadline: Instant, name: &str,
+           timestamp: u64, kind: RecordKind, data: &[u8]) -> bool
+    {
+        let cmd = match kind {
+            RecordKind::Raw => Command::TracePush,
+            RecordKind::Formatted => Command::TracePushFormatted,
+        };
+        let len = RECORD_PREFIX_LEN + name.len() + TIMESTAMP_LEN + data.len();
 
-use crate::{TracerContext, BufferElement, CON_DATA, QUEUE_TOTAL_SIZE,
-            MAX_TRACEPOINT_NAME_LEN};
+        if let Some((_, frame_cmd)) = self.frame {
+            if frame_cmd != cmd || self.len + len > self.buf.len() {
+                self.finish_frame();
+            }
+        }
+        if self.frame.is_none() {
+            if self.len + HEADER_LEN + len > self.buf.len() &&
+                !self.write_out(out, deadline) {
+                return false;
+            }
+            if HEADER_LEN + len > self.buf.len() {
+                return true;
+            }
 
-pub const HEADER_LEN: usize = 12;
+            self.frame = Some((self.len, cmd));
+            self.push(&header(cmd, 0, 0));
+        }
 
-// magic nr: 'RuSt'
-pub const MAGIC_NUMB: [u8; 4] = [0x52, 0x75, 0x53, 0x74];
-const REC_BUF_SZ: usize = 4096;
+        self.push(&(name.len() as u16).to_be_bytes());
+        self.push(name.as_bytes());
+        self.push(&timestamp.to_be_bytes());
+        self.push(&(data.len() as u16).to_be_bytes());
+        self.push(data);
+        true
+    }
 
-#[repr(u16)]
-enum Command {
-    TracepointListRequest       = 1,
-    TracepointListReply         = 2,
-    TracepointEnableRequest     = 3,
-    TracepointDisableRequest    = 4,
-    TracePush                   = 5,
-    Invalid                     = 42,
+    fn push(&mut self, bytes: &[u8])
+    {
+        self.buf[self.len..self.len + bytes.len()].copy_from_slice(bytes);
+        self.len += bytes.len();
+    }
+
+    fn finish_frame(&mut self)
+    {
+        if let Some((start, _)) = self.frame.take() {
+            let len = (self.len - start - HEADER_LEN) as u32;
+            self.buf[start + HEADER_LEN - 4..start + HEADER_LEN]
+                .copy_from_slice(&len.to_be_bytes());
+        }
+    }
+
+    fn write_out(&mut self, out: EmergencyOut, deadline: Instant) -> bool
+    {
+        self.finish_frame();
+
+        let written = write_until(out, &self.buf[..self.len], deadline);
+        self.written += written;
+        let ok = written == self.len;
+        self.len = 0;
+        ok
+    }
 }
 
 
-pub(crate) fn init() -> Option<TcpListener>
+// Length of a frame holding one record with a payload of data_len bytes,
+// which the emergency flush's scratch has to take
+pub(crate) fn emergency_frame_len(data_len: usize) -> usize
 {
-    let mut listener: Option<TcpListener> = None;
-    // random port to minimize risk for conflicts
-    for port in 61455u16..u16::max_value() {
-        let addr = SocketAddr::new(
-            IpAddr::V6(Ipv6Addr::new(0, 0, 0, 0, 0, 0, 0, 0)), port);
+    HEADER_LEN + RECORD_PREFIX_LEN + MAX_TRACEPOINT_NAME_LEN + TIMESTAMP_LEN +
+        data_len
+}
 
-        if let Ok(l) = TcpListener::bind(&addr) {
-            println!("tracy: TCP: Bound to port number {} on all interfaces.",
-                     port);
-            listener = Some(l);
+
+// Writes buf to the non-blocking fd, waiting for it to become writable again
+// until the deadline. Returns the number of bytes written.
+fn write_until(out: EmergencyOut, buf: &[u8], deadline: Instant) -> usize
+{
+    let (fd, socket) = match out {
+        EmergencyOut::Socket(fd) => (fd, true),
+        EmergencyOut::File(fd) => (fd, false),
+    };
+    let mut written = 0;
+
+    while written < buf.len() {
+        let rest = &buf[written..];
+        let ret = if socket {
+            unsafe {
+                libc::send(fd, rest.as_ptr() as *const c_void, rest.len(),
+                           libc::MSG_NOSIGNAL)
+            }
+        } else {
+            unsafe {
+                libc::write(fd, rest.as_ptr() as *const c_void, rest.len())
+            }
+        };
+        if ret > 0 {
+            written += ret as usize;
+            continue;
+        }
+        if ret == 0 {
+            break;
+        }
+
+        match std::io::Error::last_os_error().kind() {
+            ErrorKind::Interrupted => continue,
+            ErrorKind::WouldBlock => (),
+            _ => break,
+        }
+
+        let now = Instant::now();
+        if now >= deadline {
             break;
         }
+        let timeout = (deadline - now).as_millis().max(1) as c_int;
+        let mut pollfd = libc::pollfd { fd, events: libc::POLLOUT, revents: 0 };
+        unsafe { libc::poll(&mut pollfd, 1, timeout); }
     }
 
-    listener
+    written
 }
 
 
-pub(crate) fn establish_connection(mut ctx: &mut TracerContext)
+// Delta encodes the payload if its tracepoint is in delta mode, see
+// tracy_set_delta. Formatted records and payloads whose encoding might not
+// fit the length field are sent as they are.
+fn delta_encode(deltas: &mut delta::Deltas, element: &BufferElement)
+    -> Option<Range<usize>>
 {
-    match ctx.listener.accept() {
-        Ok((socket, _addr)) => {
-            let temp_con = socket.try_clone().unwrap();
-            ctx.connection = Some(socket);
-            ctx.client_connected.store(true, Ordering::SeqCst);
-            ctx.poll.register(&temp_con,
-                CON_DATA,
-                Ready::readable(),
-                PollOpt::edge())
-                .expect("Panicked at registering socket in poll.");
-        },
-        Err(_) => eprintln!("tracy: Could not establish connection."),
+    if element.kind != RecordKind::Raw {
+        return None;
     }
+
+    if element.data.len() >= MAX_WIRE_DATA_LEN {
+        deltas.skip(element.handle);
+        return None;
+    }
+
+    deltas.encode(element.handle, &element.data)
 }
 
 
-pub(crate) fn receive(mut ctx: &mut TracerContext)
-{
-    let mut reader = BufReader::with_capacity(REC_BUF_SZ,
-                                              ctx.connection.as_mut().unwrap()
-                                              .try_clone().unwrap());
-    let mut header: [u8; 12] = [0; 12];
+// Blob IDs and the chunk prefix, shared by all clients, owned by the
+// tracer-thread
+pub(crate) struct Blobs {
+    next_id: u32,
+    // Serialized frame header and chunk prefix, reused from chunk to chunk
+    prefix: Vec<u8>,
+}
 
-    loop {
-        if let Err(e) = reader.read_exact(&mut header) {
-            if e.kind() != ErrorKind::WouldBlock {
-                ctx.close_and_clean_connection();
-            }
-            return;
+// A blob of tracy_submit_blob, shared by the clients it is sent to. Its
+// budget is released when the last of them is done with it.
+struct SharedBlob {
+    // Lets the client tell the chunks of interleaved blobs apart
+    id: u32,
+    blob: Blob,
+    budget: Arc<Budget>,
+}
+
+impl Drop for SharedBlob {
+    fn drop(&mut self)
+    {
+        self.budget.release(TIMESTAMP_LEN + self.blob.data.len());
+    }
+}
+
+// How far a blob has been sent to one client
+struct PendingBlob {
+    blob: Rc<SharedBlob>,
+    sent: usize,
+}
+
+impl Blobs {
+    pub(crate) fn new() -> Blobs
+    {
+        Blobs {
+            next_id: 0,
+            prefix: Vec::with_capacity(HEADER_LEN + BLOB_CHUNK_PREFIX_LEN +
+                                       2 + MAX_TRACEPOINT_NAME_LEN +
+                                       TIMESTAMP_LEN),
         }
+    }
+}
 
-        // In case of invalid header: Close the connection
-        let (cmd, len) = match check_parse_header(&header) {
-            Ok((a, b)) => (a, b),
-            Err(_) => {
-                ctx.close_and_clean_connection();
-                read_empty(&mut reader, &mut ctx);
-                return;
-            },
-        };
 
-        execute_command(&mut ctx, cmd, len, &mut reader);
+// Queues the blob for every client subscribed to its tracepoint. Without
+// any, it is of no use, just like buffered payloads.
+pub(crate) fn share_blob(ctx: &mut TracerContext, blob: Blob)
+{
+    let shared = Rc::new(SharedBlob {
+        id: ctx.blobs.next_id,
+        blob,
+        budget: Arc::clone(&ctx.budget),
+    });
+    ctx.blobs.next_id = ctx.blobs.next_id.wrapping_add(1);
+
+    for client in ctx.clients.iter_mut().flatten() {
+        if client.subscribed(shared.blob.handle) {
+            client.blobs.push_back(PendingBlob {
+                blob: Rc::clone(&shared),
+                sent: 0,
+            });
+        }
     }
 }
 
 
-fn execute_command(mut ctx: &mut TracerContext,
-                   cmd: Command,
-                   len: u32,
-                   mut reader: &mut BufReader<TcpStream>)
+// Whether send_blob_chunks has something to do. Chunks are only sent while
+// the client's backlog is empty, so blobs never crowd out records there.
+pub(crate) fn blobs_sendable(ctx: &TracerContext) -> bool
 {
-    match cmd {
-        Command::TracepointListRequest => send_tracepoint_list(&mut ctx),
-        Command::TracepointEnableRequest =>
-            set_tracepoints(&mut ctx, len, &mut reader, true),
-        Command::TracepointDisableRequest =>
-            set_tracepoints(&mut ctx, len, &mut reader, false),
-        _ => (), // can never occur, because check_parse_header()
+    ctx.clients.iter().flatten()
+        .any(|client| !client.blobs.is_empty() && client.backlog.is_empty())
+}
+
+
+// How long the tracer-thread may block in poll with nothing else to do
+pub(crate) fn poll_timeout(ctx: &TracerContext) -> Option<Duration>
+{
+    if blobs_sendable(ctx) {
+        Some(Duration::from_millis(0))
+    } else if ctx.clients.iter().flatten()
+        .any(|client| client.shm.is_some() && !client.backlog.is_empty()) {
+        Some(SHM_RETRY_INTERVAL)
+    } else {
+        None
     }
 }
 
 
-fn send_tracepoint_list(mut ctx: &mut TracerContext)
+// Sends one round of blob chunks to every client: the next chunk of each of
+// its pending blobs, or as many as its socket takes. Chunks are at most a
+// flush threshold large, so a record flushed after a round waits for little
+// more than that.
+pub(crate) fn send_blob_chunks(mut ctx: &mut TracerContext)
 {
-    let mut msg: VecDeque<u8> = VecDeque::with_capacity(1024);
+    for slot in 0..ctx.clients.len() {
+        let sendable = match &ctx.clients[slot] {
+            Some(client) =>
+                !client.blobs.is_empty() && client.backlog.is_empty(),
+            None => false,
+        };
 
-    for tracepoint in ctx.tracepoints.keys() {
-        let len = tracepoint.len() as u16;
+        if sendable && send_new_ids(&mut ctx, slot) {
+            send_client_chunks(&mut ctx, slot);
+        }
+    }
+}
 
-        for b in len.to_be_bytes().iter() {
-            msg.push_back(*b);
+
+fn send_client_chunks(ctx: &mut TracerContext, slot: usize)
+{
+    let client = ctx.clients[slot].as_mut().unwrap();
+    let chunk_len = ctx.app_cfg.tuning.queue_size;
+    let flags = client.record_flags & FLAG_TRACEPOINT_IDS;
+    let mut round = client.blobs.len();
+
+    while round > 0 && client.backlog.is_empty() {
+        round -= 1;
+
+        let mut pending = match client.blobs.pop_front() {
+            Some(pending) => pending,
+            None => return,
+        };
+        let shared = Rc::clone(&pending.blob);
+        let data = &shared.blob.data;
+        let end = data.len().min(pending.sent + chunk_len);
+
+        let prefix = &mut ctx.blobs.prefix;
+        prefix.clear();
+        prefix.extend_from_slice(&header(Command::TraceBlob, flags, 0));
+        prefix.extend_from_slice(&shared.id.to_be_bytes());
+        prefix.extend_from_slice(&(data.len() as u32).to_be_bytes());
+        prefix.extend_from_slice(&(pending.sent as u32).to_be_bytes());
+        // The first chunk says what the blob is
+        if pending.sent == 0 {
+            let handle = shared.blob.handle;
+            if flags & FLAG_TRACEPOINT_IDS != 0 {
+                prefix.extend_from_slice(&(handle as u16).to_be_bytes());
+            } else {
+                let name = ctx.tracepoint_names[handle].as_bytes();
+                prefix.extend_from_slice(&(name.len() as u16).to_be_bytes());
+                prefix.extend_from_slice(name);
+            }
+            prefix.extend_from_slice(&shared.blob.timestamp.to_be_bytes());
+        }
+        let len = (prefix.len() - HEADER_LEN + end - pending.sent) as u32;
+        prefix[HEADER_LEN - 4..HEADER_LEN].copy_from_slice(&len.to_be_bytes());
+
+        let chunk = &data[pending.sent..end];
+        let mut iovecs = [
+            iovec(&prefix),
+            iovec(chunk),
+        ];
+        let result = send_iovecs(&mut client.backlog,
+                                 output(&client.stream, &client.shm),
+                                 &mut iovecs, false);
+        if result.is_err() {
+            client.blobs.push_front(pending);
+            ctx.close_client(slot);
+            return;
         }
 
-        for b in tracepoint.as_bytes().iter() {
-            msg.push_back(*b);
+        // Done with the blob once the last chunk is through
+        pending.sent = end;
+        if end < data.len() {
+            client.blobs.push_back(pending);
         }
     }
+}
 
-    push_front_header(&mut msg, Command::TracepointListReply);
 
-    if send_slices(&mut ctx, &msg).is_err() {
-        ctx.close_and_clean_connection();
+// Encoded length of a record with a payload of data_len bytes, see
+// SendScratch::put_record
+fn record_len(element: &BufferElement, data_len: usize, flags: u16, prev: u64)
+    -> usize
+{
+    let ids = flags & FLAG_TRACEPOINT_IDS != 0;
+
+    if flags & FLAG_COMPACT_RECORDS == 0 {
+        return if ids {
+            ID_RECORD_PREFIX_LEN + TIMESTAMP_LEN + data_len
+        } else {
+            RECORD_PREFIX_LEN + element.tracepoint.len() + TIMESTAMP_LEN +
+                data_len
+        };
     }
+
+    let tracepoint = if ids {
+        varint_len(element.handle as u64)
+    } else {
+        varint_len(element.tracepoint.len() as u64) + element.tracepoint.len()
+    };
+
+    tracepoint + varint_len(zigzag(element.timestamp.wrapping_sub(prev))) +
+        varint_len(data_len as u64) + data_len
 }
 
 
-pub(crate) fn send_trace_data(mut ctx: &mut TracerContext)
+// Maps differences of small magnitude to small varints, whatever their sign.
+// Records of different threads are not strictly ordered by time.
+fn zigzag(delta: u64) -> u64
 {
-    let mut que: VecDeque<u8> = VecDeque::with_capacity(QUEUE_TOTAL_SIZE);
-    let mut last_was_complete = true;
+    let delta = delta as i64;
+    ((delta << 1) ^ (delta >> 63)) as u64
+}
 
-    // Take first element of buffer, if one exists
-    while let Some(front) = ctx.buffer.get(0) {
-        // If there's space in the send-buffer, fill it, otherwise append the
-        // header to the front and send the data
-        if front.len() + que.len() + HEADER_LEN < QUEUE_TOTAL_SIZE {
-            encode_append_trace_data(&mut que, ctx.buffer.pop_front().unwrap());
-            last_was_complete = false;
-        } else {
-            push_front_header(&mut que, Command::TracePush);
 
-            if send_slices(ctx, &que).is_err() {
-                ctx.close_and_clean_connection();
+fn varint_len(value: u64) -> usize
+{
+    let bits = 64 - value.leading_zeros() as usize;
+    (bits.max(1) + 6) / 7
+}
+
+
+// LEB128: 7 bits per byte, least significant first, the top bit marks that
+// another byte follows
+fn varint(mut value: u64, buf: &mut [u8; MAX_VARINT_LEN]) -> &[u8]
+{
+    let mut len = 0;
+
+    loop {
+        let byte = (value & 0x7f) as u8;
+        value >>= 7;
+        if value == 0 {
+            buf[len] = byte;
+            len += 1;
+            break;
+        }
+        buf[len] = byte | 0x80;
+        len += 1;
+    }
+
+    &buf[..len]
+}
+
+
+// A piece of a flush: a range of the scratch buffer, or the payload of the
+// buffer element with the given index
+enum SendPart {
+    Scratch(usize, usize),
+    Payload(usize),
+}
+
+// Memory reused from flush to flush, owned by the tracer-thread
+pub(crate) struct SendScratch {
+    bytes: Vec<u8>,
+    parts: Vec<SendPart>,
+    iovecs: Vec<libc::iovec>,
+    // Created when the client first asks for compression
+    compressor: Option<lz4::Compressor>,
+    compressed: Vec<u8>,
+    // Where the delta encoded payload of each buffer element is, see
+    // encode_deltas
+    encoded: Vec<Option<Range<usize>>>,
+}
+
+impl SendScratch {
+    pub(crate) fn new(capacity: usize) -> SendScratch
+    {
+        SendScratch {
+            bytes: Vec::with_capacity(capacity),
+            parts: Vec::with_capacity(256),
+            iovecs: Vec::with_capacity(256),
+            compressor: None,
+            compressed: Vec::new(),
+            encoded: Vec::new(),
+        }
+    }
+
+    fn clear(&mut self)
+    {
+        self.bytes.clear();
+        self.parts.clear();
+    }
+
+    // Appends to the scratch buffer. Bytes directly following the previous
+    // part are sent as one piece with it.
+    fn put(&mut self, data: &[u8])
+    {
+        let start = self.bytes.len();
+        self.bytes.extend_from_slice(data);
+        let end = self.bytes.len();
+
+        if let Some(SendPart::Scratch(_, last_end)) = self.parts.last_mut() {
+            if *last_end == start {
+                *last_end = end;
                 return;
             }
+        }
+
+        self.parts.push(SendPart::Scratch(start, end));
+    }
+
+    // Returns where the frame's header starts, see finish_frame
+    fn begin_frame(&mut self, cmd: Command, flags: u16) -> usize
+    {
+        let start = self.bytes.len();
+        self.put(&header(cmd, flags & !FLAG_COMPRESSED, 0));
+        start
+    }
 
-            que.clear();
-            last_was_complete = true;
+    fn finish_frame(&mut self, start: usize, len: usize, flags: u16)
+    {
+        self.bytes[start + HEADER_LEN - 4..start + HEADER_LEN]
+            .copy_from_slice(&(len as u32).to_be_bytes());
+
+        if flags & FLAG_COMPRESSED != 0 && len >= MIN_COMPRESS_LEN {
+            self.compress_frame(start, len);
         }
     }
 
-    if !last_was_complete {
-        push_front_header(&mut que, Command::TracePush);
+    // Replaces the frame's payload by its compressed form, if that is
+    // smaller. In compression mode, put_record copies the payloads, so the
+    // frame is the contiguous end of the scratch buffer.
+    fn compress_frame(&mut self, start: usize, len: usize)
+    {
+        let body = start + HEADER_LEN;
+        let compressor = self.compressor
+            .get_or_insert_with(lz4::Compressor::new);
+
+        self.compressed.clear();
+        self.compressed.extend_from_slice(&(len as u32).to_be_bytes());
+        compressor.compress(&self.bytes[body..], &mut self.compressed);
+        if self.compressed.len() >= len {
+            return;
+        }
 
-        if send_slices(&mut ctx, &que).is_err() {
-            ctx.close_and_clean_connection();
+        self.bytes.truncate(body);
+        self.bytes.extend_from_slice(&self.compressed);
+        if let Some(SendPart::Scratch(_, end)) = self.parts.last_mut() {
+            *end = self.bytes.len();
         }
+
+        let mut flags = [0u8; 2];
+        flags.copy_from_slice(&self.bytes[start + 4..start + 6]);
+        let flags = u16::from_be_bytes(flags) | FLAG_COMPRESSED;
+        self.bytes[start + 4..start + 6].copy_from_slice(&flags.to_be_bytes());
+        self.bytes[start + HEADER_LEN - 4..start + HEADER_LEN]
+            .copy_from_slice(&(self.compressed.len() as u32).to_be_bytes());
     }
-}
 
+    // encoded replaces the payload, e.g. delta encoded. prev is the
+    // timestamp the record's one is relative to in FLAG_COMPACT_RECORDS mode.
+    fn put_record(&mut self, index: usize, element: &BufferElement,
+                  encoded: Option<&[u8]>, flags: u16, prev: u64)
+    {
+        let ids = flags & FLAG_TRACEPOINT_IDS != 0;
+        let data_len = encoded.map_or(element.data.len(), |data| data.len());
+
+        if flags & FLAG_COMPACT_RECORDS != 0 {
+            let mut buf = [0u8; MAX_VARINT_LEN];
+            if ids {
+                self.put(varint(element.handle as u64, &mut buf));
+            } else {
+                self.put(varint(element.tracepoint.len() as u64, &mut buf));
+                self.put(element.tracepoint.as_bytes());
+            }
+            let delta = zigzag(element.timestamp.wrapping_sub(prev));
+            self.put(varint(delta, &mut buf));
+            self.put(varint(data_len as u64, &mut buf));
+        } else {
+            if ids {
+                self.put(&(element.handle as u16).to_be_bytes());
+            } else {
+                self.put(&(element.tracepoint.len() as u16).to_be_bytes());
+                self.put(element.tracepoint.as_bytes());
+            }
+            self.put(&element.timestamp.to_be_bytes());
+            self.put(&(data_len as u16).to_be_bytes());
+        }
 
-// FIXME: Take care of signaling the application that the client is not
-// accepting data anymore (WouldBlock)
-//
-// Necessary because you can't send a VecDeque (Ringbuffer) with the default
-// write functions
-//
-// In Case of WouldBlock, most likely the client set the window size to 0.
-fn send_slices(ctx: &mut TracerContext, que: &VecDeque<u8>) ->
-    Result<(), std::io::Error>
-{
-    let (first, second) = que.as_slices();
-    let mut send_buf: Vec<u8> = Vec::with_capacity(que.len());
+        // Encoded payloads only live until the next record is encoded
+        if let Some(data) = encoded {
+            self.put(data);
+        } else if flags & FLAG_COMPRESSED != 0 {
+            self.put(&element.data);
+        } else if !element.data.is_empty() {
+            self.parts.push(SendPart::Payload(index));
+        }
+    }
 
-    // We assume that allocating & copying is less expensive than two syscalls
-    send_buf.extend_from_slice(first);
-    send_buf.extend_from_slice(second);
+    // The scratch buffer does not move anymore, so the parts can be turned
+    // into pointers now. Afresh for every client, as sending advances them.
+    fn iovecs(&mut self, buffer: &VecDeque<BufferElement>) -> &mut [libc::iovec]
+    {
+        self.iovecs.clear();
 
-    if let Err(e) = ctx.connection.as_mut().unwrap().write_all(&send_buf) {
-        match e.kind() {
-            ErrorKind::WouldBlock => (),
-            _ => return Err(e),
+        for part in self.parts.iter() {
+            let slice = match part {
+                SendPart::Scratch(start, end) => &self.bytes[*start..*end],
+                SendPart::Payload(index) => &buffer[*index].data[..],
+            };
+
+            self.iovecs.push(iovec(slice));
         }
+
+        &mut self.iovecs[..]
     }
+}
+
+
+fn header(cmd: Command, flags: u16, len: u32) -> [u8; HEADER_LEN]
+{
+    let mut header = [0u8; HEADER_LEN];
 
+    header[..4].copy_from_slice(&MAGIC_NUMB);
+    header[4..6].copy_from_slice(&flags.to_be_bytes());
+    header[6..8].copy_from_slice(&(cmd as u16).to_be_bytes());
+    header[8..].copy_from_slice(&len.to_be_bytes());
+    header
+}
+
+
+// Sends a message consisting of a single frame. Control messages are never
+// dropped, the client could not make sense of the stream without them.
+fn send_message(client: &mut Client, cmd: Command, payload: &[u8]) ->
+    Result<(), std::io::Error>
+{
+    let header = header(cmd, 0, payload.len() as u32);
+    let mut iovecs = [
+        iovec(&header),
+        iovec(payload),
+    ];
+
+    send_iovecs(&mut client.backlog, output(&client.stream, &client.shm),
+                &mut iovecs, false)?;
     Ok(())
 }
 
 
-fn push_front_header(que: &mut VecDeque<u8>, cmd: Command)
+// Where the frames for the client go: over the connection, or into the
+// shared-memory ring once the client has switched to it with SHM_REQUEST
+#[derive(Clone, Copy)]
+enum Output<'a> {
+    Socket(&'a Stream),
+    Shm(&'a shm::ShmRing),
+    // The file sink's, see write_file_sink
+    File(&'a File),
+}
+
+// Takes the fields instead of the client, so the backlog can be borrowed
+// alongside
+fn output<'a>(stream: &'a Stream, ring: &'a Option<shm::ShmRing>)
+    -> Output<'a>
 {
-    // flags are currently unused
-    let flags: u16 = 0;
-    let length = que.len() as u32;
-    for byte in length.to_be_bytes().iter().rev() {
-        que.push_front(*byte);
+    match ring {
+        Some(ring) => Output::Shm(ring),
+        None => Output::Socket(stream),
+    }
+}
+
+
+// Bytes which have been handed to send_iovecs, but which the socket did not
+// take yet, e.g. because the client's receive window is full. Everything
+// sent later is queued behind them, so frames are never interleaved or cut.
+// The rest is sent when the socket signals CON_WRITE.
+pub(crate) struct Backlog {
+    bytes: Vec<u8>,
+    // Bytes before offset have been sent
+    offset: usize,
+    // Above this, droppable data is dropped, see send_iovecs
+    limit: usize,
+}
+
+impl Backlog {
+    pub(crate) fn new(limit: usize) -> Backlog
+    {
+        Backlog {
+            bytes: Vec::new(),
+            offset: 0,
+            limit,
+        }
+    }
+
+    pub(crate) fn is_empty(&self) -> bool
+    {
+        self.offset == self.bytes.len()
     }
 
-    let tmp = cmd as u16;
-    for byte in tmp.to_be_bytes().iter().rev() {
-        que.push_front(*byte);
+    fn len(&self) -> usize
+    {
+        self.bytes.len() - self.offset
     }
 
-    for byte in flags.to_be_bytes().iter().rev() {
-        que.push_front(*byte);
+    pub(crate) fn clear(&mut self)
+    {
+        self.bytes.clear();
+        self.offset = 0;
     }
 
-    for byte in MAGIC_NUMB.iter().rev() {
-        que.push_front(*byte);
+    fn append(&mut self, iovecs: &[libc::iovec])
+    {
+        // Don't let sent bytes pile up in front while the client is slow
+        if self.offset > 0 && self.offset >= self.bytes.len() / 2 {
+            self.bytes.drain(..self.offset);
+            self.offset = 0;
+        }
+
+        for iov in iovecs {
+            self.bytes.extend_from_slice(iov_bytes(iov));
+        }
+    }
+
+    // Sends as much of the backlog as the socket takes
+    fn flush(&mut self, out: Output) -> Result<(), std::io::Error>
+    {
+        let pending = &self.bytes[self.offset..];
+        let mut iovecs = [iovec(pending)];
+
+        // A partially sent iovec has been advanced, a completely sent one
+        // has been skipped
+        if write_iovecs(out, &mut iovecs)? == 0 {
+            self.offset = self.bytes.len() - iovecs[0].iov_len;
+        } else {
+            self.offset = self.bytes.len();
+        }
+
+        if self.is_empty() {
+            self.clear();
+        }
+
+        Ok(())
     }
 }
 
 
-// Consumes ownership of bufelm
-fn encode_append_trace_data(que: &mut VecDeque<u8>, bufelm: BufferElement)
+// Sends the iovecs behind the backlog. Whatever the socket does not take is
+// appended to the backlog. If the backlog already exceeds its limit and
+// droppable is set, nothing is sent at all and false is returned.
+fn send_iovecs(backlog: &mut Backlog, out: Output, iovecs: &mut [libc::iovec],
+               droppable: bool) -> Result<bool, std::io::Error>
 {
-    let tp_len = bufelm.tracepoint.len() as u16;
-    let tp_len_arr = tp_len.to_be_bytes();
-    for byte in tp_len_arr.iter() {
-        que.push_back(*byte);
+    if !backlog.is_empty() {
+        backlog.flush(out)?;
     }
 
-    for letter in bufelm.tracepoint.into_bytes() {
-        que.push_back(letter);
+    if !backlog.is_empty() {
+        if droppable && backlog.len() >= backlog.limit {
+            return Ok(false);
+        }
+
+        backlog.append(iovecs);
+        return Ok(true);
     }
 
-    let timestamp = timestamp_to_u64(bufelm.timestamp).to_be_bytes();
-    for byte in timestamp.iter() {
-        que.push_back(*byte);
+    let unsent = write_iovecs(out, iovecs)?;
+    backlog.append(&iovecs[unsent..]);
+
+    Ok(true)
+}
+
+
+// Writes the iovecs, IOV_MAX at a time, until the socket would block resp.
+// the ring is full. The iovecs are advanced in place on partial writes.
+// Returns the index of the first iovec which has not been sent completely.
+fn write_iovecs(out: Output, iovecs: &mut [libc::iovec]) ->
+    Result<usize, std::io::Error>
+{
+    let (fd, socket) = match out {
+        Output::Socket(stream) => (stream.as_raw_fd(), true),
+        Output::Shm(ring) => return ring.write_iovecs(iovecs),
+        Output::File(file) => (file.as_raw_fd(), false),
+    };
+    let mut first = 0;
+
+    while first < iovecs.len() {
+        if iovecs[first].iov_len == 0 {
+            first += 1;
+            continue;
+        }
+
+        let count = (iovecs.len() - first).min(IOV_MAX);
+        // Unlike writev, sendmsg does not raise SIGPIPE when the client is
+        // gone
+        let ret = if socket {
+            let mut msg: libc::msghdr = unsafe { mem::zeroed() };
+            msg.msg_iov = iovecs[first..].as_mut_ptr();
+            msg.msg_iovlen = count as _;
+            unsafe { libc::sendmsg(fd, &msg, libc::MSG_NOSIGNAL) }
+        } else {
+            unsafe {
+                libc::writev(fd, iovecs[first..].as_ptr(), count as c_int)
+            }
+        };
+
+        if ret < 0 {
+            let e = std::io::Error::last_os_error();
+            match e.kind() {
+                ErrorKind::Interrupted => continue,
+                ErrorKind::WouldBlock => return Ok(first),
+                _ => return Err(e),
+            }
+        }
+        if ret == 0 {
+            return Err(ErrorKind::WriteZero.into());
+        }
+
+        let mut written = ret as usize;
+        while first < iovecs.len() && written >= iovecs[first].iov_len {
+            written -= iovecs[first].iov_len;
+            first += 1;
+        }
+        if written > 0 {
+            advance_iovec(&mut iovecs[first], written);
+        }
     }
 
-    let data_len = bufelm.data.len() as u16;
-    let data_len_arr = data_len.to_be_bytes();
-    for byte in data_len_arr.iter() {
-        que.push_back(*byte);
+    Ok(first)
+}
+
+
+// Switches the rest of the connection to a shared-memory ring, see
+// SHM_REQUEST. The memfd is passed with SCM_RIGHTS, so this only works over
+// the unix socket. Refused with a capacity of 0 otherwise, or if the switch
+// would cut a frame because the backlog has not been sent yet.
+fn setup_shm(ctx: &mut TracerContext, slot: usize, len: u32,
+             reader: &mut BufReader<Stream>)
+{
+    let mut capacity = [0u8; 4];
+    if len != 0 && (len != 4 || reader.read_exact(&mut capacity).is_err()) {
+        ctx.close_client(slot);
+        return;
     }
 
-    // Take by reference with iter, so only one large deallocation at the end
-    for byte in bufelm.data.iter() {
-        que.push_back(*byte);
+    let client = ctx.clients[slot].as_mut().unwrap();
+    let unix = match client.stream {
+        Stream::Unix(_) => true,
+        _ => false,
+    };
+    let ring = if !unix || client.shm.is_some() || !client.backlog.is_empty() {
+        None
+    } else {
+        match shm::ShmRing::new(u32::from_be_bytes(capacity) as usize) {
+            Ok(ring) => Some(ring),
+            Err(e) => {
+                eprintln!("tracy: Could not set up shared memory: {}", e);
+                None
+            },
+        }
+    };
+
+    let ring = match ring {
+        Some(ring) => ring,
+        None => {
+            let refusal = 0u32.to_be_bytes();
+            if send_message(client, Command::ShmReply, &refusal).is_err() {
+                ctx.close_client(slot);
+            }
+            return;
+        },
+    };
+
+    // The last frame on the socket, everything after it goes into the ring
+    let capacity = (ring.capacity() as u32).to_be_bytes();
+    let mut reply = header(Command::ShmReply, 0, capacity.len() as u32).to_vec();
+    reply.extend_from_slice(&capacity);
+    let fd = client.stream.as_raw_fd();
+    if shm::send_with_fd(fd, &reply, Some(ring.fd())).is_err() {
+        ctx.close_client(slot);
+        return;
     }
+
+    client.shm = Some(ring);
 }
 
 
-fn set_tracepoints(ctx: &mut TracerContext, len: u32,
-                       reader: &mut BufReader<TcpStream>,
+// Subscribes the client in slot to the tracepoints, or unsubscribes it
+fn set_tracepoints(ctx: &mut TracerContext, slot: usize, len: u32,
+                       reader: &mut BufReader<Stream>,
                        state: bool)
 {
     let mut i: u32 = 0;
@@ -275,7 +1988,7 @@ fn set_tracepoints(ctx: &mut TracerContext, len: u32,
 
     while i < len {
         if reader.read_exact(&mut name_len_arr).is_err() {
-            ctx.close_and_clean_connection();
+            ctx.close_client(slot);
             return;
         }
 
@@ -285,12 +1998,12 @@ fn set_tracepoints(ctx: &mut TracerContext, len: u32,
         if name_len > MAX_TRACEPOINT_NAME_LEN as u16 {
             eprintln!("tracy: Client violated protocol. Received invalid TP-Name\
                  length: {}", name_len);
-            ctx.close_and_clean_connection();
+            ctx.close_client(slot);
             return;
         }
 
         if reader.read_exact(&mut tp_name_arr[..name_len as usize]).is_err() {
-            ctx.close_and_clean_connection();
+            ctx.close_client(slot);
             return;
         }
         i += name_len as u32;
@@ -299,8 +2012,13 @@ fn set_tracepoints(ctx: &mut TracerContext, len: u32,
         tp_name = std::str::from_utf8(&tp_name_arr[..name_len as usize])
             .unwrap_or_default();
 
-        if let Some(val_ref) = ctx.tracepoints.get_mut(tp_name) {
-            val_ref.store(state, Ordering::SeqCst);
+        if let Some(&handle) = ctx.tracepoints.get(tp_name) {
+            ctx.clients[slot].as_mut().unwrap().subscribed[handle] = state;
+            ctx.update_enabled(handle);
+            // The new subscriber has not seen the payloads deltas refer to
+            if state {
+                ctx.deltas.reset();
+            }
         }
 
         tp_name_arr = [0u8; MAX_TRACEPOINT_NAME_LEN];
@@ -310,7 +2028,8 @@ fn set_tracepoints(ctx: &mut TracerContext, len: u32,
 
 // reads the socket empty and throws the data away
 // Closes connection if there's a problem other than WouldBlock
-fn read_empty(reader: &mut BufReader<TcpStream>, ctx: &mut TracerContext)
+fn read_empty(reader: &mut BufReader<Stream>, ctx: &mut TracerContext,
+              slot: usize)
 {
     // TODO: Which size on the stack is acceptable?
     let mut trash: [u8; 64] = [0u8; 64];
@@ -322,7 +2041,7 @@ fn read_empty(reader: &mut BufReader<TcpStream>, ctx: &mut TracerContext)
                 ErrorKind::WouldBlock => return,
                 _ => {
                     eprintln!("tracy: Read error: {}", e);
-                    ctx.close_and_clean_connection();
+                    ctx.close_client(slot);
                     return;
                 },
             },
@@ -331,7 +2050,7 @@ fn read_empty(reader: &mut BufReader<TcpStream>, ctx: &mut TracerContext)
 }
 
 
-fn check_parse_header(header: &[u8; 12]) -> Result<(Command, u32), ()>
+fn check_parse_header(header: &[u8; 12]) -> Result<(Command, u16, u32), ()>
 {
     let mut magic_no: [u8; 4] = [0; 4];
     let mut flags: [u8; 2] = [0; 2];
@@ -370,14 +2089,14 @@ fn check_parse_header(header: &[u8; 12]) -> Result<(Command, u32), ()>
     }
     check_flags(flags)?;
 
-    Ok((cmd, len))
+    Ok((cmd, flags, len))
 }
 
 
-// Flags are currently unused. If they're not all 0, reject request
+// Reject requests with flags this tracer does not know
 fn check_flags(flags: u16) -> Result<(), ()>
 {
-    if flags != 0 {
+    if flags & !KNOWN_FLAGS != 0 {
         eprintln!("Tracy: Received header flags invalid.");
         Err(())
     } else {
@@ -399,6 +2118,28 @@ fn cmd_number_to_enum(cmd: u16) -> Command
             Command::TracepointListReply,
         cmd if cmd == Command::TracePush as u16 => 
             Command::TracePush,
+        cmd if cmd == Command::FormatStringList as u16 =>
+            Command::FormatStringList,
+        cmd if cmd == Command::TracePushFormatted as u16 =>
+            Command::TracePushFormatted,
+        cmd if cmd == Command::ClockCalibration as u16 =>
+            Command::ClockCalibration,
+        cmd if cmd == Command::DropReport as u16 =>
+            Command::DropReport,
+        cmd if cmd == Command::TracepointIdList as u16 =>
+            Command::TracepointIdList,
+        cmd if cmd == Command::TracePushDelta as u16 =>
+            Command::TracePushDelta,
+        cmd if cmd == Command::TraceBlob as u16 =>
+            Command::TraceBlob,
+        cmd if cmd == Command::ShmRequest as u16 =>
+            Command::ShmRequest,
+        cmd if cmd == Command::ShmReply as u16 =>
+            Command::ShmReply,
+        cmd if cmd == Command::FlightRecorderRequest as u16 =>
+            Command::FlightRecorderRequest,
+        cmd if cmd == Command::FlightRecorderEnd as u16 =>
+            Command::FlightRecorderEnd,
         _ => 
             Command::Invalid,
     }
@@ -426,29 +2167,93 @@ fn check_cmd_validity(cmd: &Command, len: u32) -> Result<(), ()>
             } else {
                 Ok(())
             },
+        // Optionally the ring capacity
+        Command::ShmRequest =>
+            if len != 0 && len != 4 {
+                Err(())
+            } else {
+                Ok(())
+            },
+        Command::FlightRecorderRequest =>
+            if len != 0 {
+                Err(())
+            } else {
+                Ok(())
+            },
         // Client is only allowed to give the upper commands
         _ => Err(())
     }
 }
 
 
-fn timestamp_to_u64(time: SystemTime) -> u64
+fn check_magic_number(number: [u8; 4]) -> bool
 {
-    // as_nanos() method is still nightly, so do this workaround
-    match time.duration_since(UNIX_EPOCH) {
-        Ok(n) => {
-            let secs = n.as_secs(); // is already u64
-            let nanos = n.subsec_nanos() as u64;
+    number[0]==MAGIC_NUMB[0] && number[1]==MAGIC_NUMB[1] 
+        && number[2]==MAGIC_NUMB[2] && number[3]==MAGIC_NUMB[3]
+}
 
-            ((secs * 1e9 as u64) + nanos)
-        },
-        Err(_) => 0,
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn zigzag_maps_negative_deltas_to_small_values()
+    {
+        // Records of another thread may be older than the previous one
+        let prev: u64 = 1_000_000;
+        assert_eq!(zigzag(999_999u64.wrapping_sub(prev)), 1);
+        assert_eq!(zigzag(1_000_001u64.wrapping_sub(prev)), 2);
+        assert_eq!(zigzag(0), 0);
+        assert_eq!(zigzag((-64i64) as u64), 127);
+        assert_eq!(zigzag(64), 128);
+        assert_eq!(zigzag(i64::MIN as u64), u64::MAX);
+        assert_eq!(zigzag(i64::MAX as u64), u64::MAX - 1);
     }
-}
 
+    #[test]
+    fn varint_encodes_leb128()
+    {
+        let mut buf = [0u8; MAX_VARINT_LEN];
+
+        assert_eq!(varint(0, &mut buf), &[0x00]);
+        assert_eq!(varint(127, &mut buf), &[0x7f]);
+        assert_eq!(varint(128, &mut buf), &[0x80, 0x01]);
+        assert_eq!(varint(300, &mut buf), &[0xac, 0x02]);
+        assert_eq!(varint(u64::MAX, &mut buf).len(), MAX_VARINT_LEN);
+        assert_eq!(varint(u64::MAX, &mut buf)[MAX_VARINT_LEN - 1], 0x01);
+    }
 
-fn check_magic_number(number: [u8; 4]) -> bool
-{
-    number[0]==MAGIC_NUMB[0] && number[1]==MAGIC_NUMB[1] 
-        && number[2]==MAGIC_NUMB[2] && number[3]==MAGIC_NUMB[3]
+    #[test]
+    fn varint_len_matches_encoding()
+    {
+        let mut buf = [0u8; MAX_VARINT_LEN];
+
+        for shift in 0..64 {
+            for value in [(1u64 << shift) - 1, 1u64 << shift].iter() {
+                assert_eq!(varint_len(*value), varint(*value, &mut buf).len());
+            }
+        }
+        assert_eq!(varint_len(u64::MAX), MAX_VARINT_LEN);
+    }
+
+    #[test]
+    fn compact_record_len_uses_negative_delta()
+    {
+        let element = BufferElement {
+            tracepoint: String::from("tp"),
+            handle: 300,
+            timestamp: 990,
+            kind: RecordKind::Raw,
+            data: vec![0; 5],
+        };
+
+        // name length, name, zigzag(-10) = 19, data length, data
+        assert_eq!(record_len(&element, 5, FLAG_COMPACT_RECORDS, 1000),
+                   1 + 2 + 1 + 1 + 5);
+        // handle 300 takes two bytes
+        assert_eq!(record_len(&element, 5,
+                              FLAG_COMPACT_RECORDS | FLAG_TRACEPOINT_IDS, 1000),
+                   2 + 1 + 1 + 5);
+    }
 }
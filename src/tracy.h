@@ -27,25 +27,53 @@
 #include <stdio.h> /* necessary for size_t */
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h> /* struct iovec */
 
 /* You may change this constant */
 #define TRACY_MAX_SBMTPRNT_LEN 256
 
-/* DO NOT CHANGE these two constants. They can only be changed in lib.rs */
+/* DO NOT CHANGE these constants. They can only be changed in lib.rs.
+ * TRACY_MAX_SUBMIT_LEN is the default, see struct tracy_config. */
 #define TRACY_MAX_TRPT_NAME_LEN 32 /* Excluding terminating 0 */
 #define TRACY_MAX_SUBMIT_LEN = 2048
+#define TRACY_MAX_TRACEPOINTS 4096 /* Handles per tracer */
 
 #define TRACY_MCAST_DEFAULT_ADDR_V4 "225.0.0.1:64042"
 #define TRACY_MCAST_DEFAULT_ADDR_V6 "[ff02::4242:beef:1]:64042"
 
+/* Flags for tracy_init, may be ORed */
+#define TRACY_INIT_RING 0x1 /* Allocation-free submit ring, see tracy_init */
+#define TRACY_INIT_THREAD_RINGS 0x2 /* One submit ring per thread */
+#define TRACY_INIT_CLOCK_MONOTONIC_RAW 0x4 /* Timestamp sources, see tracy_init */
+#define TRACY_INIT_CLOCK_MONOTONIC_COARSE 0x8
+#define TRACY_INIT_CLOCK_COUNTER 0x10
+#define TRACY_INIT_UNIX_SOCKET 0x20 /* Also listen on a unix socket */
+
+/* Overflow policies for tracy_set_budget */
+#define TRACY_OVERFLOW_DROP_NEWEST 0 /* Refuse new payloads (default) */
+#define TRACY_OVERFLOW_DROP_OLDEST 1 /* Discard the oldest buffered payloads */
+#define TRACY_OVERFLOW_BLOCK 2 /* Wait for room, up to a timeout */
+
+/* Sync policies for tracy_open_file_sink */
+#define TRACY_SYNC_NEVER 0 /* Leave writing back to the kernel (default) */
+#define TRACY_SYNC_ROTATE 1 /* fdatasync() each file once it is complete */
+#define TRACY_SYNC_FLUSH 2 /* fdatasync() after every flush */
+
+/* Flags for tracy_submit_batch */
+#define TRACY_BATCH_TIMESTAMP_EACH 0x1 /* Timestamp every record on its own */
+
 
 /*
  * Spawns a new thread, which will administrate the tracing-services. It
  * announces host- and process-name and the port number of a TCP socket via
  * UDP-multicasts over the network. Clients then can connect to the TCP socket.
  *
- * One call to tracy_init creates one thread, and this one thread accepts
- * exactly one TCP connection.
+ * One call to tracy_init creates one thread, and this one thread serves up to
+ * max_clients connections at the same time (see struct tracy_config). Each
+ * client enables tracepoints on its own and only receives their records.
  *
  * Returns an opaque pointer, containing all relevant data for the other
  * interface functions. This pointer and the data it references must not be
@@ -82,8 +110,27 @@
  * If either hostname or process_name are NULL or if announce_interval is 0,
  * init will return NULL and ignore your request.
  *
- * int flags is reserved for later functionality extensions. For this version,
- * you can always set flags to 0.
+ * flags selects optional behavior and may be 0:
+ * 		- TRACY_INIT_RING: Submitted payloads are written directly into a
+ * 			preallocated lock-free ring, which the tracer-thread drains. The
+ * 			submit functions then do not allocate memory. If the ring is full,
+ * 			because the client can not keep up, submitted data is dropped.
+ * 		- TRACY_INIT_THREAD_RINGS: Like TRACY_INIT_RING, but every thread
+ * 			submitting data gets its own ring, created on its first submit.
+ * 			Submitting threads then never contend with each other. Takes
+ * 			precedence over TRACY_INIT_RING.
+ * 		- TRACY_INIT_CLOCK_MONOTONIC_RAW, TRACY_INIT_CLOCK_MONOTONIC_COARSE,
+ * 			TRACY_INIT_CLOCK_COUNTER: Timestamps are taken from the given
+ * 			clock, or from the CPU's cycle counter (x86_64 and aarch64 only,
+ * 			CLOCK_MONOTONIC_RAW elsewhere), instead of the realtime clock.
+ * 			These are cheaper to read and monotonic. The tracer regularly
+ * 			tells the client how to convert them to wall-clock time. Pass at
+ * 			most one of them.
+ * 		- TRACY_INIT_UNIX_SOCKET: Clients on the same host can also connect
+ * 			to the unix socket @tracy-<pid>-<process_name> in the abstract
+ * 			namespace, sparing the TCP/IP stack. The protocol is the same.
+ * 			There, clients can also have the data passed through shared
+ * 			memory, see SHM_REQUEST in the TLV documentation.
  */
 void* tracy_init(const char *hostname,
                   const char *process_name,
@@ -94,6 +141,47 @@ void* tracy_init(const char *hostname,
                   int flags);
 
 
+/*
+ * Parameters of tracy_init_ex(). The first seven fields are the parameters
+ * of tracy_init(). The remaining ones tune the tracer's buffers; 0 selects
+ * the default given in brackets.
+ */
+struct tracy_config {
+	const char *hostname;
+	const char *process_name;
+	unsigned buffer_flush_interval; /* as milliseconds */
+	unsigned announce_interval; /* as milliseconds */
+	const char *announce_iface;
+	const char *announce_mcast_addr;
+	int flags;
+
+	/* Buffered bytes which are sent before the flush interval has passed.
+	 * Also the size of the frames trace data is sent in. [4096] */
+	size_t flush_threshold;
+	/* Longest payload accepted by the submit functions, at most 65535.
+	 * [TRACY_MAX_SUBMIT_LEN] */
+	size_t max_submit_len;
+	size_t recv_buf_size; /* Read buffer for client requests [4096] */
+	size_t poll_events; /* Events handled per wake-up [1024] */
+	size_t ring_size; /* With TRACY_INIT_RING [256 KiB] */
+	size_t thread_ring_size; /* Per thread, TRACY_INIT_THREAD_RINGS [64 KiB] */
+	/* Unsent bytes above which trace data for a slow client is dropped
+	 * [8 MiB] */
+	size_t backlog_limit;
+	size_t max_clients; /* Clients served at the same time [8] */
+};
+
+
+/*
+ * Like tracy_init(), but takes its parameters from config, which allows to
+ * size the tracer's buffers per deployment. Zero-initialize the struct and
+ * set what you need. config is not referenced after the function returns.
+ *
+ * Additionally returns NULL if config is NULL or max_submit_len is too large.
+ */
+void *tracy_init_ex(const struct tracy_config *config);
+
+
 /*
  * Terminates the whole tracer described by *tracy and its thread, 
  * closes all sockets, deallocates all used memory.
@@ -110,6 +198,29 @@ void* tracy_init(const char *hostname,
 void tracy_finit(void *tracer);
 
 
+/*
+ * Limits the memory the tracer takes for payloads which have been submitted,
+ * but not handed to the client's connection yet, to about bytes (timestamps
+ * included). The default is 16 MiB with TRACY_OVERFLOW_DROP_NEWEST.
+ *
+ * policy decides what happens to payloads exceeding the budget:
+ *
+ * TRACY_OVERFLOW_DROP_NEWEST: The submit functions refuse the payload
+ *			right away. tracy_reserve() returns NULL.
+ * TRACY_OVERFLOW_DROP_OLDEST: The payload is accepted, the tracer-thread
+ *			discards the oldest buffered payloads instead.
+ * TRACY_OVERFLOW_BLOCK: The submit functions wait up to block_timeout_ms
+ *			milliseconds for room, then refuse the payload.
+ *
+ * Dropped payloads are counted per tracepoint and reported to the client,
+ * see DROP_REPORT in the TLV documentation.
+ *
+ * Returns 0 on success, -1 if tracer is NULL or policy is unknown.
+ */
+int tracy_set_budget(void *tracer, size_t bytes, int policy,
+                     unsigned block_timeout_ms);
+
+
 /*
  * Register a new tracepoint which can be activated by the client over TCP.
  * Once the tracepoint got activated, tracy_submit() will accept data
@@ -132,6 +243,21 @@ void tracy_finit(void *tracer);
 int tracy_register(void *tracer, const char *tracepoint_name);
 
 
+/*
+ * Registers a tracepoint just like tracy_register(), but returns a handle to
+ * it. The handle can be passed to tracy_submit_h() and tracy_enabled_h(),
+ * which, unlike their string-based counterparts, do not have to copy, check,
+ * lowercase and look up the tracepoint name on every call.
+ *
+ * If the tracepoint has already been registered, its existing handle is
+ * returned.
+ *
+ * Returns a handle >= 0 on success and a negative number in case of failure.
+ * Handles are only valid for the tracer they were registered at.
+ */
+int tracy_register_h(void *tracer, const char *tracepoint_name);
+
+
 /*
  * Tracepoints can be enabled or disabled. Data submitted to the tracer will
  * only be accepted if the tracepoint you're submitting to was enabled.
@@ -151,9 +277,192 @@ int tracy_register(void *tracer, const char *tracepoint_name);
 bool tracy_tracepoint_enabled(void *tracer, const char *tracepoint_name);
 
 
+/*
+ * Like tracy_tracepoint_enabled(), but takes a handle returned by
+ * tracy_register_h(). Returns false for invalid handles.
+ */
+bool tracy_enabled_h(void *tracer, int handle);
+
+
+/*
+ * Sends the payloads of a tracepoint delta encoded: each one as the bytes in
+ * which it differs from the tracepoint's previous one, see TRACE_PUSH_DELTA
+ * in the TLV documentation. Pays off for tracepoints which submit the same
+ * struct over and over, with only a few fields changing.
+ *
+ * Every keyframe_interval-th payload is sent in full, so is a payload whose
+ * length differs from the previous one. A keyframe_interval of 0 switches
+ * delta encoding off again. Only applies to tracy_submit*() and
+ * tracy_reserve*() payloads, not to tracy_submit_fmt*() records.
+ *
+ * Returns 0 on success, -1 if tracer is NULL or handle is invalid.
+ */
+int tracy_set_delta(void *tracer, int handle, unsigned keyframe_interval);
+
+
+/*
+ * Switches the flight recorder on, with room for capacity bytes of records
+ * (tracepoint name, timestamp and payload each). The flight recorder keeps
+ * the latest records of the tracepoints selected with tracy_set_recorded(),
+ * whether a client is connected or not: new records overwrite the oldest
+ * ones. So what happened before a client connected is not lost.
+ *
+ * A client gets the recorder's contents right after connecting, and again
+ * whenever it sends FLIGHT_RECORDER_REQUEST, see the TLV documentation.
+ * Blobs are not recorded.
+ *
+ * A capacity of 0 switches the recorder off and discards its contents.
+ * Returns 0 on success, -1 if tracer is NULL.
+ */
+int tracy_set_flight_recorder(void *tracer, size_t capacity);
+
+
+/*
+ * Selects whether the flight recorder records the tracepoint. While the
+ * recorder is on, a recorded tracepoint is enabled even without a client.
+ *
+ * Returns 0 on success, -1 if tracer is NULL or handle is invalid.
+ */
+int tracy_set_recorded(void *tracer, int handle, bool recorded);
+
+
+/*
+ * Parameters of tracy_open_file_sink(). 0 selects the default given in
+ * brackets.
+ */
+struct tracy_file_sink {
+	const char *path; /* Current file, rotated ones get .1, .2, ... appended */
+	size_t file_size; /* Size beyond which the file is rotated [16 MiB] */
+	unsigned max_files; /* Rotated files kept [4] */
+	int sync; /* TRACY_SYNC_* */
+	bool compress; /* LZ4 compress the frames, see COMPRESSED */
+};
+
+/*
+ * Appends the records of the tracepoints selected with tracy_set_persisted()
+ * to files, whether a client is connected or not, for devices running
+ * without one. The tracer-thread writes the frames a client would receive,
+ * each file starting with the format strings and clock calibration its
+ * records need, so the files can be read like a recorded connection.
+ *
+ * When the current file is full, it is renamed to path.1, path.1 to path.2
+ * and so on; the oldest file is deleted. A file left at path by a previous
+ * run is rotated away the same way. Replaces a file sink opened before.
+ *
+ * The files are opened by the tracer-thread; if that fails, or writing fails
+ * later on, the sink is closed and the reason printed to stderr.
+ * Returns 0 on success, -1 if a parameter is NULL or invalid.
+ */
+int tracy_open_file_sink(void *tracer, const struct tracy_file_sink *sink);
+
+/*
+ * Writes what has been submitted so far and closes the file sink.
+ * Returns 0 on success, -1 if tracer is NULL.
+ */
+int tracy_close_file_sink(void *tracer);
+
+/*
+ * Selects whether the file sink writes the tracepoint. While a file sink is
+ * open, a persisted tracepoint is enabled even without a client.
+ *
+ * Returns 0 on success, -1 if tracer is NULL or handle is invalid.
+ */
+int tracy_set_persisted(void *tracer, int handle, bool persisted);
+
+
+/*
+ * Sends what the tracer has not sent yet to the connected clients and the
+ * file sink right away, from the calling thread. Meant for the last moments
+ * before the process dies: async-signal-safe, so it may be called from a
+ * signal handler. It neither allocates nor takes locks, and gives up after
+ * 200 ms, e.g. if the tracer-thread itself is the one crashing.
+ *
+ * Covers the records buffered by the tracer-thread and, with TRACY_INIT_RING
+ * or TRACY_INIT_THREAD_RINGS, those still in the submit rings. Records still
+ * on their way through the default submit path are lost, so use a ring if
+ * the last records before a crash matter. Clients using shared memory are
+ * not served. Records taken from the rings bypass the flight recorder.
+ *
+ * Returns 0 on success, -1 if tracer is NULL, another flush is running or
+ * the tracer-thread did not let go in time.
+ */
+int tracy_emergency_flush(void *tracer);
+
+/*
+ * Calls tracy_emergency_flush() for the tracer on SIGSEGV, SIGBUS, SIGILL,
+ * SIGFPE and SIGABRT, then passes the signal on to the handler installed
+ * before, so the process still dies, or dumps core, as it would have.
+ * Install your own handlers for these signals before calling this, if any.
+ *
+ * The handler runs on the alternate signal stack if the thread has one, see
+ * sigaltstack(2), which lets it survive stack overflows. Up to 8 tracers are
+ * covered; tracy_finit() removes the tracer again.
+ *
+ * Returns 0 on success, -1 if tracer is NULL, too many tracers are covered
+ * already or the handler could not be installed.
+ */
+int tracy_install_crash_handler(void *tracer);
+
+
+/*
+ * Enable state of a tracer, shared with the tracer-thread. Only to be read,
+ * and only through the accessors below. Each byte is either 0 or 1.
+ */
+struct tracy_flags {
+	unsigned char connected;
+	unsigned char recording; /* Flight recorder or file sink records */
+	unsigned char pad0[2];
+	unsigned int tracer_id; /* Unique per process */
+	unsigned char pad[56];
+	unsigned char enabled[TRACY_MAX_TRACEPOINTS]; /* Indexed by handle */
+} __attribute__((aligned(64)));
+
+/* The tracer handle points to a pointer to its flags */
+static inline const struct tracy_flags *tracy_flags(void *tracer)
+{
+	return *(const struct tracy_flags *const *)tracer;
+}
+
+
+/*
+ * Returns true if a client is connected to the tracer. Inline: does not call
+ * into the library.
+ */
+static inline bool tracy_connected(void *tracer)
+{
+	if (!tracer)
+		return false;
+
+	return __atomic_load_n(&tracy_flags(tracer)->connected, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Same result as tracy_enabled_h(), but inline: a disabled tracepoint costs a
+ * single relaxed load. Use it to guard expensive payload preparation:
+ *
+ *	if (tracy_enabled_fast(tracer, tp_handle))
+ *		tracy_submit_h(tracer, tp_handle, prepare(), len);
+ *
+ * A tracepoint is enabled while any client has it enabled, the flight
+ * recorder records it or the file sink writes it, see tracy_set_recorded()
+ * and tracy_set_persisted().
+ */
+static inline bool tracy_enabled_fast(void *tracer, int handle)
+{
+	if (!tracer || handle < 0 || handle >= TRACY_MAX_TRACEPOINTS)
+		return false;
+
+	return __atomic_load_n(&tracy_flags(tracer)->enabled[handle],
+			__ATOMIC_RELAXED);
+}
+
+
 /*
  * Submits data, referenced by *data, to the tracer-thread, which sends the
- * data to a client, if one is connected and activated the tracepoint. You
+ * data to a client, if one is connected and activated the tracepoint, and
+ * keeps it in the flight recorder resp. the file sink, if these record the
+ * tracepoint. You
  * are only allowed to submit a data amount up to TRACY_MAX_SUBMIT_LEN Bytes.
  *
  * tracy_submit checks if tracepoint_name is a valid 7-Bit-ASCII-String. If
@@ -164,12 +473,14 @@ bool tracy_tracepoint_enabled(void *tracer, const char *tracepoint_name);
  * submit returns as soon as possible without processing data if:
  * 	1. A parameter is NULL
  * 	2. data_len is 0 or larger than TRACY_MAX_SUBMIT_LEN
- *	3. No client is connected
+ *	3. No client is connected and neither the flight recorder nor the
+ *	   file sink records anything
  * 	4. tracepoint_name is not valid ASCII
  *	5. The tracepoint has not been registered, yet
- *	6. The client is connected, but has not activated the tracepoint
+ *	6. Neither a client, the flight recorder nor the file sink has
+ *	   activated the tracepoint
  *
- * If a client enabled the tracepoint, tracy_submit copies the data
+ * If the tracepoint is enabled, tracy_submit copies the data
  * immediately after being called. Therefore, after the function returns, you
  * can call free(data) if you wish.
  *
@@ -191,6 +502,115 @@ void tracy_submit(void *tracer, const char *tracepoint_name,
                   const void *data, size_t data_len);
 
 
+/*
+ * Like tracy_submit(), but takes a handle returned by tracy_register_h()
+ * instead of the tracepoint name. Use this variant in hot paths.
+ *
+ * Requests with invalid handles are ignored.
+ */
+void tracy_submit_h(void *tracer, int handle, const void *data,
+                    size_t data_len);
+
+
+/*
+ * Submits a payload too large for tracy_submit_h(), e.g. a snapshot of
+ * sample data. The tracer-thread sends it in chunks, interleaved with the
+ * other records, so these are not held up until the blob is through. The
+ * client reassembles it, see TRACE_BLOB in the TLV documentation.
+ *
+ * The data is copied and charged to the memory budget (see
+ * tracy_set_budget()) until it has been sent completely. Blobs which are
+ * still being sent when a client disconnects are dropped for that client.
+ * Like records, blobs only go to the clients which enabled the tracepoint.
+ *
+ * Returns 0 if the blob has been accepted, -1 if not: if a parameter is
+ * invalid, the tracepoint is not enabled or the budget is exhausted.
+ */
+int tracy_submit_blob(void *tracer, int handle, const void *data,
+                      size_t data_len);
+
+
+/*
+ * Like tracy_submit(), but the payload is gathered from iovcnt memory areas
+ * described by iov, as known from writev(2). The areas are copied directly
+ * into the tracer's record, so you don't have to assemble e.g. a header and a
+ * body in a buffer of your own first.
+ *
+ * The total length of all areas is checked against TRACY_MAX_SUBMIT_LEN. The
+ * request is ignored if it is 0 or exceeds this limit, or if an area with a
+ * length other than 0 has a NULL base.
+ */
+void tracy_submitv(void *tracer, const char *tracepoint_name,
+                   const struct iovec *iov, int iovcnt);
+
+
+/*
+ * Like tracy_submitv(), but takes a handle returned by tracy_register_h().
+ */
+void tracy_submitv_h(void *tracer, int handle, const struct iovec *iov,
+                     int iovcnt);
+
+
+/* One record of tracy_submit_batch() */
+struct tracy_record {
+	int handle; /* As returned by tracy_register_h() */
+	const void *data;
+	size_t data_len;
+};
+
+/*
+ * Submits n records at once, e.g. a burst of counters. The records may belong
+ * to different tracepoints. Compared to n calls of tracy_submit_h(), the
+ * tracer and the connection are checked only once and the tracer-thread
+ * receives all records in one go.
+ *
+ * Records to invalid handles or disabled tracepoints and records with a
+ * length of 0 or above TRACY_MAX_SUBMIT_LEN are skipped.
+ *
+ * All records get the same timestamp, unless flags contains
+ * TRACY_BATCH_TIMESTAMP_EACH.
+ */
+void tracy_submit_batch(void *tracer, const struct tracy_record *recs,
+                        size_t n, int flags);
+
+
+/*
+ * Reserves data_len bytes for a payload to tracepoint_name and returns a
+ * pointer to them. Write your payload directly to this memory and publish it
+ * with tracy_commit(). This spares copying the payload, which is useful for
+ * large payloads you would otherwise have to serialize into a buffer of your
+ * own first.
+ *
+ * Returns NULL in all cases in which tracy_submit() would ignore the request,
+ * especially if the tracepoint is not enabled. In this case, don't prepare
+ * the payload at all.
+ *
+ * If the tracer was initialized with TRACY_INIT_RING or
+ * TRACY_INIT_THREAD_RINGS, the memory is located directly in the submit ring.
+ * Records behind a reservation are not transmitted before it has been
+ * committed, so commit as soon as possible. With TRACY_INIT_THREAD_RINGS, a
+ * reservation must be committed by the thread which reserved it.
+ *
+ * Every reservation must be committed exactly once. The memory must not be
+ * accessed after the commit.
+ */
+void *tracy_reserve(void *tracer, const char *tracepoint_name,
+                    size_t data_len);
+
+
+/*
+ * Like tracy_reserve(), but takes a handle returned by tracy_register_h().
+ */
+void *tracy_reserve_h(void *tracer, int handle, size_t data_len);
+
+
+/*
+ * Publishes a payload reserved by tracy_reserve() or tracy_reserve_h().
+ * reservation is the pointer returned by them.
+ */
+void tracy_commit(void *tracer, void *reservation);
+
+
 /*
  * A handy wrapper function for tracy_submit.
  * tracy_submit_printf submits a formatted string to a client. The string
@@ -221,6 +641,270 @@ static void tracy_submit_printf(void *tracer, const char *tracepoint_name,
 }
 
 
+/*
+ * Deferred printf
+ *
+ * tracy_submit_printf formats the string on the calling thread, which is
+ * expensive. Deferred printf instead only captures the raw arguments and
+ * leaves the formatting to the client. The format string is registered once
+ * and afterwards only referred to by its ID.
+ *
+ * Use the TRACY_SUBMIT_FMT macro, which registers the format string on its
+ * first use at each call site and skips all work if the tracepoint is not
+ * enabled (see tracy_enabled_fast):
+ *
+ *	TRACY_SUBMIT_FMT(tracer, tp_handle, "temp %d.%02d C at %s", deg, frac, loc);
+ *
+ * The format string has to be a string literal, or at least stay the same
+ * for each call site. The macro caches the format ID per call site and
+ * tracer; a call site used with several tracers in turn registers the
+ * format string again whenever the tracer changes.
+ *
+ * Supported are all conversions of printf except %n, including '*' for width
+ * and precision. Integers and pointers are transmitted as 8 bytes, floating
+ * point numbers as double, strings with their length. Arguments which do not
+ * fit into TRACY_MAX_SBMTPRNT_LEN bytes are cut off.
+ */
+
+/*
+ * Registers a format string and returns its ID, or a negative number on
+ * failure. Registering the same string again returns the same ID.
+ */
+int tracy_register_fmt(void *tracer, const char *fmt);
+
+/*
+ * Submits the arguments encoded by tracy_submit_fmt(). You normally do not
+ * call this function directly.
+ */
+void tracy_submit_fmt_args(void *tracer, int handle, int fmt_id,
+                           const void *args, size_t args_len);
+
+
+static inline size_t tracy_put_u64(unsigned char *buf, size_t pos,
+		size_t cap, uint64_t val)
+{
+	if (pos + 8 > cap)
+		return cap + 1;
+
+	for (int i = 7; i >= 0; i--)
+		buf[pos++] = (unsigned char)(val >> (i * 8));
+
+	return pos;
+}
+
+
+static inline size_t tracy_put_double(unsigned char *buf, size_t pos,
+		size_t cap, double val)
+{
+	uint64_t bits;
+	memcpy(&bits, &val, sizeof(bits));
+
+	return tracy_put_u64(buf, pos, cap, bits);
+}
+
+
+static inline size_t tracy_put_str(unsigned char *buf, size_t pos,
+		size_t cap, const char *str)
+{
+	size_t len;
+
+	if (!str)
+		str = "(null)";
+
+	len = strlen(str);
+	if (pos + 2 > cap)
+		return cap + 1;
+	if (len > cap - pos - 2)
+		len = cap - pos - 2;
+
+	buf[pos++] = (unsigned char)(len >> 8);
+	buf[pos++] = (unsigned char)len;
+	memcpy(buf + pos, str, len);
+
+	return pos + len;
+}
+
+
+/*
+ * Walks the conversions of fmt and appends the matching arguments in the
+ * wire encoding to buf. Stops at the first argument which does not fit.
+ * Returns the new length of buf.
+ */
+static inline size_t tracy_encode_fmt_args(unsigned char *buf, size_t pos,
+		size_t cap, const char *fmt, va_list ap)
+{
+	enum { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_J, LEN_Z, LEN_T,
+		LEN_BIG_L } len;
+	size_t next;
+	const char *p;
+
+	for (p = fmt; *p; p++) {
+		if (*p != '%')
+			continue;
+		if (*++p == '%')
+			continue;
+
+		while (*p && strchr("-+ #0'", *p))
+			p++;
+
+		if (*p == '*') {
+			next = tracy_put_u64(buf, pos, cap, (uint64_t)(int64_t)va_arg(ap, int));
+			if (next > cap)
+				return pos;
+			pos = next;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+			p++;
+
+		if (*p == '.') {
+			p++;
+			if (*p == '*') {
+				next = tracy_put_u64(buf, pos, cap, (uint64_t)(int64_t)va_arg(ap, int));
+				if (next > cap)
+					return pos;
+				pos = next;
+				p++;
+			}
+			while (*p >= '0' && *p <= '9')
+				p++;
+		}
+
+		len = LEN_NONE;
+		switch (*p) {
+		case 'h':
+			len = (p[1] == 'h') ? LEN_HH : LEN_H;
+			p += (len == LEN_HH) ? 2 : 1;
+			break;
+		case 'l':
+			len = (p[1] == 'l') ? LEN_LL : LEN_L;
+			p += (len == LEN_LL) ? 2 : 1;
+			break;
+		case 'j': len = LEN_J; p++; break;
+		case 'z': len = LEN_Z; p++; break;
+		case 't': len = LEN_T; p++; break;
+		case 'L': len = LEN_BIG_L; p++; break;
+		}
+
+		switch (*p) {
+		case 'd': case 'i': {
+			int64_t val;
+			switch (len) {
+			case LEN_L: val = va_arg(ap, long); break;
+			case LEN_LL: val = va_arg(ap, long long); break;
+			case LEN_J: val = va_arg(ap, intmax_t); break;
+			case LEN_Z: val = (int64_t)va_arg(ap, size_t); break;
+			case LEN_T: val = va_arg(ap, ptrdiff_t); break;
+			default: val = va_arg(ap, int); break;
+			}
+			next = tracy_put_u64(buf, pos, cap, (uint64_t)val);
+			break;
+		}
+		case 'u': case 'o': case 'x': case 'X': case 'c': {
+			uint64_t val;
+			switch (len) {
+			case LEN_L: val = va_arg(ap, unsigned long); break;
+			case LEN_LL: val = va_arg(ap, unsigned long long); break;
+			case LEN_J: val = va_arg(ap, uintmax_t); break;
+			case LEN_Z: val = va_arg(ap, size_t); break;
+			case LEN_T: val = (uint64_t)va_arg(ap, ptrdiff_t); break;
+			default: val = va_arg(ap, unsigned int); break;
+			}
+			next = tracy_put_u64(buf, pos, cap, val);
+			break;
+		}
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			if (len == LEN_BIG_L)
+				next = tracy_put_double(buf, pos, cap,
+						(double)va_arg(ap, long double));
+			else
+				next = tracy_put_double(buf, pos, cap, va_arg(ap, double));
+			break;
+		case 's':
+			next = tracy_put_str(buf, pos, cap, va_arg(ap, const char *));
+			break;
+		case 'p':
+			next = tracy_put_u64(buf, pos, cap,
+					(uint64_t)(uintptr_t)va_arg(ap, void *));
+			break;
+		case 'n':
+			(void)va_arg(ap, void *);
+			next = pos;
+			break;
+		default:
+			/* Unknown conversion or end of string */
+			return pos;
+		}
+
+		if (next > cap)
+			return pos;
+		pos = next;
+	}
+
+	return pos;
+}
+
+
+/*
+ * Captures the arguments for the format string registered as fmt_id and
+ * submits them to the tracepoint referred to by handle. fmt has to be the
+ * registered format string. Prefer the TRACY_SUBMIT_FMT macro.
+ */
+static inline void tracy_submit_fmt(void *tracer, int handle, int fmt_id,
+		const char *fmt, ...)
+{
+	unsigned char buffer[TRACY_MAX_SBMTPRNT_LEN];
+	size_t len;
+	va_list ap;
+	if (!tracer || !fmt || fmt_id < 0)
+		return;
+
+	va_start(ap, fmt);
+	len = tracy_encode_fmt_args(buffer, 0, sizeof(buffer), fmt, ap);
+	va_end(ap);
+
+	tracy_submit_fmt_args(tracer, handle, fmt_id, buffer, len);
+}
+
+
+/*
+ * Format ID cache of a TRACY_SUBMIT_FMT call site: the tracer's ID in the
+ * upper half, the format ID plus one in the lower half, 0 while empty. A
+ * single word, so concurrent callers never pair a format ID with the wrong
+ * tracer.
+ */
+static inline int tracy_cached_fmt(void *tracer, unsigned long long *cache,
+		const char *fmt)
+{
+	unsigned long long tracer_id = tracy_flags(tracer)->tracer_id;
+	unsigned long long cached = __atomic_load_n(cache, __ATOMIC_RELAXED);
+	int id;
+
+	if (cached >> 32 == tracer_id && (cached & 0xffffffff) != 0)
+		return (int)(cached & 0xffffffff) - 1;
+
+	id = tracy_register_fmt(tracer, fmt);
+	if (id >= 0)
+		__atomic_store_n(cache, tracer_id << 32 | (unsigned)(id + 1),
+				__ATOMIC_RELAXED);
+
+	return id;
+}
+
+#define TRACY_SUBMIT_FMT(tracer, handle, fmt, ...) \
+	do { \
+		static unsigned long long tracy_fmt_cache_; \
+		void *tracy_tracer_ = (tracer); \
+		if (tracy_enabled_fast(tracy_tracer_, (handle))) { \
+			tracy_submit_fmt(tracy_tracer_, (handle), \
+					tracy_cached_fmt(tracy_tracer_, \
+						&tracy_fmt_cache_, (fmt)), \
+					(fmt), ##__VA_ARGS__); \
+		} \
+	} while (0)
+
+
 /*
  * Short usage example. For more detailed examples see tracy/examples
 
@@ -49,15 +49,20 @@ fn format_json(ctx: &TracerContext) -> String
 {
     let mut announce_interval: u64 = ctx.app_cfg.announce_interval.as_secs();
     announce_interval += ctx.app_cfg.announce_interval.subsec_millis() as u64;
+    // Lets collectors on the same host skip TCP
+    let unix_socket = match (&ctx.unix_listener, &ctx.app_cfg.unix_socket) {
+        (Some(_), Some(name)) => format!(", \"unix_socket\": \"@{}\"", name),
+        _ => String::new(),
+    };
     let s = format!("{{ \"sequence_nr\": {},\
                 \"server_version\": \"{}\", \"protocoll_version\": \"{}\",\
                 \"update_interval_msecs\": {},\
                 \"hostname\": \"{}\", \"process_name\": \"{}\",\
-                \"port\": {}}}",
+                \"port\": {}{}}}",
                 ctx.sequence_no, SERVER_VERSION, PROTOCOLL_VERSION,
                 announce_interval, ctx.app_cfg.hostname,
                 ctx.app_cfg.process_name,
-                ctx.listener.local_addr().unwrap().port());
+                ctx.listener.local_addr().unwrap().port(), unix_socket);
 
     String::from(s)
 }